@@ -46,13 +46,40 @@ This library provides the following functions;
 - qoi_write   -- encode and write a QOI file
 - qoi_encode  -- encode an rgba buffer into a QOI image in memory
 
+For many small images, a qoi_ctx can be reused across calls to avoid the setup
+and allocation of fresh buffers each time;
+- qoi_ctx_init, qoi_ctx_free  -- create and release a reusable context
+- qoi_read_ctx, qoi_decode_ctx, qoi_write_ctx, qoi_encode_ctx
+                              -- same as above, but using the context's buffers
+
+To direct allocations to your own arenas or pools at runtime, pass a
+qoi_allocator to the *_ex variants and to qoi_ctx_init;
+- qoi_read_ex, qoi_decode_ex, qoi_write_ex, qoi_encode_ex
+                              -- same as above, with a custom allocator
+- qoi_free                    -- release a buffer returned by an *_ex function
+- qoi_alloc                   -- allocate memory with an allocator
+- qoi_large_alloc, qoi_large_realloc, qoi_large_free
+                              -- an allocator for very large images, using
+                                 prefaulted or huge page mappings
+
+For very large images that should not be encoded into one contiguous buffer;
+- qoi_encode_chunks           -- encode into a list of fixed size chunks
+- qoi_free_chunks             -- release the chunks
+- qoi_write_fd                -- encode and write to a file descriptor through
+                                 a small ring of buffers
+
 See the function declaration below for the signature and more information.
 
 If you don't want/need the qoi_read and qoi_write functions, you can define
 QOI_NO_STDIO before including this library.
 
+On POSIX systems qoi_write_fd writes to a file descriptor instead. If you don't
+want/need it, you can define QOI_NO_POSIX before including this library.
+
 This library uses malloc() and free(). To supply your own malloc implementation
-you can define QOI_MALLOC and QOI_FREE before including this library.
+you can define QOI_MALLOC and QOI_FREE before including this library. These are
+also used whenever a NULL qoi_allocator is passed. If you define QOI_MALLOC,
+you may also define QOI_REALLOC; otherwise buffers are resized by copying.
 
 This library uses memset() to zero-initialize the index. To supply your own
 implementation you can define QOI_ZEROARR before including this library.
@@ -214,6 +241,8 @@ Header - Public functions */
 #ifndef QOI_H
 #define QOI_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -289,6 +318,399 @@ The returned pixel data should be free()d after use. */
 void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels);
 
 
+/* A qoi_allocator can be supplied to the *_ex functions and to qoi_ctx_init()
+to control where memory comes from. The user pointer is passed through to the
+alloc and free functions unchanged.
+
+The hint passed to alloc tells what the memory is used for:
+	QOI_ALLOC_RESULT  -- the buffer is returned to the caller
+	QOI_ALLOC_TEMP    -- the buffer is freed again before the function returns
+	QOI_ALLOC_CONTEXT -- the buffer is owned by a qoi_ctx until qoi_ctx_free()
+	QOI_ALLOC_CHUNK   -- a fixed size output chunk for qoi_encode_chunks(); an
+	                     allocator may hand these out from a pool
+
+The alloc and free functions belong together: unless both are set, the
+allocator is ignored as a whole, so that memory never crosses from one side to
+the other. The realloc function is optional and only used to resize results
+(see QOI_ENCODE_SHRINK and QOI_ENCODE_GROW). If it is NULL, buffers are resized
+with alloc, memcpy and free.
+
+Passing a NULL allocator uses QOI_MALLOC, QOI_REALLOC and QOI_FREE. */
+
+#define QOI_ALLOC_RESULT  0
+#define QOI_ALLOC_TEMP    1
+#define QOI_ALLOC_CONTEXT 2
+#define QOI_ALLOC_CHUNK   3
+
+typedef struct {
+	void *(*alloc)(void *user, size_t size, int hint);
+	void *(*realloc)(void *user, void *ptr, size_t old_size, size_t new_size);
+	void (*free)(void *user, void *ptr);
+	void *user;
+} qoi_allocator;
+
+
+/* Same as qoi_encode, qoi_decode, qoi_write and qoi_read, but all memory is
+obtained from the given allocator. Buffers returned by qoi_encode_ex and
+qoi_decode_ex (and qoi_read_ex) must be released with qoi_free() using the same
+allocator.
+
+By default, the buffer returned from qoi_encode_ex is sized for the worst case
+of 5 bytes per pixel. The flags for qoi_encode_ex can be used to get a right
+sized buffer instead, which is useful when encoded images are kept around:
+	QOI_ENCODE_SHRINK -- realloc the result to the encoded size at the end
+	QOI_ENCODE_GROW   -- start with a smaller buffer and grow it row by row as
+	                     needed, then shrink it to the encoded size. This never
+	                     reserves the worst case size, at the cost of a few
+	                     reallocations. */
+
+#define QOI_ENCODE_SHRINK 1
+#define QOI_ENCODE_GROW   2
+
+void *qoi_encode_ex(const void *data, const qoi_desc *desc, int *out_len, int flags, const qoi_allocator *allocator);
+void *qoi_decode_ex(const void *data, int size, qoi_desc *desc, int channels, const qoi_allocator *allocator);
+
+#ifndef QOI_NO_STDIO
+int qoi_write_ex(const char *filename, const void *data, const qoi_desc *desc, const qoi_allocator *allocator);
+void *qoi_read_ex(const char *filename, qoi_desc *desc, int channels, const qoi_allocator *allocator);
+#endif /* QOI_NO_STDIO */
+
+
+/* Allocate and release memory with the given allocator, the same way this
+library does internally. Useful for code built on top of this library that
+wants to honor the allocator. */
+
+void *qoi_alloc(size_t size, int hint, const qoi_allocator *allocator);
+void qoi_free(void *ptr, const qoi_allocator *allocator);
+
+
+/* qoi_large_alloc and qoi_large_free can be used as the alloc and free
+functions of a qoi_allocator to reduce the page fault overhead when decoding
+or encoding very large images.
+
+Buffers of at least options->threshold bytes are obtained directly with mmap()
+instead of malloc(). The flags control how the mapping is prepared:
+	QOI_LARGE_HUGEPAGE -- advise the kernel to back the buffer with huge pages
+	QOI_LARGE_POPULATE -- prefault all pages of the buffer up front
+
+Note that QOI_LARGE_POPULATE prefaults the whole worst case buffer when
+encoding, i.e. 5 bytes per pixel. It is most useful for decoding.
+
+The user pointer of the qoi_allocator must point to a qoi_large_options struct
+or be NULL to use QOI_LARGE_THRESHOLD and QOI_LARGE_HUGEPAGE. On platforms
+without mmap() all buffers are obtained with QOI_MALLOC. */
+
+#define QOI_LARGE_HUGEPAGE 1
+#define QOI_LARGE_POPULATE 2
+
+#ifndef QOI_LARGE_THRESHOLD
+	#define QOI_LARGE_THRESHOLD (16 << 20)
+#endif
+
+typedef struct {
+	size_t threshold;
+	int flags;
+} qoi_large_options;
+
+void *qoi_large_alloc(void *user, size_t size, int hint);
+void *qoi_large_realloc(void *user, void *ptr, size_t old_size, size_t new_size);
+void qoi_large_free(void *user, void *ptr);
+
+
+/* Encode raw RGB or RGBA pixels into a chain of chunks of chunk_size bytes
+each, instead of one contiguous buffer. This avoids the need for a single
+worst case allocation for very large images.
+
+Each chunk is allocated with the QOI_ALLOC_CHUNK hint, so that the allocator
+may take them from a pool of chunk_size buffers. The chunk_size must be at
+least 64 bytes.
+
+The function either returns NULL on failure or an array of qoi_chunk structs,
+allocated with the QOI_ALLOC_RESULT hint. out_count is set to the number of
+chunks. Only the last chunk may have a size less than chunk_size. The qoi_chunk
+struct has the same layout as struct iovec on common platforms, so the result
+can be handed to writev() directly.
+
+The chunks and the array should be released with qoi_free_chunks(). */
+
+typedef struct {
+	void *data;
+	size_t size;
+} qoi_chunk;
+
+qoi_chunk *qoi_encode_chunks(const void *data, const qoi_desc *desc, int chunk_size, int *out_count, const qoi_allocator *allocator);
+void qoi_free_chunks(qoi_chunk *chunks, int count, const qoi_allocator *allocator);
+
+
+#if !defined(QOI_NO_POSIX) && (defined(__unix__) || defined(__APPLE__))
+#define QOI_POSIX
+
+/* Encode raw RGB or RGBA pixels into a QOI image and write it to the file
+descriptor fd. The image is encoded into a ring of QOI_WRITE_FD_BUFFERS buffers
+of QOI_WRITE_FD_BUFFER_SIZE bytes each, which are handed to writev() whenever
+all of them are filled. Memory use is therefore independent of the image
+size.
+
+The call is synchronous: encoding stops while writev() runs. On a buffered
+descriptor that is only the copy into the page cache, but with
+QOI_WRITE_DIRECT each writev() waits until the data has reached the disk.
+
+If flags contains QOI_WRITE_DIRECT, the file descriptor is switched to O_DIRECT
+(where supported) while writing, so that large exports do not thrash the page
+cache. The file offset must then be at 0; the bytes after the last whole
+block are written normally. If O_DIRECT can not be used, the data is written
+normally. O_DIRECT is used wherever <fcntl.h> provides it; with glibc this does
+not require _GNU_SOURCE. Writes interrupted by a signal are retried.
+
+The ring is taken from allocator (NULL for the default). The function returns
+0 on failure (invalid parameters, malloc or write failed) or the number of
+bytes written on success. */
+
+#define QOI_WRITE_DIRECT 1
+
+int qoi_write_fd(int fd, const void *data, const qoi_desc *desc, int flags, const qoi_allocator *allocator);
+
+#endif /* QOI_POSIX */
+
+
+/* A qoi_ctx owns an input and an output buffer that are grown as needed and
+kept alive between calls. When en-/decoding many (small) images in a row, the
+same context can be reused, so that no allocation happens once the buffers
+are large enough. A context must not be used by more than one thread at a
+time.
+
+The pointers returned by the *_ctx functions point into the context's buffers.
+They remain valid until the next call with the same context or until
+qoi_ctx_free() is called. They must not be free()d by the caller.
+
+The allocator passed to qoi_ctx_init is copied into the context and used for
+its buffers. It may be NULL. */
+
+typedef struct {
+	unsigned char *in;
+	unsigned char *out;
+	int in_capacity;
+	int out_capacity;
+	qoi_allocator allocator;
+} qoi_ctx;
+
+void qoi_ctx_init(qoi_ctx *ctx, const qoi_allocator *allocator);
+void qoi_ctx_free(qoi_ctx *ctx);
+
+void *qoi_encode_ctx(qoi_ctx *ctx, const void *data, const qoi_desc *desc, int *out_len);
+void *qoi_decode_ctx(qoi_ctx *ctx, const void *data, int size, qoi_desc *desc, int channels);
+
+#ifndef QOI_NO_STDIO
+int qoi_write_ctx(qoi_ctx *ctx, const char *filename, const void *data, const qoi_desc *desc);
+void *qoi_read_ctx(qoi_ctx *ctx, const char *filename, qoi_desc *desc, int channels);
+#endif /* QOI_NO_STDIO */
+
+
+/* Encode an image row by row, for pixels that are produced in strips and never
+held in memory as a whole.
+
+qoi_encoder_begin() writes the header for desc. Each qoi_encoder_rows() call
+encodes the next rows of desc->width pixels. qoi_encoder_end() must be called
+after all desc->height rows have been written. It returns the QOI data,
+allocated with the QOI_ALLOC_RESULT hint, and sets out_len; the data must be
+released with qoi_free(). The output buffer grows as rows are written; with
+QOI_ENCODE_SHRINK in flags, it is shrunk to its final size at the end.
+
+qoi_encoder_begin() and qoi_encoder_rows() return 0 on failure, after which
+the encoder must be released with qoi_encoder_abort(). qoi_encoder_end()
+returns NULL if not all rows were written, and releases the encoder either way.
+
+The state is private to the encoder. The output is identical to that of
+qoi_encode(). */
+
+typedef struct {
+	qoi_desc desc;
+	int rows;
+	int flags;
+	unsigned char *bytes;
+	int len;
+	int capacity;
+	qoi_allocator allocator;
+	unsigned int state[66];
+} qoi_encoder;
+
+int qoi_encoder_begin(qoi_encoder *enc, const qoi_desc *desc, int flags, const qoi_allocator *allocator);
+int qoi_encoder_rows(qoi_encoder *enc, const void *pixels, int rows);
+void *qoi_encoder_end(qoi_encoder *enc, int *out_len);
+void qoi_encoder_abort(qoi_encoder *enc);
+
+
+/* Encode a sequence of frames of the same size, e.g. from a screen recorder,
+where usually only a small part of each frame changes.
+
+The frame is encoded in horizontal stripes of stripe_rows rows (0 for 16).
+Each stripe starts with a QOI_OP_RGBA and only uses index entries that were
+written within the same stripe, so its bytes do not depend on the stripes
+before it. A copy of the previous frame's pixels is kept; if a stripe's pixels
+are unchanged in the next frame, its bytes are copied from the previous output
+instead of being encoded again. The cost of a frame is thus mostly
+proportional to the changed area, plus a compare of every pixel.
+
+The result is a valid QOI image, but slightly larger than that of
+qoi_encode(), and not identical to it. The returned pointer points into the
+encoder's buffers and remains valid until the next call of qoi_frame_encode()
+or qoi_frame_free(). stripes_encoded is set to the number of stripes that
+were actually encoded for the last frame.
+
+qoi_frame_init() returns 0 on failure; the encoder must be released with
+qoi_frame_free() either way. */
+
+typedef struct {
+	qoi_desc desc;
+	int stripe_rows;
+	int stripe_count;
+	int stripes_encoded;
+	int current;
+	int has_frame;
+	unsigned char *pixels;
+	int *offsets;
+	unsigned char *bytes[2];
+	int capacity;
+	qoi_allocator allocator;
+} qoi_frame_encoder;
+
+int qoi_frame_init(qoi_frame_encoder *frame, const qoi_desc *desc, int stripe_rows, const qoi_allocator *allocator);
+void *qoi_frame_encode(qoi_frame_encoder *frame, const void *data, int *out_len);
+void qoi_frame_free(qoi_frame_encoder *frame);
+
+
+#ifndef QOI_NO_STDIO
+
+/* Append rows of pixels to the bottom of an existing QOI file, without
+encoding the existing image again. pixels must hold rows * width * channels
+bytes, with the width and channels from the file header.
+
+The encoder state at the end of the image (the previous pixel, the index and
+an open run) is recovered by scanning the chunks once. The padding, and a
+final QOI_OP_RUN that may still grow, are then overwritten by the new chunks,
+followed by new padding, and the height in the header is updated. The file is
+identical to what qoi_write() would produce for the whole image.
+
+With QOI_APPEND_STATE in flags, the encoder state is also saved next to the
+file, as filename + ".state", and the next append reads it from there instead
+of scanning the file. The state is only used if the file still has the size,
+header and last bytes it was saved for; otherwise the file is scanned.
+
+The file is modified in place. Temporary buffers are taken from allocator
+(NULL for the default). The function returns the new height of the image on
+success or 0 on failure (invalid file, or fopen, malloc or a write failed). */
+
+#define QOI_APPEND_STATE 1
+
+int qoi_append_rows(const char *filename, const void *pixels, int rows, int flags, const qoi_allocator *allocator);
+
+#endif /* QOI_NO_STDIO */
+
+
+/* Crop the rectangle of w * h pixels at x, y out of the QOI image in data and
+return it as a new QOI image with the same channels and colorspace.
+
+The chunks are decoded as a stream and only the pixels inside the rectangle
+are written out, one row at a time, and encoded again right away. Pixels
+above and to the left and right of the rectangle only update the decoder
+state, and decoding stops after the last row of the rectangle. Memory use is
+thus one row of the rectangle plus the output, and the time is proportional
+to the size of the data up to the bottom of the rectangle.
+
+The result is allocated with the QOI_ALLOC_RESULT hint and must be released
+with qoi_free(). The function returns NULL if data is not a valid QOI image,
+if the rectangle is empty or not fully inside the image, or if an allocation
+failed. */
+
+void *qoi_crop(const void *data, int size, int x, int y, int w, int h, int *out_len, const qoi_allocator *allocator);
+
+
+/* Compare the pixels of the two QOI images a and b, e.g. a rendering against
+a golden image.
+
+If the data is byte for byte the same, the images are equal without decoding
+them. Otherwise both are decoded in lockstep, one row at a time, so memory use
+is two rows regardless of the image size. Pixels are compared as RGBA; a
+3-channel image has an alpha of 255 throughout. The colorspace is not
+compared.
+
+The two rows are taken from allocator (NULL for the default). The function
+returns 0 if either image is not valid QOI data or an allocation failed.
+Otherwise it returns 1 and fills result: equal is 1 if the images have the
+same size and pixels. If they have the same size, diff_pixels is the number of
+pixels that differ, first_x, first_y the first one of them in reading order
+and min_x, min_y, max_x, max_y their bounding box (inclusive); all of these
+are -1 (or 0 for diff_pixels) if there is no difference. Images of different
+sizes are not compared pixel by pixel; same_size is 0 then. */
+
+typedef struct {
+	int equal;
+	int same_size;
+	int diff_pixels;
+	int first_x, first_y;
+	int min_x, min_y, max_x, max_y;
+} qoi_compare_result;
+
+int qoi_compare(const void *a, int a_size, const void *b, int b_size, qoi_compare_result *result, const qoi_allocator *allocator);
+
+
+/* A 32 bit checksum of the pixels of an image, for integrity checks. It is
+computed over the RGBA value of each pixel in reading order; 3-channel pixels
+have an alpha of 255. The checksum starts at 0 and is updated for each pixel
+as
+
+	checksum = checksum * QOI_CHECKSUM_MUL + mix(r | g << 8 | b << 16 | a << 24)
+
+modulo 2^32, where mix() is the 32 bit finalizer of MurmurHash3. As this is
+linear in the checksum, a run of n equal pixels is added with two
+multiplications.
+
+qoi_checksum() computes it in a separate pass over the pixels.
+qoi_encode_checksum() and qoi_decode_checksum() work like qoi_encode_ex() and
+qoi_decode_ex() (without flags) and compute the checksum of the source or
+decoded pixels on the side, once per chunk instead of once per pixel. The
+checksum of a decoded image is that of the image as stored, regardless of the
+channels requested.
+
+This is no cryptographic hash: it reliably detects corrupted pixels, not
+deliberate changes. */
+
+#define QOI_CHECKSUM_MUL 0x9e3779b1
+
+unsigned int qoi_checksum(const void *pixels, const qoi_desc *desc);
+void *qoi_encode_checksum(const void *data, const qoi_desc *desc, int *out_len, unsigned int *checksum, const qoi_allocator *allocator);
+void *qoi_decode_checksum(const void *data, int size, qoi_desc *desc, int channels, unsigned int *checksum, const qoi_allocator *allocator);
+
+
+/* Facts about an image that are otherwise found with extra passes over the
+pixels: whether it is fully opaque, the bounding box of the pixels that are
+not fully transparent, and whether it has at most 256 distinct colors (and
+which).
+
+qoi_encode_analyze() and qoi_decode_analyze() work like qoi_encode_ex() and
+qoi_decode_ex() (without flags) and fill analysis on the side, once per chunk
+instead of once per pixel: a run extends the bounding box in one step, and
+only chunks that can introduce a color (all but QOI_OP_INDEX and QOI_OP_RUN)
+are looked up in the color set. As with the checksum, a decoded image is
+analyzed as stored, regardless of the channels requested.
+
+opaque is 1 if all pixels have an alpha of 255. min_x, min_y, max_x, max_y
+is the bounding box (inclusive) of the pixels with an alpha above 0, or -1
+for all of them if there are none. color_count is the number of distinct RGBA
+values, or 257 if there are more than 256; up to 256 of them are listed in
+palette in order of appearance. */
+
+typedef struct {
+	int opaque;
+	int min_x, min_y, max_x, max_y;
+	int color_count;
+	unsigned char palette[256][4];
+} qoi_analysis;
+
+void *qoi_encode_analyze(const void *data, const qoi_desc *desc, int *out_len, qoi_analysis *analysis, const qoi_allocator *allocator);
+void *qoi_decode_analyze(const void *data, int size, qoi_desc *desc, int channels, qoi_analysis *analysis, const qoi_allocator *allocator);
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -302,14 +724,38 @@ Implementation */
 #include <stdlib.h>
 #include <string.h>
 
+/* The ring of buffers used by qoi_write_fd. The buffer size must be a multiple
+of 4096 for QOI_WRITE_DIRECT. qoi_write uses a single buffer of this size. */
+#ifndef QOI_WRITE_FD_BUFFERS
+	#define QOI_WRITE_FD_BUFFERS 4
+#endif
+#ifndef QOI_WRITE_FD_BUFFER_SIZE
+	#define QOI_WRITE_FD_BUFFER_SIZE (64 * 1024)
+#endif
+
+#if defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__)
+	#include <sys/mman.h>
+	/* MAP_ANONYMOUS is not exposed in strict ANSI mode */
+	#if defined(MAP_ANONYMOUS)
+		#define QOI_HAVE_MMAP
+	#endif
+#endif
+
 #ifndef QOI_MALLOC
-	#define QOI_MALLOC(sz) malloc(sz)
-	#define QOI_FREE(p)    free(p)
+	#define QOI_MALLOC(sz)      malloc(sz)
+	#define QOI_REALLOC(p, sz)  realloc(p, sz)
+	#define QOI_FREE(p)         free(p)
 #endif
 #ifndef QOI_ZEROARR
 	#define QOI_ZEROARR(a) memset((a),0,sizeof(a))
 #endif
 
+/* SSE2 is used where it is always available, unless QOI_NO_SIMD is defined */
+#if !defined(QOI_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#include <emmintrin.h>
+	#define QOI_SSE2
+#endif
+
 #define QOI_OP_INDEX  0x00 /* 00xxxxxx */
 #define QOI_OP_DIFF   0x40 /* 01xxxxxx */
 #define QOI_OP_LUMA   0x80 /* 10xxxxxx */
@@ -353,270 +799,1895 @@ static unsigned int qoi_read_32(const unsigned char *bytes, int *p) {
 	return a << 24 | b << 16 | c << 8 | d;
 }
 
-void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len) {
-	int i, max_size, p, run;
-	int px_len, px_end, px_pos, channels;
-	unsigned char *bytes;
-	const unsigned char *pixels;
-	qoi_rgba_t index[64];
-	qoi_rgba_t px, px_prev;
+/* Returns 1 if memory has to come from QOI_MALLOC instead of the allocator */
+static int qoi_alloc_default(const qoi_allocator *allocator) {
+	return allocator == NULL || allocator->alloc == NULL || allocator->free == NULL;
+}
 
-	if (
-		data == NULL || out_len == NULL || desc == NULL ||
-		desc->width == 0 || desc->height == 0 ||
-		desc->channels < 3 || desc->channels > 4 ||
-		desc->colorspace > 1 ||
-		desc->height >= QOI_PIXELS_MAX / desc->width
-	) {
-		return NULL;
+void *qoi_alloc(size_t size, int hint, const qoi_allocator *allocator) {
+	if (qoi_alloc_default(allocator)) {
+		return QOI_MALLOC(size);
 	}
+	return allocator->alloc(allocator->user, size, hint);
+}
 
-	max_size =
-		desc->width * desc->height * (desc->channels + 1) +
-		QOI_HEADER_SIZE + sizeof(qoi_padding);
-
-	p = 0;
-	bytes = (unsigned char *) QOI_MALLOC(max_size);
-	if (!bytes) {
-		return NULL;
+void qoi_free(void *ptr, const qoi_allocator *allocator) {
+	if (ptr == NULL) {
+		return;
 	}
+	if (qoi_alloc_default(allocator)) {
+		QOI_FREE(ptr);
+	}
+	else {
+		allocator->free(allocator->user, ptr);
+	}
+}
 
-	qoi_write_32(bytes, &p, QOI_MAGIC);
-	qoi_write_32(bytes, &p, desc->width);
-	qoi_write_32(bytes, &p, desc->height);
-	bytes[p++] = desc->channels;
-	bytes[p++] = desc->colorspace;
-
-
-	pixels = (const unsigned char *)data;
-
-	QOI_ZEROARR(index);
-
-	run = 0;
-	px_prev.rgba.r = 0;
-	px_prev.rgba.g = 0;
-	px_prev.rgba.b = 0;
-	px_prev.rgba.a = 255;
-	px = px_prev;
+/* Resize a buffer, keeping its contents up to the smaller of both sizes. On
+failure NULL is returned and the old buffer is left untouched. */
+static void *qoi_realloc(const qoi_allocator *allocator, void *ptr, size_t old_size, size_t new_size, int hint) {
+	void *resized;
 
-	px_len = desc->width * desc->height * desc->channels;
-	px_end = px_len - desc->channels;
-	channels = desc->channels;
+	if (qoi_alloc_default(allocator)) {
+		#ifdef QOI_REALLOC
+			return QOI_REALLOC(ptr, new_size);
+		#endif
+	}
+	else if (allocator->realloc != NULL) {
+		return allocator->realloc(allocator->user, ptr, old_size, new_size);
+	}
 
-	for (px_pos = 0; px_pos < px_len; px_pos += channels) {
-		px.rgba.r = pixels[px_pos + 0];
-		px.rgba.g = pixels[px_pos + 1];
-		px.rgba.b = pixels[px_pos + 2];
+	resized = qoi_alloc(new_size, hint, allocator);
+	if (resized) {
+		memcpy(resized, ptr, old_size < new_size ? old_size : new_size);
+		qoi_free(ptr, allocator);
+	}
+	return resized;
+}
 
-		if (channels == 4) {
-			px.rgba.a = pixels[px_pos + 3];
-		}
+/* Every buffer from qoi_large_alloc is preceded by this header, so that
+qoi_large_free knows how it was obtained. The header is padded to 64 bytes to
+keep the returned pointer aligned to a cache line. */
+typedef union {
+	struct {
+		size_t size;
+		int mapped;
+	} info;
+	unsigned char align[64];
+} qoi_large_header_t;
+
+void *qoi_large_alloc(void *user, size_t size, int hint) {
+	const qoi_large_options *options = (const qoi_large_options *)user;
+	size_t threshold = options ? options->threshold : QOI_LARGE_THRESHOLD;
+	int flags = options ? options->flags : QOI_LARGE_HUGEPAGE;
+	qoi_large_header_t *header;
+	size_t total = size + sizeof(qoi_large_header_t);
+	(void)hint;
+
+	if (total < size) {
+		return NULL;
+	}
 
-		if (px.v == px_prev.v) {
-			run++;
-			if (run == 62 || px_pos == px_end) {
-				bytes[p++] = QOI_OP_RUN | (run - 1);
-				run = 0;
-			}
+	#ifdef QOI_HAVE_MMAP
+	if (size >= threshold) {
+		int map_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+		int populate = (flags & QOI_LARGE_POPULATE);
+		unsigned char *map;
+
+		/* With huge pages, population has to wait until after madvise(),
+		otherwise all pages would be faulted in as normal pages first */
+		#ifdef MAP_POPULATE
+		if (populate && !(flags & QOI_LARGE_HUGEPAGE)) {
+			map_flags |= MAP_POPULATE;
+			populate = 0;
 		}
-		else {
-			int index_pos;
-
-			if (run > 0) {
-				bytes[p++] = QOI_OP_RUN | (run - 1);
-				run = 0;
-			}
+		#endif
 
-			index_pos = QOI_COLOR_HASH(px) % 64;
-
-			if (index[index_pos].v == px.v) {
-				bytes[p++] = QOI_OP_INDEX | index_pos;
+		map = (unsigned char *)mmap(NULL, total, PROT_READ | PROT_WRITE, map_flags, -1, 0);
+		if (map != MAP_FAILED) {
+			#ifdef MADV_HUGEPAGE
+			if (flags & QOI_LARGE_HUGEPAGE) {
+				madvise(map, total, MADV_HUGEPAGE);
 			}
-			else {
-				index[index_pos] = px;
-
-				if (px.rgba.a == px_prev.rgba.a) {
-					signed char vr = px.rgba.r - px_prev.rgba.r;
-					signed char vg = px.rgba.g - px_prev.rgba.g;
-					signed char vb = px.rgba.b - px_prev.rgba.b;
-
-					signed char vg_r = vr - vg;
-					signed char vg_b = vb - vg;
-
-					if (
-						vr > -3 && vr < 2 &&
-						vg > -3 && vg < 2 &&
-						vb > -3 && vb < 2
-					) {
-						bytes[p++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
-					}
-					else if (
-						vg_r >  -9 && vg_r <  8 &&
-						vg   > -33 && vg   < 32 &&
-						vg_b >  -9 && vg_b <  8
-					) {
-						bytes[p++] = QOI_OP_LUMA     | (vg   + 32);
-						bytes[p++] = (vg_r + 8) << 4 | (vg_b +  8);
-					}
-					else {
-						bytes[p++] = QOI_OP_RGB;
-						bytes[p++] = px.rgba.r;
-						bytes[p++] = px.rgba.g;
-						bytes[p++] = px.rgba.b;
-					}
+			#endif
+			if (populate) {
+				#ifdef MADV_POPULATE_WRITE
+				if (madvise(map, total, MADV_POPULATE_WRITE) == 0) {
+					populate = 0;
 				}
-				else {
-					bytes[p++] = QOI_OP_RGBA;
-					bytes[p++] = px.rgba.r;
-					bytes[p++] = px.rgba.g;
-					bytes[p++] = px.rgba.b;
-					bytes[p++] = px.rgba.a;
+				#endif
+				if (populate) {
+					size_t i;
+					for (i = 0; i < total; i += 4096) {
+						map[i] = 0;
+					}
 				}
 			}
+			header = (qoi_large_header_t *)map;
+			header->info.size = total;
+			header->info.mapped = 1;
+			return header + 1;
 		}
-		px_prev = px;
 	}
+	#else
+	(void)threshold;
+	(void)flags;
+	#endif
 
-	for (i = 0; i < (int)sizeof(qoi_padding); i++) {
-		bytes[p++] = qoi_padding[i];
+	header = (qoi_large_header_t *) QOI_MALLOC(total);
+	if (!header) {
+		return NULL;
 	}
-
-	*out_len = p;
-	return bytes;
+	header->info.size = total;
+	header->info.mapped = 0;
+	return header + 1;
 }
 
-void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
-	const unsigned char *bytes;
-	unsigned int header_magic;
-	unsigned char *pixels;
-	qoi_rgba_t index[64];
-	qoi_rgba_t px;
-	int px_len, chunks_len, px_pos;
-	int p = 0, run = 0;
+void *qoi_large_realloc(void *user, void *ptr, size_t old_size, size_t new_size) {
+	qoi_large_header_t *header;
+	void *resized;
 
-	if (
-		data == NULL || desc == NULL ||
-		(channels != 0 && channels != 3 && channels != 4) ||
-		size < QOI_HEADER_SIZE + (int)sizeof(qoi_padding)
-	) {
-		return NULL;
+	if (ptr == NULL) {
+		return qoi_large_alloc(user, new_size, QOI_ALLOC_RESULT);
 	}
 
-	bytes = (const unsigned char *)data;
-
-	header_magic = qoi_read_32(bytes, &p);
-	desc->width = qoi_read_32(bytes, &p);
-	desc->height = qoi_read_32(bytes, &p);
-	desc->channels = bytes[p++];
-	desc->colorspace = bytes[p++];
+	header = (qoi_large_header_t *)ptr - 1;
+	#ifdef QOI_HAVE_MMAP
+	if (header->info.mapped) {
+		/* Shrink mappings in place by unmapping the pages past the new end */
+		size_t page = 4096;
+		size_t keep = (new_size + sizeof(qoi_large_header_t) + page - 1) & ~(page - 1);
+		if (keep <= header->info.size) {
+			if (
+				keep < header->info.size &&
+				munmap((unsigned char *)header + keep, header->info.size - keep) == 0
+			) {
+				header->info.size = keep;
+			}
+			return ptr;
+		}
+	}
+	else
+	#endif
+	{
+		#ifdef QOI_REALLOC
+		header = (qoi_large_header_t *) QOI_REALLOC(header, new_size + sizeof(qoi_large_header_t));
+		if (!header) {
+			return NULL;
+		}
+		header->info.size = new_size + sizeof(qoi_large_header_t);
+		return header + 1;
+		#endif
+	}
 
-	if (
-		desc->width == 0 || desc->height == 0 ||
-		desc->channels < 3 || desc->channels > 4 ||
-		desc->colorspace > 1 ||
-		header_magic != QOI_MAGIC ||
-		desc->height >= QOI_PIXELS_MAX / desc->width
-	) {
-		return NULL;
+	resized = qoi_large_alloc(user, new_size, QOI_ALLOC_RESULT);
+	if (resized) {
+		memcpy(resized, ptr, old_size < new_size ? old_size : new_size);
+		qoi_large_free(user, ptr);
 	}
+	return resized;
+}
 
-	if (channels == 0) {
-		channels = desc->channels;
+void qoi_large_free(void *user, void *ptr) {
+	qoi_large_header_t *header;
+	(void)user;
+
+	if (ptr == NULL) {
+		return;
 	}
 
-	px_len = desc->width * desc->height * channels;
-	pixels = (unsigned char *) QOI_MALLOC(px_len);
-	if (!pixels) {
-		return NULL;
+	header = (qoi_large_header_t *)ptr - 1;
+	#ifdef QOI_HAVE_MMAP
+	if (header->info.mapped) {
+		munmap(header, header->info.size);
+		return;
 	}
+	#endif
+	QOI_FREE(header);
+}
 
-	QOI_ZEROARR(index);
-	px.rgba.r = 0;
-	px.rgba.g = 0;
-	px.rgba.b = 0;
-	px.rgba.a = 255;
+static int qoi_valid_desc(const qoi_desc *desc) {
+	return
+		desc->width != 0 && desc->height != 0 &&
+		desc->channels >= 3 && desc->channels <= 4 &&
+		desc->colorspace <= 1 &&
+		desc->height < QOI_PIXELS_MAX / desc->width;
+}
 
-	chunks_len = size - (int)sizeof(qoi_padding);
-	for (px_pos = 0; px_pos < px_len; px_pos += channels) {
-		if (run > 0) {
-			run--;
-		}
-		else if (p < chunks_len) {
-			int b1 = bytes[p++];
+static int qoi_encode_max_size(const qoi_desc *desc) {
+	return
+		desc->width * desc->height * (desc->channels + 1) +
+		QOI_HEADER_SIZE + sizeof(qoi_padding);
+}
 
-			if (b1 == QOI_OP_RGB) {
-				px.rgba.r = bytes[p++];
-				px.rgba.g = bytes[p++];
-				px.rgba.b = bytes[p++];
-			}
-			else if (b1 == QOI_OP_RGBA) {
-				px.rgba.r = bytes[p++];
-				px.rgba.g = bytes[p++];
-				px.rgba.b = bytes[p++];
-				px.rgba.a = bytes[p++];
-			}
-			else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
-				px = index[b1];
-			}
-			else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
-				px.rgba.r += ((b1 >> 4) & 0x03) - 2;
-				px.rgba.g += ((b1 >> 2) & 0x03) - 2;
-				px.rgba.b += ( b1       & 0x03) - 2;
-			}
-			else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
-				int b2 = bytes[p++];
-				int vg = (b1 & 0x3f) - 32;
-				px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
-				px.rgba.g += vg;
-				px.rgba.b += vg - 8 +  (b2       & 0x0f);
-			}
-			else if ((b1 & QOI_MASK_2) == QOI_OP_RUN) {
-				run = (b1 & 0x3f);
-			}
+/* The running checksum and the factors to add a run of n equal pixels to it:
+QOI_CHECKSUM_MUL^n and the sum of QOI_CHECKSUM_MUL^i for i < n. */
+typedef struct {
+	unsigned int sum;
+	unsigned int pow[63];
+	unsigned int geo[63];
+} qoi_checksum_t;
+
+static void qoi_checksum_init(qoi_checksum_t *checksum) {
+	int n;
+
+	checksum->sum = 0;
+	checksum->pow[0] = 1;
+	checksum->geo[0] = 0;
+	for (n = 1; n < 63; n++) {
+		checksum->pow[n] = checksum->pow[n - 1] * QOI_CHECKSUM_MUL;
+		checksum->geo[n] = checksum->geo[n - 1] * QOI_CHECKSUM_MUL + 1;
+	}
+}
 
-			index[QOI_COLOR_HASH(px) % 64] = px;
-		}
+/* Add n (1 to 62) pixels of the value px */
+static void qoi_checksum_run(qoi_checksum_t *checksum, qoi_rgba_t px, int n) {
+	unsigned int v =
+		(unsigned int)px.rgba.r | (unsigned int)px.rgba.g << 8 |
+		(unsigned int)px.rgba.b << 16 | (unsigned int)px.rgba.a << 24;
 
-		pixels[px_pos + 0] = px.rgba.r;
-		pixels[px_pos + 1] = px.rgba.g;
-		pixels[px_pos + 2] = px.rgba.b;
-		
-		if (channels == 4) {
-			pixels[px_pos + 3] = px.rgba.a;
-		}
-	}
+	v ^= v >> 16;
+	v *= 0x85ebca6b;
+	v ^= v >> 13;
+	v *= 0xc2b2ae35;
+	v ^= v >> 16;
 
-	return pixels;
+	checksum->sum = checksum->sum * checksum->pow[n] + v * checksum->geo[n];
 }
 
-#ifndef QOI_NO_STDIO
-#include <stdio.h>
+/* The state for filling a qoi_analysis: the position of the next pixel and a
+hash set of the colors seen so far. 0 marks an empty slot; the color 0 is
+tracked with has_zero instead. */
+typedef struct {
+	qoi_analysis *out;
+	int width;
+	int x, y;
+	int has_zero;
+	unsigned int colors[512];
+} qoi_analysis_t;
+
+static void qoi_analysis_init(qoi_analysis_t *analysis, qoi_analysis *out, int width) {
+	analysis->out = out;
+	analysis->width = width;
+	analysis->x = 0;
+	analysis->y = 0;
+	analysis->has_zero = 0;
+	QOI_ZEROARR(analysis->colors);
+
+	out->opaque = 1;
+	out->min_x = out->min_y = -1;
+	out->max_x = out->max_y = -1;
+	out->color_count = 0;
+}
 
-int qoi_write(const char *filename, const void *data, const qoi_desc *desc) {
-	FILE *f = fopen(filename, "wb");
-	int size, err;
-	void *encoded;
+static void qoi_analysis_color(qoi_analysis_t *analysis, qoi_rgba_t px) {
+	qoi_analysis *out = analysis->out;
+	unsigned int v =
+		(unsigned int)px.rgba.r | (unsigned int)px.rgba.g << 8 |
+		(unsigned int)px.rgba.b << 16 | (unsigned int)px.rgba.a << 24;
+	int slot = 0;
 
-	if (!f) {
-		return 0;
+	if (v == 0) {
+		if (analysis->has_zero) {
+			return;
+		}
 	}
-
-	encoded = qoi_encode(data, desc, &size);
-	if (!encoded) {
-		fclose(f);
-		return 0;
+	else {
+		slot = ((v * 0x9e3779b1) >> 23) & 511;
+		while (analysis->colors[slot] != 0) {
+			if (analysis->colors[slot] == v) {
+				return;
+			}
+			slot = (slot + 1) & 511;
+		}
 	}
 
-	fwrite(encoded, 1, size, f);
-	fflush(f);
-	err = ferror(f);
-	fclose(f);
-
-	QOI_FREE(encoded);
-	return err ? 0 : size;
+	/* With at most 256 of 512 slots used, there always is a free one */
+	if (out->color_count == 256) {
+		out->color_count = 257;
+		return;
+	}
+	if (v == 0) {
+		analysis->has_zero = 1;
+	}
+	else {
+		analysis->colors[slot] = v;
+	}
+	out->palette[out->color_count][0] = px.rgba.r;
+	out->palette[out->color_count][1] = px.rgba.g;
+	out->palette[out->color_count][2] = px.rgba.b;
+	out->palette[out->color_count][3] = px.rgba.a;
+	out->color_count++;
 }
 
-void *qoi_read(const char *filename, qoi_desc *desc, int channels) {
+/* Add n pixels of the value px. If seen is set, px is known to have been
+added before. */
+static void qoi_analysis_run(qoi_analysis_t *analysis, qoi_rgba_t px, int n, int seen) {
+	qoi_analysis *out = analysis->out;
+	int width = analysis->width;
+	int last_x = analysis->x + n - 1, last_y = analysis->y;
+	int box_min_x = analysis->x, box_max_x = last_x;
+
+	if (last_x >= width) {
+		/* The run continues in the next row, so it touches both edges */
+		last_y += last_x / width;
+		last_x %= width;
+		box_min_x = 0;
+		box_max_x = width - 1;
+	}
+
+	if (px.rgba.a != 255) {
+		out->opaque = 0;
+	}
+	if (px.rgba.a != 0) {
+		if (out->max_y < 0) {
+			out->min_x = box_min_x;
+			out->max_x = box_max_x;
+			out->min_y = analysis->y;
+		}
+		else {
+			if (box_min_x < out->min_x) {
+				out->min_x = box_min_x;
+			}
+			if (box_max_x > out->max_x) {
+				out->max_x = box_max_x;
+			}
+		}
+		out->max_y = last_y;
+	}
+
+	analysis->x = last_x + 1;
+	analysis->y = last_y;
+	if (analysis->x == width) {
+		analysis->x = 0;
+		analysis->y++;
+	}
+
+	if (!seen && out->color_count <= 256) {
+		qoi_analysis_color(analysis, px);
+	}
+}
+
+/* Optional work done alongside encoding or decoding, once per chunk */
+typedef struct {
+	qoi_checksum_t *checksum;
+	qoi_analysis_t *analysis;
+} qoi_track_t;
+
+static void qoi_track_run(qoi_track_t *track, qoi_rgba_t px, int n, int seen) {
+	if (track->checksum) {
+		qoi_checksum_run(track->checksum, px, n);
+	}
+	if (track->analysis) {
+		qoi_analysis_run(track->analysis, px, n, seen);
+	}
+}
+
+/* The encoder state that is carried from one call of qoi_encode_px() to the
+next. */
+typedef struct {
+	qoi_rgba_t index[64];
+	qoi_rgba_t px_prev;
+	int run;
+} qoi_enc_t;
+
+static void qoi_enc_init(qoi_enc_t *enc) {
+	QOI_ZEROARR(enc->index);
+	enc->px_prev.rgba.r = 0;
+	enc->px_prev.rgba.g = 0;
+	enc->px_prev.rgba.b = 0;
+	enc->px_prev.rgba.a = 255;
+	enc->run = 0;
+}
+
+static int qoi_encode_header(const qoi_desc *desc, unsigned char *bytes) {
+	int p = 0;
+	qoi_write_32(bytes, &p, QOI_MAGIC);
+	qoi_write_32(bytes, &p, desc->width);
+	qoi_write_32(bytes, &p, desc->height);
+	bytes[p++] = desc->channels;
+	bytes[p++] = desc->colorspace;
+	return p;
+}
+
+/* The number of pixels qoi_encode_px() classifies at a time */
+#define QOI_ENC_BLOCK 8
+
+/* The number of bytes qoi_encode_px() may overwrite past the worst case size
+of the pixels it is given; see there */
+#define QOI_ENC_SLACK 4
+
+/* Classify each of the pixels px[1] to px[QOI_ENC_BLOCK] against the one
+before it, for all ops that do not depend on the encoder state. code[i] is
+set to the first byte | the second byte << 8 | the index position << 16 |
+op << 24 of the op that px[i + 1] is written as if it is neither part of a
+run nor found in the index. op is 0 to 3 for QOI_OP_DIFF, QOI_OP_LUMA,
+QOI_OP_RGB and QOI_OP_RGBA. Returns a mask with bit i set if px[i + 1] is
+equal to px[i]; rgb is set to a mask of the pixels written as QOI_OP_RGB.
+
+With SSE2, qoi_enc_write_rgb() writes px[1] to px[QOI_ENC_BLOCK] as
+QOI_OP_RGB. Since the tag comes first, each op is simply the pixel shifted by
+one byte. */
+#ifdef QOI_SSE2
+static unsigned int qoi_enc_classify(const qoi_rgba_t *px, unsigned int *code, unsigned int *rgb) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lo_byte = _mm_set1_epi32(0xff);
+	const __m128i hash_mul = _mm_set_epi16(11, 7, 5, 3, 11, 7, 5, 3);
+	__m128i cur, prev, d, v, dg, l, diff_ok, luma_ok, same_a, op, b0, b1, a, b;
+	__m128 h_lo, h_hi;
+	unsigned int same = 0;
+	int i;
+
+	*rgb = 0;
+	for (i = 0; i < QOI_ENC_BLOCK; i += 4) {
+		cur = _mm_loadu_si128((const __m128i *)(px + i + 1));
+		prev = _mm_loadu_si128((const __m128i *)(px + i));
+		same |= (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(cur, prev))) << i;
+
+		/* r*3 + g*5 and b*7 + a*11 of each pixel, then their sum */
+		h_lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(cur, zero), hash_mul));
+		h_hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(cur, zero), hash_mul));
+		a = _mm_castps_si128(_mm_shuffle_ps(h_lo, h_hi, _MM_SHUFFLE(2, 0, 2, 0)));
+		b = _mm_castps_si128(_mm_shuffle_ps(h_lo, h_hi, _MM_SHUFFLE(3, 1, 3, 1)));
+		a = _mm_and_si128(_mm_add_epi32(a, b), _mm_set1_epi32(63));
+
+		/* The biased deltas vr, vg, vb of QOI_OP_DIFF in bytes 0 to 2 */
+		d = _mm_sub_epi8(cur, prev);
+		v = _mm_add_epi8(d, _mm_set1_epi32(0x00020202));
+		diff_ok = _mm_cmpeq_epi32(_mm_and_si128(v, _mm_set1_epi32(0x00fcfcfc)), zero);
+		same_a = _mm_cmpeq_epi32(_mm_and_si128(d, _mm_set1_epi32((int)0xff000000)), zero);
+
+		/* The biased vg_r, vg and vg_b of QOI_OP_LUMA in bytes 0 to 2 */
+		dg = _mm_and_si128(_mm_srli_epi32(d, 8), lo_byte);
+		l = _mm_sub_epi8(d, _mm_or_si128(dg, _mm_slli_epi32(dg, 16)));
+		l = _mm_add_epi8(l, _mm_set1_epi32(0x00082008));
+		luma_ok = _mm_cmpeq_epi32(_mm_and_si128(l, _mm_set1_epi32(0x00f0c0f0)), zero);
+
+		/* op = same_a ? (diff_ok ? 0 : luma_ok ? 1 : 2) : 3 */
+		op = _mm_andnot_si128(diff_ok, _mm_add_epi32(_mm_set1_epi32(2), luma_ok));
+		op = _mm_or_si128(op, _mm_andnot_si128(same_a, _mm_set1_epi32(3)));
+		diff_ok = _mm_and_si128(diff_ok, same_a);
+		luma_ok = _mm_cmpeq_epi32(op, _mm_set1_epi32(1));
+		*rgb |= (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(op, _mm_set1_epi32(2)))) << i;
+
+		/* The first byte: QOI_OP_RGB or QOI_OP_RGBA unless replaced by
+		QOI_OP_DIFF or QOI_OP_LUMA */
+		b0 = _mm_or_si128(_mm_set1_epi32(QOI_OP_RGB), _mm_srli_epi32(_mm_andnot_si128(same_a, _mm_set1_epi32(-1)), 31));
+		b = _mm_or_si128(
+			_mm_or_si128(_mm_slli_epi32(_mm_and_si128(v, lo_byte), 4), _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(v, 8), lo_byte), 2)),
+			_mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), lo_byte), _mm_set1_epi32(QOI_OP_DIFF))
+		);
+		b0 = _mm_or_si128(_mm_andnot_si128(diff_ok, b0), _mm_and_si128(diff_ok, b));
+		b = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(l, 8), lo_byte), _mm_set1_epi32(QOI_OP_LUMA));
+		b0 = _mm_or_si128(_mm_andnot_si128(luma_ok, b0), _mm_and_si128(luma_ok, b));
+
+		/* The second byte: r unless replaced by the second byte of QOI_OP_LUMA */
+		b = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(l, lo_byte), 4), _mm_and_si128(_mm_srli_epi32(l, 16), lo_byte));
+		b1 = _mm_or_si128(_mm_andnot_si128(luma_ok, _mm_and_si128(cur, lo_byte)), _mm_and_si128(luma_ok, b));
+
+		b0 = _mm_or_si128(_mm_or_si128(b0, _mm_slli_epi32(b1, 8)), _mm_or_si128(_mm_slli_epi32(a, 16), _mm_slli_epi32(op, 24)));
+		_mm_storeu_si128((__m128i *)(code + i), b0);
+	}
+	return same;
+}
+
+/* Returns 1 if all of px[1] to px[QOI_ENC_BLOCK] are equal to px[0] */
+static int qoi_enc_is_run(const qoi_rgba_t *px) {
+	__m128i prev = _mm_set1_epi32((int)px[0].v);
+	__m128i eq = _mm_and_si128(
+		_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(px + 1)), prev),
+		_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(px + 5)), prev)
+	);
+	return _mm_movemask_epi8(eq) == 0xffff;
+}
+
+static void qoi_enc_write_rgb(const qoi_rgba_t *px, unsigned char *bytes) {
+	int i;
+	for (i = 0; i < QOI_ENC_BLOCK; i += 4) {
+		__m128i cur = _mm_loadu_si128((const __m128i *)(px + i + 1));
+		_mm_storeu_si128(
+			(__m128i *)(bytes + i * 4),
+			_mm_or_si128(_mm_slli_epi32(cur, 8), _mm_set1_epi32(QOI_OP_RGB))
+		);
+	}
+}
+#else
+static unsigned int qoi_enc_classify(const qoi_rgba_t *px, unsigned int *code, unsigned int *rgb) {
+	unsigned int same = 0;
+	int i;
+
+	*rgb = 0;
+	for (i = 0; i < QOI_ENC_BLOCK; i++) {
+		/* The deltas are biased so that each range test is a single unsigned
+		compare. The tag of each op is packed into one constant. */
+		qoi_rgba_t cur = px[i + 1], prev = px[i];
+		unsigned int vr = (cur.rgba.r - prev.rgba.r + 2) & 0xff;
+		unsigned int vg = (cur.rgba.g - prev.rgba.g + 2) & 0xff;
+		unsigned int vb = (cur.rgba.b - prev.rgba.b + 2) & 0xff;
+		unsigned int vg_r = (vr - vg + 8) & 0xff;
+		unsigned int vg_b = (vb - vg + 8) & 0xff;
+		unsigned int vg_l = (vg + 30) & 0xff;
+
+		unsigned int not_diff = ((vr | vg | vb) > 3);
+		unsigned int not_luma = ((vg_r | vg_b | vg_l >> 2) > 15);
+		unsigned int op = (not_diff + (not_diff & not_luma)) | ((cur.rgba.a != prev.rgba.a) * 3);
+		unsigned int m_diff = (op != 0) - 1;
+		unsigned int m_luma = (op != 1) - 1;
+
+		unsigned int b0 = ((0xfffe8040 >> (op * 8)) | ((vr << 4 | vg << 2 | vb) & m_diff) | (vg_l & m_luma)) & 0xff;
+		unsigned int b1 = ((vg_r << 4 | vg_b) & m_luma) | (cur.rgba.r & ~m_luma);
+
+		code[i] = b0 | (b1 & 0xff) << 8 | (QOI_COLOR_HASH(cur) % 64) << 16 | op << 24;
+		same |= (unsigned int)(cur.v == prev.v) << i;
+		*rgb |= (unsigned int)(op == 2) << i;
+	}
+	return same;
+}
+
+static int qoi_enc_is_run(const qoi_rgba_t *px) {
+	int i;
+	for (i = 1; i <= QOI_ENC_BLOCK; i++) {
+		if (px[i].v != px[0].v) {
+			return 0;
+		}
+	}
+	return 1;
+}
+#endif
+
+/* Encode px_count pixels into bytes, which must hold at least
+px_count * (channels + 1) + 1 + QOI_ENC_SLACK bytes. A run that is still open
+after the last pixel is kept in the encoder state; it is not yet passed to
+track, if one is given. Returns the number of bytes written; the bytes after
+them, up to the size above, may be overwritten as well.
+
+The pixels are taken QOI_ENC_BLOCK at a time. qoi_enc_classify() looks
+ahead at all of them, so that only runs, the index and writing the bytes are
+left to be done for one pixel after the other. Since all bytes any of the ops
+could need are written, and p only moves past the op's own bytes, the choice
+between QOI_OP_DIFF, QOI_OP_LUMA, QOI_OP_RGB and QOI_OP_RGBA takes no branch;
+on noisy images these branches are unpredictable. */
+static int qoi_encode_px(qoi_enc_t *enc, const unsigned char *pixels, int px_count, int channels, unsigned char *bytes, qoi_track_t *track) {
+	qoi_rgba_t px[QOI_ENC_BLOCK + 1];
+	unsigned int code[QOI_ENC_BLOCK];
+	unsigned int same, rgb;
+	int p, run;
+	int i, n;
+
+	p = 0;
+	run = enc->run;
+	px[0] = enc->px_prev;
+
+	for (; px_count > 0; px_count -= n) {
+		n = px_count < QOI_ENC_BLOCK ? px_count : QOI_ENC_BLOCK;
+		if (channels == 4) {
+			memcpy(px + 1, pixels, n * 4);
+		}
+		else {
+			for (i = 0; i < n; i++) {
+				px[i + 1].rgba.r = pixels[i * 3 + 0];
+				px[i + 1].rgba.g = pixels[i * 3 + 1];
+				px[i + 1].rgba.b = pixels[i * 3 + 2];
+				px[i + 1].rgba.a = px[0].rgba.a;
+			}
+		}
+		pixels += n * channels;
+		for (i = n + 1; i <= QOI_ENC_BLOCK; i++) {
+			px[i] = px[n];
+		}
+
+		/* Most pixels of most images are part of a long run */
+		if (n == QOI_ENC_BLOCK && qoi_enc_is_run(px)) {
+			run += QOI_ENC_BLOCK;
+			if (run >= 62) {
+				bytes[p++] = QOI_OP_RUN | (62 - 1);
+				if (track) {
+					qoi_track_run(track, px[0], 62, 0);
+				}
+				run -= 62;
+			}
+			continue;
+		}
+
+		same = qoi_enc_classify(px, code, &rgb);
+		i = 0;
+
+		/* On noisy images, whole blocks are QOI_OP_RGB. Only the index has
+		to be checked one pixel after the other; the ops before the first
+		index hit are written at once. The rest of the block is handled
+		below. Without SIMD, this is slower than writing them one by one.
+
+		qoi_enc_write_rgb() stores QOI_ENC_BLOCK * 4 bytes regardless of
+		where the index hit is. This is only done for a full block: then
+		at least QOI_ENC_BLOCK pixels are left, whose worst case covers
+		the store. The last, partial block of the pixels given is always
+		written op by op, so the store never reaches past the end of a
+		buffer or sink span. */
+		#ifdef QOI_SSE2
+		if (n == QOI_ENC_BLOCK && rgb == (1u << QOI_ENC_BLOCK) - 1) {
+			if (run > 0) {
+				bytes[p++] = QOI_OP_RUN | (run - 1);
+				if (track) {
+					qoi_track_run(track, px[0], run, 0);
+				}
+				run = 0;
+			}
+			for (; i < n; i++) {
+				int index_pos = (code[i] >> 16) & 63;
+				if (enc->index[index_pos].v == px[i + 1].v) {
+					break;
+				}
+				enc->index[index_pos] = px[i + 1];
+				if (track) {
+					qoi_track_run(track, px[i + 1], 1, 0);
+				}
+			}
+			qoi_enc_write_rgb(px, bytes + p);
+			p += i * 4;
+		}
+		#endif
+
+		for (; i < n; i++) {
+			if (same & (1u << i)) {
+				run++;
+				if (run == 62) {
+					bytes[p++] = QOI_OP_RUN | (run - 1);
+					if (track) {
+						qoi_track_run(track, px[i + 1], run, 0);
+					}
+					run = 0;
+				}
+			}
+			else {
+				int index_pos = (code[i] >> 16) & 63;
+
+				if (run > 0) {
+					bytes[p++] = QOI_OP_RUN | (run - 1);
+					if (track) {
+						qoi_track_run(track, px[i], run, 0);
+					}
+					run = 0;
+				}
+
+				/* Apart from the zeroed initial entries, the index only holds
+				pixels that were already passed to track */
+				if (track) {
+					qoi_track_run(track, px[i + 1], 1, enc->index[index_pos].v == px[i + 1].v && px[i + 1].v != 0);
+				}
+
+				if (enc->index[index_pos].v == px[i + 1].v) {
+					bytes[p++] = QOI_OP_INDEX | index_pos;
+				}
+				else {
+					enc->index[index_pos] = px[i + 1];
+
+					bytes[p + 0] = (unsigned char)code[i];
+					bytes[p + 1] = (unsigned char)(code[i] >> 8);
+					bytes[p + 2] = px[i + 1].rgba.g;
+					bytes[p + 3] = px[i + 1].rgba.b;
+					bytes[p + 4] = px[i + 1].rgba.a;
+					/* The sizes of the four ops, packed like their tags */
+					p += (0x05040201 >> (code[i] >> 24) * 8) & 0xff;
+				}
+			}
+		}
+		px[0] = px[n];
+	}
+
+	enc->run = run;
+	enc->px_prev = px[0];
+	return p;
+}
+
+/* Close an open run and write the end marker. This writes at most
+1 + sizeof(qoi_padding) bytes. */
+static int qoi_encode_end(qoi_enc_t *enc, unsigned char *bytes) {
+	int i, p = 0;
+
+	if (enc->run > 0) {
+		bytes[p++] = QOI_OP_RUN | (enc->run - 1);
+		enc->run = 0;
+	}
+
+	for (i = 0; i < (int)sizeof(qoi_padding); i++) {
+		bytes[p++] = qoi_padding[i];
+	}
+	return p;
+}
+
+/* Encode the image into bytes, which must hold at least qoi_encode_max_size()
+bytes. Returns the number of bytes written. */
+static int qoi_encode_into(const void *data, const qoi_desc *desc, unsigned char *bytes) {
+	qoi_enc_t enc;
+	int p;
+
+	qoi_enc_init(&enc);
+	p = qoi_encode_header(desc, bytes);
+	p += qoi_encode_px(&enc, (const unsigned char *)data, desc->width * desc->height, desc->channels, bytes + p, NULL);
+	p += qoi_encode_end(&enc, bytes + p);
+	return p;
+}
+
+/* Read and validate the header. Returns 0 if the data is not a valid QOI
+image or the requested channels are invalid. */
+static int qoi_decode_header(const unsigned char *bytes, int size, qoi_desc *desc, int channels) {
+	unsigned int header_magic;
+	int p = 0;
+
+	if (
+		bytes == NULL || desc == NULL ||
+		(channels != 0 && channels != 3 && channels != 4) ||
+		size < QOI_HEADER_SIZE + (int)sizeof(qoi_padding)
+	) {
+		return 0;
+	}
+
+	header_magic = qoi_read_32(bytes, &p);
+	desc->width = qoi_read_32(bytes, &p);
+	desc->height = qoi_read_32(bytes, &p);
+	desc->channels = bytes[p++];
+	desc->colorspace = bytes[p++];
+
+	return header_magic == QOI_MAGIC && qoi_valid_desc(desc);
+}
+
+/* The decoder state between calls of qoi_decode_px() and qoi_decode_skip():
+the index, the previous pixel, the read position and the pending run. */
+typedef struct {
+	qoi_rgba_t index[64];
+	qoi_rgba_t px;
+	int p;
+	int run;
+} qoi_dec_t;
+
+static void qoi_dec_init(qoi_dec_t *dec) {
+	QOI_ZEROARR(dec->index);
+	dec->px.rgba.r = 0;
+	dec->px.rgba.g = 0;
+	dec->px.rgba.b = 0;
+	dec->px.rgba.a = 255;
+	dec->p = QOI_HEADER_SIZE;
+	dec->run = 0;
+}
+
+#ifdef QOI_SSE2
+/* The most pixels qoi_decode_px() reads one chunk at a time before it tries
+qoi_dec_read_rgb() again */
+#define QOI_DEC_SEGMENT 64
+
+/* Decode QOI_OP_RGB chunks from bytes into pixels, four at a time, for as
+long as the next four chunks are all QOI_OP_RGB, and add them to the index.
+a is the alpha of the pixels; chunks_len and px_len are the bytes and pixels
+left. Returns the number of pixels decoded. Since the tag comes first, each
+pixel is simply the chunk shifted by one byte. */
+static int qoi_dec_read_rgb(const unsigned char *bytes, int chunks_len, unsigned char *pixels, int px_len, int channels, int a, qoi_rgba_t *index, qoi_track_t *track) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i hash_mul = _mm_set_epi16(11, 7, 5, 3, 11, 7, 5, 3);
+	qoi_rgba_t px[4];
+	int index_pos[4];
+	int n = 0, i;
+
+	while (chunks_len - n * 4 >= 16 && px_len - n >= 4) {
+		__m128i chunks = _mm_loadu_si128((const __m128i *)(bytes + n * 4));
+		__m128i tags = _mm_and_si128(chunks, _mm_set1_epi32(0xff));
+		__m128i cur, h;
+		__m128 h_lo, h_hi;
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(tags, _mm_set1_epi32(QOI_OP_RGB))) != 0xffff) {
+			break;
+		}
+
+		cur = _mm_or_si128(_mm_srli_epi32(chunks, 8), _mm_slli_epi32(_mm_set1_epi32(a), 24));
+		_mm_storeu_si128((__m128i *)px, cur);
+
+		/* r*3 + g*5 and b*7 + a*11 of each pixel, then their sum */
+		h_lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(cur, zero), hash_mul));
+		h_hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(cur, zero), hash_mul));
+		h = _mm_add_epi32(
+			_mm_castps_si128(_mm_shuffle_ps(h_lo, h_hi, _MM_SHUFFLE(2, 0, 2, 0))),
+			_mm_castps_si128(_mm_shuffle_ps(h_lo, h_hi, _MM_SHUFFLE(3, 1, 3, 1)))
+		);
+		_mm_storeu_si128((__m128i *)index_pos, _mm_and_si128(h, _mm_set1_epi32(63)));
+
+		for (i = 0; i < 4; i++) {
+			index[index_pos[i]] = px[i];
+			if (track) {
+				qoi_track_run(track, px[i], 1, 0);
+			}
+		}
+		if (channels == 4) {
+			_mm_storeu_si128((__m128i *)(pixels + n * 4), cur);
+		}
+		else {
+			for (i = 0; i < 4; i++) {
+				pixels[(n + i) * 3 + 0] = px[i].rgba.r;
+				pixels[(n + i) * 3 + 1] = px[i].rgba.g;
+				pixels[(n + i) * 3 + 2] = px[i].rgba.b;
+			}
+		}
+		n += 4;
+	}
+	return n;
+}
+#endif
+
+/* Decode the next px_count pixels into pixels. chunks_len is the size of the
+data without the padding. If track is given, each chunk's pixels are passed
+to it when the chunk is read; a run is only counted up to the last of the
+px_count pixels, so track should only be used to decode whole images. */
+static void qoi_decode_px(qoi_dec_t *dec, const unsigned char *bytes, int chunks_len, int px_count, int channels, unsigned char *pixels, qoi_track_t *track) {
+	qoi_rgba_t index[64];
+	qoi_rgba_t px = dec->px;
+	int p = dec->p, run = dec->run;
+	int px_len = px_count * channels, px_pos = 0, px_end;
+
+	/* Work on a local copy of the index, so the compiler can tell that the
+	pixel stores don't modify it. */
+	memcpy(index, dec->index, sizeof(index));
+
+	while (px_pos < px_len) {
+		#ifdef QOI_SSE2
+		/* On noisy images, most chunks are QOI_OP_RGB. As long as the next four
+		chunks are, they are decoded at once. Any other chunk ends this for a
+		segment of pixels that are read one chunk at a time; checking before
+		every chunk would slow down the loop below. */
+		if (run == 0) {
+			int n = qoi_dec_read_rgb(bytes + p, chunks_len - p, pixels + px_pos, (px_len - px_pos) / channels, channels, px.rgba.a, index, track);
+			if (n > 0) {
+				p += n * 4;
+				px_pos += n * channels;
+				px.rgba.r = pixels[px_pos - channels + 0];
+				px.rgba.g = pixels[px_pos - channels + 1];
+				px.rgba.b = pixels[px_pos - channels + 2];
+			}
+		}
+		px_end = px_len - px_pos > QOI_DEC_SEGMENT * channels ? px_pos + QOI_DEC_SEGMENT * channels : px_len;
+		#else
+		px_end = px_len;
+		#endif
+
+		for (; px_pos < px_end; px_pos += channels) {
+			if (run > 0) {
+				run--;
+			}
+			else if (p < chunks_len) {
+				int b1 = bytes[p++];
+
+				if (b1 == QOI_OP_RGB) {
+					px.rgba.r = bytes[p++];
+					px.rgba.g = bytes[p++];
+					px.rgba.b = bytes[p++];
+				}
+				else if (b1 == QOI_OP_RGBA) {
+					px.rgba.r = bytes[p++];
+					px.rgba.g = bytes[p++];
+					px.rgba.b = bytes[p++];
+					px.rgba.a = bytes[p++];
+				}
+				else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+					px = index[b1];
+				}
+				else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+					px.rgba.r += ((b1 >> 4) & 0x03) - 2;
+					px.rgba.g += ((b1 >> 2) & 0x03) - 2;
+					px.rgba.b += ( b1       & 0x03) - 2;
+				}
+				else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+					int b2 = bytes[p++];
+					int vg = (b1 & 0x3f) - 32;
+					px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
+					px.rgba.g += vg;
+					px.rgba.b += vg - 8 +  (b2       & 0x0f);
+				}
+				else if ((b1 & QOI_MASK_2) == QOI_OP_RUN) {
+					run = (b1 & 0x3f);
+				}
+
+				index[QOI_COLOR_HASH(px) % 64] = px;
+
+				/* run is 0 for all chunks but QOI_OP_RUN. Apart from the zeroed
+				initial entries, the index only holds pixels that were already
+				passed to track. */
+				if (track) {
+					qoi_track_run(
+						track, px,
+						(run + 1) * channels <= px_len - px_pos ? run + 1 : (px_len - px_pos) / channels,
+						(b1 & QOI_MASK_2) == QOI_OP_INDEX && px.v != 0
+					);
+				}
+			}
+			else if (track) {
+				/* The data ended early; the last pixel is repeated */
+				qoi_track_run(track, px, 1, 1);
+			}
+
+			pixels[px_pos + 0] = px.rgba.r;
+			pixels[px_pos + 1] = px.rgba.g;
+			pixels[px_pos + 2] = px.rgba.b;
+		
+			if (channels == 4) {
+				pixels[px_pos + 3] = px.rgba.a;
+			}
+		}
+	}
+
+	memcpy(dec->index, index, sizeof(index));
+	dec->px = px;
+	dec->p = p;
+	dec->run = run;
+}
+
+/* Advance the decoder past px_count pixels without writing them. Runs are
+skipped as a whole. Returns the number of pixels that could not be skipped
+because the chunks ended early. */
+static int qoi_decode_skip(qoi_dec_t *dec, const unsigned char *bytes, int chunks_len, int px_count) {
+	qoi_rgba_t px = dec->px;
+	int p = dec->p, run = dec->run;
+
+	while (px_count > 0) {
+		int b1;
+
+		if (run > 0) {
+			int skipped = run < px_count ? run : px_count;
+			run -= skipped;
+			px_count -= skipped;
+			continue;
+		}
+		if (p >= chunks_len) {
+			break;
+		}
+
+		b1 = bytes[p++];
+		if (b1 == QOI_OP_RGB) {
+			px.rgba.r = bytes[p++];
+			px.rgba.g = bytes[p++];
+			px.rgba.b = bytes[p++];
+		}
+		else if (b1 == QOI_OP_RGBA) {
+			px.rgba.r = bytes[p++];
+			px.rgba.g = bytes[p++];
+			px.rgba.b = bytes[p++];
+			px.rgba.a = bytes[p++];
+		}
+		else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+			px = dec->index[b1];
+		}
+		else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+			px.rgba.r += ((b1 >> 4) & 0x03) - 2;
+			px.rgba.g += ((b1 >> 2) & 0x03) - 2;
+			px.rgba.b += ( b1       & 0x03) - 2;
+		}
+		else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+			int b2 = bytes[p++];
+			int vg = (b1 & 0x3f) - 32;
+			px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
+			px.rgba.g += vg;
+			px.rgba.b += vg - 8 +  (b2       & 0x0f);
+		}
+		else if ((b1 & QOI_MASK_2) == QOI_OP_RUN) {
+			run = (b1 & 0x3f);
+		}
+
+		dec->index[QOI_COLOR_HASH(px) % 64] = px;
+		px_count--;
+	}
+
+	dec->px = px;
+	dec->p = p;
+	dec->run = run;
+	return px_count;
+}
+
+/* Decode the chunks following the header into pixels, which must hold
+width * height * channels bytes. track may be NULL. */
+static void qoi_decode_into(const unsigned char *bytes, int size, const qoi_desc *desc, int channels, unsigned char *pixels, qoi_track_t *track) {
+	qoi_dec_t dec;
+
+	qoi_dec_init(&dec);
+	qoi_decode_px(
+		&dec, bytes, size - (int)sizeof(qoi_padding),
+		desc->width * desc->height, channels, pixels, track
+	);
+}
+
+/* The initial size of a growing encode buffer: 1/8th of the worst case, but
+enough for the header, one row and the end marker. */
+static int qoi_encode_grow_initial(const qoi_desc *desc) {
+	int capacity = qoi_encode_max_size(desc) / 8;
+	int required = QOI_HEADER_SIZE + desc->width * (desc->channels + 1) + 2 + sizeof(qoi_padding);
+	return capacity < required ? required : capacity;
+}
+
+/* Double the capacity of a growing encode buffer until it holds at least
+required bytes. On failure the buffer is released and NULL returned. */
+static unsigned char *qoi_encode_reserve(unsigned char *bytes, int *capacity, int required, const qoi_allocator *allocator, int hint) {
+	int new_capacity;
+	unsigned char *grown;
+
+	if (required <= *capacity) {
+		return bytes;
+	}
+
+	new_capacity = *capacity * 2;
+	if (new_capacity < required) {
+		new_capacity = required;
+	}
+	grown = (unsigned char *) qoi_realloc(allocator, bytes, *capacity, new_capacity, hint);
+	if (!grown) {
+		qoi_free(bytes, allocator);
+		return NULL;
+	}
+	*capacity = new_capacity;
+	return grown;
+}
+
+/* Encode into a buffer that starts at qoi_encode_grow_initial() and is grown
+as needed before each row. Returns the buffer and sets its capacity. */
+static unsigned char *qoi_encode_grow(const void *data, const qoi_desc *desc, int *out_len, int *capacity, const qoi_allocator *allocator, int hint) {
+	const unsigned char *pixels = (const unsigned char *)data;
+	int row_size = desc->width * (desc->channels + 1) + 1;
+	int stride = desc->width * desc->channels;
+	int p, y;
+	unsigned char *bytes;
+	qoi_enc_t enc;
+
+	*capacity = qoi_encode_grow_initial(desc);
+	bytes = (unsigned char *) qoi_alloc(*capacity, hint, allocator);
+	if (!bytes) {
+		return NULL;
+	}
+
+	qoi_enc_init(&enc);
+	p = qoi_encode_header(desc, bytes);
+	for (y = 0; y < (int)desc->height; y++) {
+		bytes = qoi_encode_reserve(bytes, capacity, p + row_size + 1 + sizeof(qoi_padding), allocator, hint);
+		if (!bytes) {
+			return NULL;
+		}
+		p += qoi_encode_px(&enc, pixels + y * stride, desc->width, desc->channels, bytes + p, NULL);
+	}
+	p += qoi_encode_end(&enc, bytes + p);
+
+	*out_len = p;
+	return bytes;
+}
+
+static void *qoi_encode_alloc(const void *data, const qoi_desc *desc, int *out_len, int flags, const qoi_allocator *allocator, int hint) {
+	unsigned char *bytes, *shrunk;
+	int capacity;
+
+	if (data == NULL || out_len == NULL || desc == NULL || !qoi_valid_desc(desc)) {
+		return NULL;
+	}
+
+	if (flags & QOI_ENCODE_GROW) {
+		bytes = qoi_encode_grow(data, desc, out_len, &capacity, allocator, hint);
+		if (!bytes) {
+			return NULL;
+		}
+	}
+	else {
+		capacity = qoi_encode_max_size(desc);
+		bytes = (unsigned char *) qoi_alloc(capacity, hint, allocator);
+		if (!bytes) {
+			return NULL;
+		}
+		*out_len = qoi_encode_into(data, desc, bytes);
+	}
+
+	if ((flags & (QOI_ENCODE_SHRINK | QOI_ENCODE_GROW)) && *out_len < capacity) {
+		shrunk = (unsigned char *) qoi_realloc(allocator, bytes, capacity, *out_len, hint);
+		if (shrunk) {
+			bytes = shrunk;
+		}
+	}
+	return bytes;
+}
+
+void *qoi_encode_ex(const void *data, const qoi_desc *desc, int *out_len, int flags, const qoi_allocator *allocator) {
+	return qoi_encode_alloc(data, desc, out_len, flags, allocator, QOI_ALLOC_RESULT);
+}
+
+/* The public qoi_encoder keeps the qoi_enc_t in an opaque array */
+typedef char qoi_encoder_state_fits[sizeof(qoi_enc_t) <= sizeof(((qoi_encoder *)0)->state) ? 1 : -1];
+
+int qoi_encoder_begin(qoi_encoder *enc, const qoi_desc *desc, int flags, const qoi_allocator *allocator) {
+	enc->bytes = NULL;
+	enc->len = 0;
+	enc->capacity = 0;
+	enc->rows = 0;
+	enc->flags = flags;
+	if (allocator) {
+		enc->allocator = *allocator;
+	}
+	else {
+		enc->allocator.alloc = NULL;
+		enc->allocator.realloc = NULL;
+		enc->allocator.free = NULL;
+		enc->allocator.user = NULL;
+	}
+
+	if (desc == NULL || !qoi_valid_desc(desc)) {
+		return 0;
+	}
+	enc->desc = *desc;
+
+	enc->capacity = qoi_encode_grow_initial(desc);
+	enc->bytes = (unsigned char *) qoi_alloc(enc->capacity, QOI_ALLOC_RESULT, &enc->allocator);
+	if (!enc->bytes) {
+		enc->capacity = 0;
+		return 0;
+	}
+
+	qoi_enc_init((qoi_enc_t *)enc->state);
+	enc->len = qoi_encode_header(desc, enc->bytes);
+	return 1;
+}
+
+int qoi_encoder_rows(qoi_encoder *enc, const void *pixels, int rows) {
+	const unsigned char *px = (const unsigned char *)pixels;
+	int row_size = enc->desc.width * (enc->desc.channels + 1) + 1;
+	int stride = enc->desc.width * enc->desc.channels;
+	int y;
+
+	if (
+		enc->bytes == NULL || pixels == NULL || rows < 0 ||
+		rows > (int)enc->desc.height - enc->rows
+	) {
+		return 0;
+	}
+
+	for (y = 0; y < rows; y++) {
+		enc->bytes = qoi_encode_reserve(
+			enc->bytes, &enc->capacity, enc->len + row_size + 1 + sizeof(qoi_padding),
+			&enc->allocator, QOI_ALLOC_RESULT
+		);
+		if (!enc->bytes) {
+			enc->capacity = 0;
+			return 0;
+		}
+		enc->len += qoi_encode_px(
+			(qoi_enc_t *)enc->state, px + y * stride, enc->desc.width,
+			enc->desc.channels, enc->bytes + enc->len, NULL
+		);
+	}
+	enc->rows += rows;
+	return 1;
+}
+
+void *qoi_encoder_end(qoi_encoder *enc, int *out_len) {
+	unsigned char *bytes, *shrunk;
+
+	if (enc->bytes == NULL || out_len == NULL || enc->rows != (int)enc->desc.height) {
+		qoi_encoder_abort(enc);
+		return NULL;
+	}
+
+	/* qoi_encoder_rows() always leaves room for the end marker */
+	enc->len += qoi_encode_end((qoi_enc_t *)enc->state, enc->bytes + enc->len);
+
+	bytes = enc->bytes;
+	if ((enc->flags & QOI_ENCODE_SHRINK) && enc->len < enc->capacity) {
+		shrunk = (unsigned char *) qoi_realloc(&enc->allocator, bytes, enc->capacity, enc->len, QOI_ALLOC_RESULT);
+		if (shrunk) {
+			bytes = shrunk;
+		}
+	}
+
+	*out_len = enc->len;
+	enc->bytes = NULL;
+	enc->capacity = 0;
+	return bytes;
+}
+
+void qoi_encoder_abort(qoi_encoder *enc) {
+	qoi_free(enc->bytes, &enc->allocator);
+	enc->bytes = NULL;
+	enc->capacity = 0;
+}
+
+/* Encode a stripe of px_count pixels independently of the encoder state
+before it: the first pixel is always a QOI_OP_RGBA and the index starts out
+with entries that no pixel can match. Slot 0 is the only one a zeroed entry
+could match (with the pixel 0,0,0,0), so it gets an entry that hashes
+elsewhere. bytes must hold at least px_count * (channels + 1) + 3 +
+QOI_ENC_SLACK bytes. */
+static int qoi_encode_stripe(const unsigned char *pixels, int px_count, int channels, unsigned char *bytes) {
+	qoi_enc_t enc;
+	int p = 0;
+
+	QOI_ZEROARR(enc.index);
+	enc.index[0].rgba.r = 1;
+	enc.run = 0;
+
+	enc.px_prev.rgba.r = pixels[0];
+	enc.px_prev.rgba.g = pixels[1];
+	enc.px_prev.rgba.b = pixels[2];
+	enc.px_prev.rgba.a = channels == 4 ? pixels[3] : 255;
+	enc.index[QOI_COLOR_HASH(enc.px_prev) % 64] = enc.px_prev;
+
+	bytes[p++] = QOI_OP_RGBA;
+	bytes[p++] = enc.px_prev.rgba.r;
+	bytes[p++] = enc.px_prev.rgba.g;
+	bytes[p++] = enc.px_prev.rgba.b;
+	bytes[p++] = enc.px_prev.rgba.a;
+
+	p += qoi_encode_px(&enc, pixels + channels, px_count - 1, channels, bytes + p, NULL);
+	if (enc.run > 0) {
+		bytes[p++] = QOI_OP_RUN | (enc.run - 1);
+	}
+	return p;
+}
+
+int qoi_frame_init(qoi_frame_encoder *frame, const qoi_desc *desc, int stripe_rows, const qoi_allocator *allocator) {
+	frame->pixels = NULL;
+	frame->offsets = NULL;
+	frame->bytes[0] = NULL;
+	frame->bytes[1] = NULL;
+	frame->capacity = 0;
+	frame->current = 0;
+	frame->has_frame = 0;
+	frame->stripes_encoded = 0;
+	if (allocator) {
+		frame->allocator = *allocator;
+	}
+	else {
+		frame->allocator.alloc = NULL;
+		frame->allocator.realloc = NULL;
+		frame->allocator.free = NULL;
+		frame->allocator.user = NULL;
+	}
+
+	if (desc == NULL || !qoi_valid_desc(desc) || stripe_rows < 0) {
+		return 0;
+	}
+
+	frame->desc = *desc;
+	frame->stripe_rows = stripe_rows ? stripe_rows : 16;
+	if (frame->stripe_rows > (int)desc->height) {
+		frame->stripe_rows = desc->height;
+	}
+	frame->stripe_count = (desc->height + frame->stripe_rows - 1) / frame->stripe_rows;
+
+	/* Every stripe may need up to 3 bytes more than its pixels' worst case,
+	for its leading literal and the run it closes */
+	frame->capacity = qoi_encode_max_size(desc) + frame->stripe_count * 3;
+
+	frame->pixels = (unsigned char *) qoi_alloc((size_t)desc->width * desc->height * desc->channels, QOI_ALLOC_CONTEXT, &frame->allocator);
+	frame->offsets = (int *) qoi_alloc((frame->stripe_count + 1) * 2 * sizeof(int), QOI_ALLOC_CONTEXT, &frame->allocator);
+	frame->bytes[0] = (unsigned char *) qoi_alloc(frame->capacity, QOI_ALLOC_CONTEXT, &frame->allocator);
+	frame->bytes[1] = (unsigned char *) qoi_alloc(frame->capacity, QOI_ALLOC_CONTEXT, &frame->allocator);
+	return frame->pixels && frame->offsets && frame->bytes[0] && frame->bytes[1];
+}
+
+void *qoi_frame_encode(qoi_frame_encoder *frame, const void *data, int *out_len) {
+	const unsigned char *pixels = (const unsigned char *)data;
+	int stride, cur, p, i, s;
+	int *offsets, *prev_offsets;
+	unsigned char *bytes, *prev_bytes;
+
+	if (frame == NULL || frame->bytes[1] == NULL || data == NULL || out_len == NULL) {
+		return NULL;
+	}
+
+	stride = frame->desc.width * frame->desc.channels;
+	cur = frame->current ^ 1;
+	bytes = frame->bytes[cur];
+	prev_bytes = frame->bytes[frame->current];
+	offsets = frame->offsets + cur * (frame->stripe_count + 1);
+	prev_offsets = frame->offsets + frame->current * (frame->stripe_count + 1);
+
+	frame->stripes_encoded = 0;
+	p = qoi_encode_header(&frame->desc, bytes);
+	for (s = 0; s < frame->stripe_count; s++) {
+		int y = s * frame->stripe_rows;
+		int rows = frame->desc.height - y < (unsigned int)frame->stripe_rows ? (int)frame->desc.height - y : frame->stripe_rows;
+		const unsigned char *stripe = pixels + (size_t)y * stride;
+		unsigned char *kept = frame->pixels + (size_t)y * stride;
+
+		offsets[s] = p;
+		if (frame->has_frame && memcmp(stripe, kept, (size_t)rows * stride) == 0) {
+			int len = prev_offsets[s + 1] - prev_offsets[s];
+			memcpy(bytes + p, prev_bytes + prev_offsets[s], len);
+			p += len;
+		}
+		else {
+			p += qoi_encode_stripe(stripe, rows * frame->desc.width, frame->desc.channels, bytes + p);
+			memcpy(kept, stripe, (size_t)rows * stride);
+			frame->stripes_encoded++;
+		}
+	}
+	offsets[frame->stripe_count] = p;
+
+	for (i = 0; i < (int)sizeof(qoi_padding); i++) {
+		bytes[p++] = qoi_padding[i];
+	}
+
+	frame->current = cur;
+	frame->has_frame = 1;
+	*out_len = p;
+	return bytes;
+}
+
+void qoi_frame_free(qoi_frame_encoder *frame) {
+	qoi_free(frame->pixels, &frame->allocator);
+	qoi_free(frame->offsets, &frame->allocator);
+	qoi_free(frame->bytes[0], &frame->allocator);
+	qoi_free(frame->bytes[1], &frame->allocator);
+	frame->pixels = NULL;
+	frame->offsets = NULL;
+	frame->bytes[0] = NULL;
+	frame->bytes[1] = NULL;
+	frame->has_frame = 0;
+}
+
+void *qoi_encode(const void *data, const qoi_desc *desc, int *out_len) {
+	return qoi_encode_ex(data, desc, out_len, 0, NULL);
+}
+
+/* A qoi_sink_t receives the encoded bytes in a sequence of buffers. Whenever
+the current buffer is full, next() is called to consume it and to provide a
+fresh one. */
+typedef struct qoi_sink_t {
+	unsigned char *buffer;
+	int size;
+	int pos;
+	int (*next)(struct qoi_sink_t *sink);
+	void *user;
+} qoi_sink_t;
+
+static int qoi_sink_write(qoi_sink_t *sink, const unsigned char *bytes, int len) {
+	int i;
+	for (i = 0; i < len; i++) {
+		if (sink->pos == sink->size && !sink->next(sink)) {
+			return 0;
+		}
+		sink->buffer[sink->pos++] = bytes[i];
+	}
+	return 1;
+}
+
+/* Encode the image into the sink. The pixels are encoded directly into the
+sink's buffers, in spans that fit into the remaining space. The last buffer is
+left to the caller to finish. All other buffers are filled completely.
+Returns 0 if next() failed. */
+static int qoi_encode_sink(const void *data, const qoi_desc *desc, qoi_sink_t *sink) {
+	const unsigned char *pixels = (const unsigned char *)data;
+	unsigned char end[QOI_HEADER_SIZE + sizeof(qoi_padding)];
+	int px_count = desc->width * desc->height;
+	int px_size = desc->channels + 1;
+	int len, span;
+	qoi_enc_t enc;
+
+	qoi_enc_init(&enc);
+	len = qoi_encode_header(desc, end);
+	if (!qoi_sink_write(sink, end, len)) {
+		return 0;
+	}
+
+	while (px_count > 0) {
+		/* One extra byte for a run that may be pending from the last span,
+		and room for the bytes qoi_encode_px() overwrites past the ops */
+		span = (sink->size - sink->pos - 1 - QOI_ENC_SLACK) / px_size;
+		if (span <= 0) {
+			/* Not enough room left for the worst case; encode a single pixel
+			separately, so that it can be split across buffers */
+			len = qoi_encode_px(&enc, pixels, 1, desc->channels, end, NULL);
+			if (!qoi_sink_write(sink, end, len)) {
+				return 0;
+			}
+			pixels += desc->channels;
+			px_count--;
+			continue;
+		}
+		if (span > px_count) {
+			span = px_count;
+		}
+		sink->pos += qoi_encode_px(&enc, pixels, span, desc->channels, sink->buffer + sink->pos, NULL);
+		pixels += span * desc->channels;
+		px_count -= span;
+	}
+
+	len = qoi_encode_end(&enc, end);
+	return qoi_sink_write(sink, end, len);
+}
+
+typedef struct {
+	qoi_chunk *chunks;
+	int count;
+	int capacity;
+	const qoi_allocator *allocator;
+} qoi_chunk_list_t;
+
+static int qoi_chunk_next(qoi_sink_t *sink) {
+	qoi_chunk_list_t *list = (qoi_chunk_list_t *)sink->user;
+
+	if (list->count > 0) {
+		list->chunks[list->count - 1].size = sink->pos;
+	}
+
+	if (list->count == list->capacity) {
+		int new_capacity = list->capacity * 2;
+		qoi_chunk *grown = (qoi_chunk *) qoi_realloc(
+			list->allocator, list->chunks,
+			list->capacity * sizeof(qoi_chunk), new_capacity * sizeof(qoi_chunk),
+			QOI_ALLOC_RESULT
+		);
+		if (!grown) {
+			return 0;
+		}
+		list->chunks = grown;
+		list->capacity = new_capacity;
+	}
+
+	sink->buffer = (unsigned char *) qoi_alloc(sink->size, QOI_ALLOC_CHUNK, list->allocator);
+	if (!sink->buffer) {
+		return 0;
+	}
+	sink->pos = 0;
+	list->chunks[list->count].data = sink->buffer;
+	list->chunks[list->count].size = 0;
+	list->count++;
+	return 1;
+}
+
+qoi_chunk *qoi_encode_chunks(const void *data, const qoi_desc *desc, int chunk_size, int *out_count, const qoi_allocator *allocator) {
+	qoi_chunk_list_t list;
+	qoi_sink_t sink;
+
+	if (
+		data == NULL || out_count == NULL || desc == NULL ||
+		chunk_size < 64 || !qoi_valid_desc(desc)
+	) {
+		return NULL;
+	}
+
+	/* Start with enough entries for a typical compression ratio of 1/4 */
+	list.count = 0;
+	list.capacity = qoi_encode_max_size(desc) / 5 / chunk_size + 1;
+	list.allocator = allocator;
+	list.chunks = (qoi_chunk *) qoi_alloc(list.capacity * sizeof(qoi_chunk), QOI_ALLOC_RESULT, allocator);
+	if (!list.chunks) {
+		return NULL;
+	}
+
+	sink.buffer = NULL;
+	sink.size = chunk_size;
+	sink.pos = chunk_size;
+	sink.next = qoi_chunk_next;
+	sink.user = &list;
+
+	if (!qoi_encode_sink(data, desc, &sink)) {
+		qoi_free_chunks(list.chunks, list.count, allocator);
+		return NULL;
+	}
+
+	list.chunks[list.count - 1].size = sink.pos;
+	*out_count = list.count;
+	return list.chunks;
+}
+
+void qoi_free_chunks(qoi_chunk *chunks, int count, const qoi_allocator *allocator) {
+	int i;
+	if (chunks == NULL) {
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		qoi_free(chunks[i].data, allocator);
+	}
+	qoi_free(chunks, allocator);
+}
+
+void *qoi_decode_ex(const void *data, int size, qoi_desc *desc, int channels, const qoi_allocator *allocator) {
+	const unsigned char *bytes = (const unsigned char *)data;
+	unsigned char *pixels;
+
+	if (!qoi_decode_header(bytes, size, desc, channels)) {
+		return NULL;
+	}
+
+	if (channels == 0) {
+		channels = desc->channels;
+	}
+
+	pixels = (unsigned char *) qoi_alloc(desc->width * desc->height * channels, QOI_ALLOC_RESULT, allocator);
+	if (!pixels) {
+		return NULL;
+	}
+
+	qoi_decode_into(bytes, size, desc, channels, pixels, NULL);
+	return pixels;
+}
+
+void *qoi_decode(const void *data, int size, qoi_desc *desc, int channels) {
+	return qoi_decode_ex(data, size, desc, channels, NULL);
+}
+
+void *qoi_crop(const void *data, int size, int x, int y, int w, int h, int *out_len, const qoi_allocator *allocator) {
+	const unsigned char *bytes = (const unsigned char *)data;
+	qoi_desc desc, crop;
+	qoi_dec_t dec;
+	qoi_encoder enc;
+	unsigned char *row;
+	int chunks_len, row_y;
+
+	if (
+		out_len == NULL || !qoi_decode_header(bytes, size, &desc, 0) ||
+		x < 0 || y < 0 || w <= 0 || h <= 0 ||
+		w > (int)desc.width - x || h > (int)desc.height - y
+	) {
+		return NULL;
+	}
+
+	crop = desc;
+	crop.width = w;
+	crop.height = h;
+
+	row = (unsigned char *) qoi_alloc(w * desc.channels, QOI_ALLOC_TEMP, allocator);
+	if (!row) {
+		return NULL;
+	}
+	if (!qoi_encoder_begin(&enc, &crop, QOI_ENCODE_SHRINK, allocator)) {
+		qoi_encoder_abort(&enc);
+		qoi_free(row, allocator);
+		return NULL;
+	}
+
+	qoi_dec_init(&dec);
+	chunks_len = size - (int)sizeof(qoi_padding);
+	qoi_decode_skip(&dec, bytes, chunks_len, y * desc.width + x);
+
+	for (row_y = 0; row_y < h; row_y++) {
+		if (row_y > 0) {
+			qoi_decode_skip(&dec, bytes, chunks_len, desc.width - w);
+		}
+		qoi_decode_px(&dec, bytes, chunks_len, w, desc.channels, row, NULL);
+		if (!qoi_encoder_rows(&enc, row, 1)) {
+			qoi_encoder_abort(&enc);
+			qoi_free(row, allocator);
+			return NULL;
+		}
+	}
+
+	qoi_free(row, allocator);
+	return qoi_encoder_end(&enc, out_len);
+}
+
+int qoi_compare(const void *a, int a_size, const void *b, int b_size, qoi_compare_result *result, const qoi_allocator *allocator) {
+	const unsigned char *a_bytes = (const unsigned char *)a;
+	const unsigned char *b_bytes = (const unsigned char *)b;
+	qoi_desc a_desc, b_desc;
+	qoi_dec_t a_dec, b_dec;
+	unsigned char *a_row, *b_row;
+	int x, y, row_size;
+
+	if (
+		result == NULL ||
+		!qoi_decode_header(a_bytes, a_size, &a_desc, 0) ||
+		!qoi_decode_header(b_bytes, b_size, &b_desc, 0)
+	) {
+		return 0;
+	}
+
+	result->same_size = a_desc.width == b_desc.width && a_desc.height == b_desc.height;
+	result->equal = result->same_size;
+	result->diff_pixels = 0;
+	result->first_x = result->first_y = -1;
+	result->min_x = result->min_y = -1;
+	result->max_x = result->max_y = -1;
+
+	if (
+		!result->same_size ||
+		(a_size == b_size && memcmp(a_bytes, b_bytes, a_size) == 0)
+	) {
+		return 1;
+	}
+
+	row_size = a_desc.width * 4;
+	a_row = (unsigned char *) qoi_alloc(row_size * 2, QOI_ALLOC_TEMP, allocator);
+	if (!a_row) {
+		return 0;
+	}
+	b_row = a_row + row_size;
+
+	qoi_dec_init(&a_dec);
+	qoi_dec_init(&b_dec);
+
+	for (y = 0; y < (int)a_desc.height; y++) {
+		qoi_decode_px(&a_dec, a_bytes, a_size - (int)sizeof(qoi_padding), a_desc.width, 4, a_row, NULL);
+		qoi_decode_px(&b_dec, b_bytes, b_size - (int)sizeof(qoi_padding), b_desc.width, 4, b_row, NULL);
+		if (memcmp(a_row, b_row, row_size) == 0) {
+			continue;
+		}
+
+		for (x = 0; x < (int)a_desc.width; x++) {
+			if (memcmp(a_row + x * 4, b_row + x * 4, 4) == 0) {
+				continue;
+			}
+			if (result->diff_pixels++ == 0) {
+				result->first_x = result->min_x = result->max_x = x;
+				result->first_y = result->min_y = y;
+			}
+			if (x < result->min_x) {
+				result->min_x = x;
+			}
+			if (x > result->max_x) {
+				result->max_x = x;
+			}
+			result->max_y = y;
+		}
+	}
+
+	qoi_free(a_row, allocator);
+	result->equal = result->diff_pixels == 0;
+	return 1;
+}
+
+unsigned int qoi_checksum(const void *pixels, const qoi_desc *desc) {
+	const unsigned char *bytes = (const unsigned char *)pixels;
+	qoi_checksum_t checksum;
+	qoi_rgba_t px;
+	int px_len, px_pos;
+
+	if (pixels == NULL || desc == NULL || !qoi_valid_desc(desc)) {
+		return 0;
+	}
+
+	qoi_checksum_init(&checksum);
+	px.rgba.a = 255;
+	px_len = desc->width * desc->height * desc->channels;
+	for (px_pos = 0; px_pos < px_len; px_pos += desc->channels) {
+		px.rgba.r = bytes[px_pos + 0];
+		px.rgba.g = bytes[px_pos + 1];
+		px.rgba.b = bytes[px_pos + 2];
+		if (desc->channels == 4) {
+			px.rgba.a = bytes[px_pos + 3];
+		}
+		qoi_checksum_run(&checksum, px, 1);
+	}
+	return checksum.sum;
+}
+
+/* qoi_encode() and qoi_decode() with a qoi_track_t */
+static void *qoi_encode_track(const void *data, const qoi_desc *desc, int *out_len, qoi_track_t *track, const qoi_allocator *allocator) {
+	qoi_enc_t enc;
+	unsigned char *bytes;
+	int p;
+
+	bytes = (unsigned char *) qoi_alloc(qoi_encode_max_size(desc), QOI_ALLOC_RESULT, allocator);
+	if (!bytes) {
+		return NULL;
+	}
+
+	qoi_enc_init(&enc);
+	p = qoi_encode_header(desc, bytes);
+	p += qoi_encode_px(&enc, (const unsigned char *)data, desc->width * desc->height, desc->channels, bytes + p, track);
+	if (enc.run > 0) {
+		qoi_track_run(track, enc.px_prev, enc.run, 0);
+	}
+	p += qoi_encode_end(&enc, bytes + p);
+
+	*out_len = p;
+	return bytes;
+}
+
+static void *qoi_decode_track(const unsigned char *bytes, int size, const qoi_desc *desc, int channels, qoi_track_t *track, const qoi_allocator *allocator) {
+	unsigned char *pixels;
+
+	if (channels == 0) {
+		channels = desc->channels;
+	}
+
+	pixels = (unsigned char *) qoi_alloc(desc->width * desc->height * channels, QOI_ALLOC_RESULT, allocator);
+	if (pixels) {
+		qoi_decode_into(bytes, size, desc, channels, pixels, track);
+	}
+	return pixels;
+}
+
+void *qoi_encode_checksum(const void *data, const qoi_desc *desc, int *out_len, unsigned int *checksum, const qoi_allocator *allocator) {
+	qoi_checksum_t sum;
+	qoi_track_t track;
+	void *bytes;
+
+	if (
+		data == NULL || out_len == NULL || checksum == NULL || desc == NULL ||
+		!qoi_valid_desc(desc)
+	) {
+		return NULL;
+	}
+
+	qoi_checksum_init(&sum);
+	track.checksum = &sum;
+	track.analysis = NULL;
+	bytes = qoi_encode_track(data, desc, out_len, &track, allocator);
+	*checksum = sum.sum;
+	return bytes;
+}
+
+void *qoi_decode_checksum(const void *data, int size, qoi_desc *desc, int channels, unsigned int *checksum, const qoi_allocator *allocator) {
+	qoi_checksum_t sum;
+	qoi_track_t track;
+	void *pixels;
+
+	if (checksum == NULL || !qoi_decode_header((const unsigned char *)data, size, desc, channels)) {
+		return NULL;
+	}
+
+	qoi_checksum_init(&sum);
+	track.checksum = &sum;
+	track.analysis = NULL;
+	pixels = qoi_decode_track((const unsigned char *)data, size, desc, channels, &track, allocator);
+	*checksum = sum.sum;
+	return pixels;
+}
+
+void *qoi_encode_analyze(const void *data, const qoi_desc *desc, int *out_len, qoi_analysis *analysis, const qoi_allocator *allocator) {
+	qoi_analysis_t state;
+	qoi_track_t track;
+
+	if (
+		data == NULL || out_len == NULL || analysis == NULL || desc == NULL ||
+		!qoi_valid_desc(desc)
+	) {
+		return NULL;
+	}
+
+	qoi_analysis_init(&state, analysis, desc->width);
+	track.checksum = NULL;
+	track.analysis = &state;
+	return qoi_encode_track(data, desc, out_len, &track, allocator);
+}
+
+void *qoi_decode_analyze(const void *data, int size, qoi_desc *desc, int channels, qoi_analysis *analysis, const qoi_allocator *allocator) {
+	qoi_analysis_t state;
+	qoi_track_t track;
+
+	if (analysis == NULL || !qoi_decode_header((const unsigned char *)data, size, desc, channels)) {
+		return NULL;
+	}
+
+	qoi_analysis_init(&state, analysis, desc->width);
+	track.checksum = NULL;
+	track.analysis = &state;
+	return qoi_decode_track((const unsigned char *)data, size, desc, channels, &track, allocator);
+}
+
+void qoi_ctx_init(qoi_ctx *ctx, const qoi_allocator *allocator) {
+	ctx->in = NULL;
+	ctx->out = NULL;
+	ctx->in_capacity = 0;
+	ctx->out_capacity = 0;
+	if (allocator) {
+		ctx->allocator = *allocator;
+	}
+	else {
+		ctx->allocator.alloc = NULL;
+		ctx->allocator.realloc = NULL;
+		ctx->allocator.free = NULL;
+		ctx->allocator.user = NULL;
+	}
+}
+
+void qoi_ctx_free(qoi_ctx *ctx) {
+	qoi_free(ctx->in, &ctx->allocator);
+	qoi_free(ctx->out, &ctx->allocator);
+	qoi_ctx_init(ctx, &ctx->allocator);
+}
+
+/* Make sure the buffer holds at least size bytes. The previous contents are
+not preserved. The buffer grows by at least 50% to avoid frequent
+reallocations for slowly growing sizes. */
+static unsigned char *qoi_ctx_reserve(qoi_ctx *ctx, unsigned char **buffer, int *capacity, int size) {
+	int new_capacity;
+
+	if (size <= *capacity) {
+		return *buffer;
+	}
+
+	new_capacity = *capacity + *capacity / 2;
+	if (new_capacity < size || new_capacity < 0) {
+		new_capacity = size;
+	}
+
+	qoi_free(*buffer, &ctx->allocator);
+	*buffer = (unsigned char *) qoi_alloc(new_capacity, QOI_ALLOC_CONTEXT, &ctx->allocator);
+	*capacity = *buffer ? new_capacity : 0;
+	return *buffer;
+}
+
+void *qoi_encode_ctx(qoi_ctx *ctx, const void *data, const qoi_desc *desc, int *out_len) {
+	unsigned char *bytes;
+
+	if (
+		ctx == NULL || data == NULL || out_len == NULL || desc == NULL ||
+		!qoi_valid_desc(desc)
+	) {
+		return NULL;
+	}
+
+	bytes = qoi_ctx_reserve(ctx, &ctx->out, &ctx->out_capacity, qoi_encode_max_size(desc));
+	if (!bytes) {
+		return NULL;
+	}
+
+	*out_len = qoi_encode_into(data, desc, bytes);
+	return bytes;
+}
+
+void *qoi_decode_ctx(qoi_ctx *ctx, const void *data, int size, qoi_desc *desc, int channels) {
+	const unsigned char *bytes = (const unsigned char *)data;
+	unsigned char *pixels;
+
+	if (ctx == NULL || !qoi_decode_header(bytes, size, desc, channels)) {
+		return NULL;
+	}
+
+	if (channels == 0) {
+		channels = desc->channels;
+	}
+
+	pixels = qoi_ctx_reserve(ctx, &ctx->out, &ctx->out_capacity, desc->width * desc->height * channels);
+	if (!pixels) {
+		return NULL;
+	}
+
+	qoi_decode_into(bytes, size, desc, channels, pixels, NULL);
+	return pixels;
+}
+
+#ifndef QOI_NO_STDIO
+#include <stdio.h>
+
+static int qoi_fwrite_next(qoi_sink_t *sink) {
+	if (fwrite(sink->buffer, 1, sink->pos, (FILE *)sink->user) != (size_t)sink->pos) {
+		return 0;
+	}
+	sink->pos = 0;
+	return 1;
+}
+
+int qoi_write_ex(const char *filename, const void *data, const qoi_desc *desc, const qoi_allocator *allocator) {
+	FILE *f;
+	int size, err;
+	qoi_sink_t sink;
+
+	if (data == NULL || desc == NULL || !qoi_valid_desc(desc)) {
+		return 0;
+	}
+
+	f = fopen(filename, "wb");
+	if (!f) {
+		return 0;
+	}
+
+	/* Encode through a single buffer that is written whenever it is full,
+	instead of encoding the whole image into memory first */
+	sink.size = QOI_WRITE_FD_BUFFER_SIZE;
+	sink.pos = 0;
+	sink.next = qoi_fwrite_next;
+	sink.user = f;
+	sink.buffer = (unsigned char *) qoi_alloc(sink.size, QOI_ALLOC_TEMP, allocator);
+	if (!sink.buffer) {
+		fclose(f);
+		return 0;
+	}
+
+	err = !qoi_encode_sink(data, desc, &sink) || !qoi_fwrite_next(&sink);
+	size = ftell(f);
+	fflush(f);
+	err |= ferror(f);
+	fclose(f);
+
+	qoi_free(sink.buffer, allocator);
+	return err ? 0 : size;
+}
+
+int qoi_write(const char *filename, const void *data, const qoi_desc *desc) {
+	return qoi_write_ex(filename, data, desc, NULL);
+}
+
+void *qoi_read_ex(const char *filename, qoi_desc *desc, int channels, const qoi_allocator *allocator) {
 	FILE *f = fopen(filename, "rb");
 	int size, bytes_read;
 	void *pixels, *data;
@@ -632,7 +2703,7 @@ void *qoi_read(const char *filename, qoi_desc *desc, int channels) {
 		return NULL;
 	}
 
-	data = QOI_MALLOC(size);
+	data = qoi_alloc(size, QOI_ALLOC_TEMP, allocator);
 	if (!data) {
 		fclose(f);
 		return NULL;
@@ -640,10 +2711,465 @@ void *qoi_read(const char *filename, qoi_desc *desc, int channels) {
 
 	bytes_read = fread(data, 1, size, f);
 	fclose(f);
-	pixels = (bytes_read != size) ? NULL : qoi_decode(data, bytes_read, desc, channels);
-	QOI_FREE(data);
+	pixels = (bytes_read != size) ? NULL : qoi_decode_ex(data, bytes_read, desc, channels, allocator);
+	qoi_free(data, allocator);
 	return pixels;
 }
 
+void *qoi_read(const char *filename, qoi_desc *desc, int channels) {
+	return qoi_read_ex(filename, desc, channels, NULL);
+}
+
+int qoi_write_ctx(qoi_ctx *ctx, const char *filename, const void *data, const qoi_desc *desc) {
+	FILE *f;
+	int size, err;
+	void *encoded;
+
+	encoded = qoi_encode_ctx(ctx, data, desc, &size);
+	if (!encoded) {
+		return 0;
+	}
+
+	f = fopen(filename, "wb");
+	if (!f) {
+		return 0;
+	}
+
+	fwrite(encoded, 1, size, f);
+	fflush(f);
+	err = ferror(f);
+	fclose(f);
+	return err ? 0 : size;
+}
+
+void *qoi_read_ctx(qoi_ctx *ctx, const char *filename, qoi_desc *desc, int channels) {
+	FILE *f;
+	int size, bytes_read;
+	unsigned char *data;
+
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	f = fopen(filename, "rb");
+	if (!f) {
+		return NULL;
+	}
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	if (size <= 0 || fseek(f, 0, SEEK_SET) != 0) {
+		fclose(f);
+		return NULL;
+	}
+
+	data = qoi_ctx_reserve(ctx, &ctx->in, &ctx->in_capacity, size);
+	if (!data) {
+		fclose(f);
+		return NULL;
+	}
+
+	bytes_read = fread(data, 1, size, f);
+	fclose(f);
+	return (bytes_read != size) ? NULL : qoi_decode_ctx(ctx, data, bytes_read, desc, channels);
+}
+
+/* Recover the state qoi_encode_px() had after the last pixel of the image, as
+if the image had not been ended yet. Returns the offset at which encoding
+continues: the end of the chunks, or the start of a final QOI_OP_RUN that is
+reopened in the state. Returns 0 if the chunks don't end exactly after the
+last pixel. */
+static int qoi_append_scan(const unsigned char *bytes, int size, const qoi_desc *desc, qoi_enc_t *enc) {
+	qoi_dec_t dec;
+	int px_count = desc->width * desc->height;
+	int chunks_len = size - (int)sizeof(qoi_padding);
+	int run_op = -1, run;
+
+	qoi_dec_init(&dec);
+
+	/* Unlike the decoder, the encoder does not add the initial pixel to the
+	index for runs at the start of the image. Skip those by hand to end up
+	with the encoder's index. */
+	while (
+		px_count > 0 && dec.p < chunks_len &&
+		bytes[dec.p] < QOI_OP_RGB && (bytes[dec.p] & QOI_MASK_2) == QOI_OP_RUN
+	) {
+		run_op = dec.p;
+		px_count -= (bytes[dec.p++] & 0x3f) + 1;
+	}
+
+	if (px_count > 0) {
+		run_op = -1;
+		if (qoi_decode_skip(&dec, bytes, chunks_len, px_count - 1) != 0) {
+			return 0;
+		}
+
+		if (dec.run > 0) {
+			/* The last pixel belongs to the run that was read last */
+			run_op = dec.p - 1;
+			dec.run--;
+		}
+		else {
+			if (
+				dec.p < chunks_len &&
+				bytes[dec.p] < QOI_OP_RGB && (bytes[dec.p] & QOI_MASK_2) == QOI_OP_RUN
+			) {
+				run_op = dec.p;
+			}
+			if (qoi_decode_skip(&dec, bytes, chunks_len, 1) != 0) {
+				return 0;
+			}
+		}
+	}
+
+	if (
+		px_count < 0 || dec.run != 0 || dec.p != chunks_len ||
+		memcmp(bytes + chunks_len, qoi_padding, sizeof(qoi_padding)) != 0
+	) {
+		return 0;
+	}
+
+	memcpy(enc->index, dec.index, sizeof(enc->index));
+	enc->px_prev = dec.px;
+	enc->run = 0;
+
+	/* A run of 62 is closed; the encoder would start a new one */
+	if (run_op >= 0) {
+		run = (bytes[run_op] & 0x3f) + 1;
+		if (run < 62) {
+			enc->run = run;
+			return run_op;
+		}
+	}
+	return chunks_len;
+}
+
+/* The saved state: magic, file size, continue offset, run, previous pixel,
+index, and the header and last bytes of the file it belongs to. */
+#define QOI_APPEND_TAIL 16
+#define QOI_APPEND_STATE_SIZE (4 * 4 + 4 + 64 * 4 + QOI_HEADER_SIZE + QOI_APPEND_TAIL)
+#define QOI_APPEND_MAGIC \
+	(((unsigned int)'q') << 24 | ((unsigned int)'o') << 16 | \
+	 ((unsigned int)'i') <<  8 | ((unsigned int)'a'))
+
+static int qoi_append_read_tail(FILE *f, int size, unsigned char *tail) {
+	return
+		fseek(f, size - QOI_APPEND_TAIL, SEEK_SET) == 0 &&
+		fread(tail, 1, QOI_APPEND_TAIL, f) == QOI_APPEND_TAIL;
+}
+
+static int qoi_append_load_state(const char *state_name, FILE *f, int size, const unsigned char *header, qoi_enc_t *enc) {
+	unsigned char state[QOI_APPEND_STATE_SIZE], tail[QOI_APPEND_TAIL];
+	FILE *sf = fopen(state_name, "rb");
+	int i, p = 0, ok, end, run;
+
+	if (!sf) {
+		return 0;
+	}
+	ok = fread(state, 1, sizeof(state), sf) == sizeof(state) && fgetc(sf) == EOF;
+	fclose(sf);
+
+	if (
+		!ok || qoi_read_32(state, &p) != QOI_APPEND_MAGIC ||
+		(int)qoi_read_32(state, &p) != size
+	) {
+		return 0;
+	}
+	end = qoi_read_32(state, &p);
+	run = qoi_read_32(state, &p);
+	if (
+		end < QOI_HEADER_SIZE || end > size - (int)sizeof(qoi_padding) ||
+		run < 0 || run > 61 ||
+		memcmp(state + 4 * 4 + 4 + 64 * 4, header, QOI_HEADER_SIZE) != 0 ||
+		!qoi_append_read_tail(f, size, tail) ||
+		memcmp(state + QOI_APPEND_STATE_SIZE - QOI_APPEND_TAIL, tail, QOI_APPEND_TAIL) != 0
+	) {
+		return 0;
+	}
+
+	enc->run = run;
+	enc->px_prev.rgba.r = state[p++];
+	enc->px_prev.rgba.g = state[p++];
+	enc->px_prev.rgba.b = state[p++];
+	enc->px_prev.rgba.a = state[p++];
+	for (i = 0; i < 64; i++) {
+		enc->index[i].rgba.r = state[p++];
+		enc->index[i].rgba.g = state[p++];
+		enc->index[i].rgba.b = state[p++];
+		enc->index[i].rgba.a = state[p++];
+	}
+	return end;
+}
+
+static void qoi_append_save_state(const char *state_name, FILE *f, int size, int end, const unsigned char *header, const qoi_enc_t *enc) {
+	unsigned char state[QOI_APPEND_STATE_SIZE];
+	FILE *sf;
+	int i, p = 0, ok;
+
+	qoi_write_32(state, &p, QOI_APPEND_MAGIC);
+	qoi_write_32(state, &p, size);
+	qoi_write_32(state, &p, end);
+	qoi_write_32(state, &p, enc->run);
+	state[p++] = enc->px_prev.rgba.r;
+	state[p++] = enc->px_prev.rgba.g;
+	state[p++] = enc->px_prev.rgba.b;
+	state[p++] = enc->px_prev.rgba.a;
+	for (i = 0; i < 64; i++) {
+		state[p++] = enc->index[i].rgba.r;
+		state[p++] = enc->index[i].rgba.g;
+		state[p++] = enc->index[i].rgba.b;
+		state[p++] = enc->index[i].rgba.a;
+	}
+	memcpy(state + p, header, QOI_HEADER_SIZE);
+	p += QOI_HEADER_SIZE;
+
+	/* A state that can not be written completely must not stay around */
+	sf = fopen(state_name, "wb");
+	ok =
+		sf && qoi_append_read_tail(f, size, state + p) &&
+		fwrite(state, 1, sizeof(state), sf) == sizeof(state);
+	if (sf && fclose(sf) != 0) {
+		ok = 0;
+	}
+	if (!ok) {
+		remove(state_name);
+	}
+}
+
+int qoi_append_rows(const char *filename, const void *pixels, int rows, int flags, const qoi_allocator *allocator) {
+	unsigned char header[QOI_HEADER_SIZE];
+	unsigned char *bytes = NULL, *data;
+	char *state_name = NULL;
+	qoi_desc desc;
+	qoi_enc_t enc, enc_open;
+	int size, end = 0, open_end, len, px_count, ok;
+	FILE *f;
+
+	if (filename == NULL || pixels == NULL || rows <= 0) {
+		return 0;
+	}
+
+	f = fopen(filename, "r+b");
+	if (!f) {
+		return 0;
+	}
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	if (
+		size <= 0 || fseek(f, 0, SEEK_SET) != 0 ||
+		fread(header, 1, QOI_HEADER_SIZE, f) != QOI_HEADER_SIZE ||
+		!qoi_decode_header(header, size, &desc, 0) ||
+		(unsigned int)rows >= QOI_PIXELS_MAX / desc.width - desc.height
+	) {
+		fclose(f);
+		return 0;
+	}
+
+	if (flags & QOI_APPEND_STATE) {
+		state_name = (char *) qoi_alloc(strlen(filename) + 7, QOI_ALLOC_TEMP, allocator);
+		if (state_name) {
+			strcpy(state_name, filename);
+			strcat(state_name, ".state");
+			end = qoi_append_load_state(state_name, f, size, header, &enc);
+		}
+	}
+
+	if (!end) {
+		data = (unsigned char *) qoi_alloc(size, QOI_ALLOC_TEMP, allocator);
+		if (data && fseek(f, 0, SEEK_SET) == 0 && fread(data, 1, size, f) == (size_t)size) {
+			end = qoi_append_scan(data, size, &desc, &enc);
+		}
+		qoi_free(data, allocator);
+	}
+
+	px_count = rows * desc.width;
+	if (end) {
+		bytes = (unsigned char *) qoi_alloc(
+			px_count * (desc.channels + 1) + 1 + 1 + sizeof(qoi_padding),
+			QOI_ALLOC_TEMP, allocator
+		);
+	}
+	if (!bytes) {
+		qoi_free(state_name, allocator);
+		fclose(f);
+		return 0;
+	}
+
+	/* The state is saved before the run is closed, so the next append can
+	reopen it */
+	len = qoi_encode_px(&enc, (const unsigned char *)pixels, px_count, desc.channels, bytes, NULL);
+	open_end = end + len;
+	enc_open = enc;
+	len += qoi_encode_end(&enc, bytes + len);
+
+	/* The new chunks are never shorter than the tail they replace, so the
+	file does not need to be truncated. */
+	desc.height += rows;
+	ok =
+		fseek(f, end, SEEK_SET) == 0 &&
+		fwrite(bytes, 1, len, f) == (size_t)len &&
+		fseek(f, 0, SEEK_SET) == 0 &&
+		qoi_encode_header(&desc, header) == QOI_HEADER_SIZE &&
+		fwrite(header, 1, QOI_HEADER_SIZE, f) == QOI_HEADER_SIZE &&
+		fflush(f) == 0;
+
+	if (state_name) {
+		if (ok) {
+			qoi_append_save_state(state_name, f, end + len, open_end, header, &enc_open);
+		}
+		else {
+			remove(state_name);
+		}
+	}
+
+	if (fclose(f) != 0) {
+		ok = 0;
+	}
+	qoi_free(bytes, allocator);
+	qoi_free(state_name, allocator);
+	return ok ? (int)desc.height : 0;
+}
+
 #endif /* QOI_NO_STDIO */
+
+#ifdef QOI_POSIX
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+/* glibc only defines O_DIRECT if _GNU_SOURCE was defined before the first
+system header, which is easy to miss. Its own name for the flag is always
+there. */
+#if defined(O_DIRECT)
+	#define QOI_O_DIRECT O_DIRECT
+#elif defined(__O_DIRECT)
+	#define QOI_O_DIRECT __O_DIRECT
+#endif
+
+typedef struct {
+	int fd;
+	int count;
+	int written;
+	unsigned char *ring;
+} qoi_fd_writer_t;
+
+/* Write all buffers of the ring up to count, including sink->pos bytes of the
+last one, with as few writev() calls as possible */
+static int qoi_fd_flush(qoi_sink_t *sink, qoi_fd_writer_t *writer) {
+	struct iovec iov[QOI_WRITE_FD_BUFFERS];
+	int i, first = 0;
+
+	for (i = 0; i < writer->count; i++) {
+		iov[i].iov_base = writer->ring + i * sink->size;
+		iov[i].iov_len = (i == writer->count - 1) ? sink->pos : sink->size;
+	}
+
+	while (first < writer->count) {
+		ssize_t written = writev(writer->fd, iov + first, writer->count - first);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 0;
+		}
+		writer->written += written;
+		while (first < writer->count && (size_t)written >= iov[first].iov_len) {
+			written -= iov[first].iov_len;
+			first++;
+		}
+		if (first < writer->count) {
+			iov[first].iov_base = (unsigned char *)iov[first].iov_base + written;
+			iov[first].iov_len -= written;
+		}
+	}
+	writer->count = 0;
+	return 1;
+}
+
+static int qoi_fd_next(qoi_sink_t *sink) {
+	qoi_fd_writer_t *writer = (qoi_fd_writer_t *)sink->user;
+
+	if (writer->count == QOI_WRITE_FD_BUFFERS && !qoi_fd_flush(sink, writer)) {
+		return 0;
+	}
+
+	sink->buffer = writer->ring + writer->count * sink->size;
+	sink->pos = 0;
+	writer->count++;
+	return 1;
+}
+
+int qoi_write_fd(int fd, const void *data, const qoi_desc *desc, int flags, const qoi_allocator *allocator) {
+	qoi_fd_writer_t writer;
+	qoi_sink_t sink;
+	int ok, size;
+	void *block;
+	#ifdef QOI_O_DIRECT
+	int direct_flags = -1;
+	#endif
+
+	if (fd < 0 || data == NULL || desc == NULL || !qoi_valid_desc(desc)) {
+		return 0;
+	}
+
+	/* Over-allocate for O_DIRECT, which requires the buffers to be aligned to
+	the logical block size. 4096 works for all common devices. */
+	block = qoi_alloc(QOI_WRITE_FD_BUFFERS * QOI_WRITE_FD_BUFFER_SIZE + 4096, QOI_ALLOC_TEMP, allocator);
+	if (!block) {
+		return 0;
+	}
+
+	#ifdef QOI_O_DIRECT
+	if ((flags & QOI_WRITE_DIRECT) && lseek(fd, 0, SEEK_CUR) == 0) {
+		direct_flags = fcntl(fd, F_GETFL);
+		if (direct_flags != -1 && fcntl(fd, F_SETFL, direct_flags | QOI_O_DIRECT) == -1) {
+			direct_flags = -1;
+		}
+	}
+	#else
+	(void)flags;
+	#endif
+
+	writer.fd = fd;
+	writer.count = 0;
+	writer.written = 0;
+	writer.ring = (unsigned char *)(((size_t)block + 4095) & ~(size_t)4095);
+
+	sink.buffer = NULL;
+	sink.size = QOI_WRITE_FD_BUFFER_SIZE;
+	sink.pos = QOI_WRITE_FD_BUFFER_SIZE;
+	sink.next = qoi_fd_next;
+	sink.user = &writer;
+
+	ok = qoi_encode_sink(data, desc, &sink);
+	size = writer.written + (writer.count - 1) * sink.size + sink.pos;
+
+	#ifdef QOI_O_DIRECT
+	if (direct_flags != -1) {
+		/* O_DIRECT only takes whole blocks. The bytes after the last whole
+		block are moved to the start of the ring and written normally. */
+		int tail = ok ? sink.pos & 4095 : 0;
+		sink.pos -= tail;
+		ok = ok && qoi_fd_flush(&sink, &writer);
+		fcntl(fd, F_SETFL, direct_flags);
+		if (ok && tail > 0) {
+			memmove(writer.ring, sink.buffer + sink.pos, tail);
+			sink.pos = tail;
+			writer.count = 1;
+			ok = qoi_fd_flush(&sink, &writer);
+		}
+	}
+	else
+	#endif
+	{
+		ok = ok && qoi_fd_flush(&sink, &writer);
+	}
+
+	qoi_free(block, allocator);
+	return ok ? size : 0;
+}
+
+#endif /* QOI_POSIX */
 #endif /* QOI_IMPLEMENTATION */
@@ -0,0 +1,247 @@
+/*
+
+SPDX-License-Identifier: MIT
+
+
+QOI Batch - Read and decode many QOI files in parallel
+
+-- About
+
+Loading thousands of small QOI files one after another with qoi_read spends
+most of its time in file system calls, not in decoding. This library reads and
+decodes a list of files on a pool of worker threads and hands each decoded
+image to a callback as soon as it is ready.
+
+
+-- Synopsis
+
+// Define `QOIBATCH_IMPLEMENTATION` in *one* C/C++ file before including this
+// library to create the implementation. qoi.h must be included before.
+
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+#define QOIBATCH_IMPLEMENTATION
+#include "qoibatch.h"
+
+void on_image(void *user, int index, void *pixels, const qoi_desc *desc) {
+	if (pixels) {
+		upload_texture(index, pixels, desc->width, desc->height);
+		qoi_free(pixels, NULL);
+	}
+}
+
+int decoded = qoi_read_batch(paths, path_count, 4, 0, on_image, NULL, NULL);
+
+
+-- Documentation
+
+This library requires POSIX threads and the POSIX file functions open, fstat
+and pread. Compile with -pthread and a POSIX feature level, e.g. -std=gnu99 or
+-D_POSIX_C_SOURCE=200809L.
+
+Each worker opens its next file, gets the size with a single fstat() instead of
+two seeks and reads it with pread() into a per-thread buffer that is reused for
+all files handled by that thread. Only the decoded pixels are allocated per
+file.
+
+*/
+
+
+/* -----------------------------------------------------------------------------
+Header - Public functions */
+
+#ifndef QOIBATCH_H
+#define QOIBATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The callback receives the index of the file in the paths array and either
+the decoded pixels and the qoi_desc from the file header, or NULL for both if
+the file could not be read or decoded. The pixels are owned by the callback and
+must be released with qoi_free() using the allocator passed to qoi_read_batch.
+
+The callback is called from the worker threads, possibly concurrently, and
+not necessarily in the order of the paths. */
+
+typedef void (*qoi_batch_callback)(void *user, int index, void *pixels, const qoi_desc *desc);
+
+
+/* Read and decode count files on threads worker threads. If threads is 0 or
+less, one thread per online CPU is used. channels has the same meaning as for
+qoi_read. The allocator may be NULL.
+
+The function returns after all files have been handed to the callback. It
+returns the number of images that were successfully decoded. */
+
+int qoi_read_batch(
+	const char *const *paths, int count, int channels, int threads,
+	qoi_batch_callback callback, void *user, const qoi_allocator *allocator
+);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* QOIBATCH_H */
+
+
+/* -----------------------------------------------------------------------------
+Implementation */
+
+#ifdef QOIBATCH_IMPLEMENTATION
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#ifndef QOIBATCH_MAX_THREADS
+	#define QOIBATCH_MAX_THREADS 64
+#endif
+
+typedef struct {
+	const char *const *paths;
+	int count;
+	int channels;
+	qoi_batch_callback callback;
+	void *user;
+	const qoi_allocator *allocator;
+
+	pthread_mutex_t lock;
+	int next;
+	int decoded;
+} qoibatch_job_t;
+
+static int qoibatch_claim(qoibatch_job_t *job) {
+	int index;
+	pthread_mutex_lock(&job->lock);
+	index = job->next < job->count ? job->next++ : -1;
+	pthread_mutex_unlock(&job->lock);
+	return index;
+}
+
+/* Read the whole file into the thread's buffer, growing it if needed. Returns
+the file size or 0 on failure. */
+static int qoibatch_load(const char *path, unsigned char **buffer, int *capacity, const qoi_allocator *allocator) {
+	struct stat st;
+	int fd, size, pos = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > INT_MAX) {
+		close(fd);
+		return 0;
+	}
+	size = (int)st.st_size;
+
+	if (size > *capacity) {
+		qoi_free(*buffer, allocator);
+		*capacity = size > *capacity * 2 ? size : *capacity * 2;
+		*buffer = (unsigned char *) qoi_alloc(*capacity, QOI_ALLOC_TEMP, allocator);
+		if (!*buffer) {
+			*capacity = 0;
+			close(fd);
+			return 0;
+		}
+	}
+
+	while (pos < size) {
+		ssize_t bytes_read = pread(fd, *buffer + pos, size - pos, pos);
+		if (bytes_read <= 0) {
+			close(fd);
+			return 0;
+		}
+		pos += bytes_read;
+	}
+
+	close(fd);
+	return size;
+}
+
+static void *qoibatch_worker(void *arg) {
+	qoibatch_job_t *job = (qoibatch_job_t *)arg;
+	unsigned char *buffer = NULL;
+	int capacity = 0, decoded = 0;
+	int index, size;
+
+	while ((index = qoibatch_claim(job)) >= 0) {
+		void *pixels = NULL;
+		qoi_desc desc;
+
+		size = qoibatch_load(job->paths[index], &buffer, &capacity, job->allocator);
+		if (size > 0) {
+			pixels = qoi_decode_ex(buffer, size, &desc, job->channels, job->allocator);
+		}
+
+		if (pixels) {
+			decoded++;
+		}
+		job->callback(job->user, index, pixels, pixels ? &desc : NULL);
+	}
+
+	qoi_free(buffer, job->allocator);
+
+	pthread_mutex_lock(&job->lock);
+	job->decoded += decoded;
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+int qoi_read_batch(
+	const char *const *paths, int count, int channels, int threads,
+	qoi_batch_callback callback, void *user, const qoi_allocator *allocator
+) {
+	pthread_t workers[QOIBATCH_MAX_THREADS];
+	qoibatch_job_t job;
+	int i, started;
+
+	if (paths == NULL || count <= 0 || callback == NULL) {
+		return 0;
+	}
+
+	if (threads <= 0) {
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads > count) {
+		threads = count;
+	}
+	if (threads > QOIBATCH_MAX_THREADS) {
+		threads = QOIBATCH_MAX_THREADS;
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	job.paths = paths;
+	job.count = count;
+	job.channels = channels;
+	job.callback = callback;
+	job.user = user;
+	job.allocator = allocator;
+	job.next = 0;
+	job.decoded = 0;
+	pthread_mutex_init(&job.lock, NULL);
+
+	/* The calling thread works as well, so only threads - 1 are started. If
+	starting a thread fails, the remaining ones just get more work. */
+	for (started = 0; started < threads - 1; started++) {
+		if (pthread_create(&workers[started], NULL, qoibatch_worker, &job) != 0) {
+			break;
+		}
+	}
+	qoibatch_worker(&job);
+
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	pthread_mutex_destroy(&job.lock);
+	return job.decoded;
+}
+
+#endif /* QOIBATCH_IMPLEMENTATION */
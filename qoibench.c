@@ -87,6 +87,23 @@ static uint64_t ns() {
 #endif
 }
 
+
+// -----------------------------------------------------------------------------
+// Page fault counter
+
+#if defined(__linux) || defined(__APPLE__)
+	#include <sys/resource.h>
+	static uint64_t page_faults() {
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_minflt + usage.ru_majflt;
+	}
+#else
+	static uint64_t page_faults() {
+		return 0;
+	}
+#endif
+
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 #define ERROR(...) printf("abort at line " TOSTRING(__LINE__) ": " __VA_ARGS__); printf("\n"); exit(1)
@@ -302,6 +319,9 @@ int opt_nodecode = 0;
 int opt_noencode = 0;
 int opt_norecurse = 0;
 int opt_onlytotals = 0;
+int opt_ctx = 0;
+int opt_largepages = 0;
+int opt_encode_flags = 0;
 
 enum {
 	LIBPNG,
@@ -320,6 +340,8 @@ typedef struct {
 	uint64_t size;
 	uint64_t encode_time;
 	uint64_t decode_time;
+	uint64_t encode_faults;
+	uint64_t decode_faults;
 } benchmark_lib_result_t;
 
 typedef struct {
@@ -328,6 +350,8 @@ typedef struct {
 	uint64_t px;
 	int w;
 	int h;
+	uint64_t qoi_retained;
+	uint64_t qoi_reserved;
 	benchmark_lib_result_t libs[BENCH_COUNT];
 } benchmark_result_t;
 
@@ -337,7 +361,7 @@ void benchmark_print_result(benchmark_result_t res) {
 	res.raw_size /= res.count;
 
 	double px = res.px;
-	printf("          decode ms   encode ms   decode mpps   encode mpps   size kb    rate\n");
+	printf("          decode ms   encode ms   decode mpps   encode mpps   size kb    rate   dec flt   enc flt\n");
 	for (int i = 0; i < BENCH_COUNT; ++i) {
 		if (opt_nopng && (i == LIBPNG || i == STBI)) {
 			continue;
@@ -345,37 +369,73 @@ void benchmark_print_result(benchmark_result_t res) {
 		res.libs[i].encode_time /= res.count;
 		res.libs[i].decode_time /= res.count;
 		res.libs[i].size /= res.count;
+		res.libs[i].encode_faults /= res.count;
+		res.libs[i].decode_faults /= res.count;
 		printf(
-			"%s   %8.1f    %8.1f      %8.2f      %8.2f  %8ld   %4.1f%%\n",
+			"%s   %8.1f    %8.1f      %8.2f      %8.2f  %8ld   %4.1f%%  %8ld  %8ld\n",
 			lib_names[i],
 			(double)res.libs[i].decode_time/1000000.0,
 			(double)res.libs[i].encode_time/1000000.0,
 			(res.libs[i].decode_time > 0 ? px / ((double)res.libs[i].decode_time/1000.0) : 0),
 			(res.libs[i].encode_time > 0 ? px / ((double)res.libs[i].encode_time/1000.0) : 0),
 			res.libs[i].size/1024,
-			((double)res.libs[i].size/(double)res.raw_size) * 100.0
+			((double)res.libs[i].size/(double)res.raw_size) * 100.0,
+			res.libs[i].decode_faults,
+			res.libs[i].encode_faults
+		);
+	}
+	if (opt_encode_flags && !opt_noencode) {
+		printf(
+			"qoi retained kb: %ld instead of %ld worst case (%.1f%% saved)\n",
+			res.qoi_retained / res.count / 1024,
+			res.qoi_reserved / res.count / 1024,
+			100.0 - ((double)res.qoi_retained / (double)res.qoi_reserved) * 100.0
 		);
 	}
 	printf("\n");
 }
 
-// Run __VA_ARGS__ a number of times and measure the time taken. The first
-// run is ignored.
-#define BENCHMARK_FN(NOWARMUP, RUNS, AVG_TIME, ...) \
+// Run __VA_ARGS__ a number of times and measure the time taken and the page
+// faults caused. The first run is ignored.
+#define BENCHMARK_FN(NOWARMUP, RUNS, AVG_TIME, AVG_FAULTS, ...) \
 	do { \
 		uint64_t time = 0; \
+		uint64_t faults = 0; \
 		for (int i = NOWARMUP; i <= RUNS; i++) { \
+			uint64_t faults_start = page_faults(); \
 			uint64_t time_start = ns(); \
 			__VA_ARGS__ \
 			uint64_t time_end = ns(); \
+			uint64_t faults_end = page_faults(); \
 			if (i > 0) { \
 				time += time_end - time_start; \
+				faults += faults_end - faults_start; \
 			} \
 		} \
 		AVG_TIME = time / RUNS; \
+		AVG_FAULTS = faults / RUNS; \
 	} while (0)
 
 
+// A context shared by all images when running with --ctx, so that its
+// buffers are only grown, never freed, between benchmark runs.
+qoi_ctx qoi_bench_ctx;
+
+// The allocator used for all qoi encode/decode calls. Set to the mmap based
+// qoi_large_alloc when running with --largepages; --shrink and --grow then
+// resize through qoi_large_realloc.
+qoi_large_options qoi_bench_large_options = {
+	.threshold = 1 << 20,
+	.flags = QOI_LARGE_HUGEPAGE | QOI_LARGE_POPULATE
+};
+qoi_allocator qoi_bench_large_allocator = {
+	.alloc = qoi_large_alloc,
+	.realloc = qoi_large_realloc,
+	.free = qoi_large_free,
+	.user = &qoi_bench_large_options
+};
+qoi_allocator *qoi_bench_allocator = NULL;
+
 benchmark_result_t benchmark_image(const char *path) {
 	int encoded_png_size;
 	int encoded_qoi_size;
@@ -430,55 +490,82 @@ benchmark_result_t benchmark_image(const char *path) {
 
 	if (!opt_nodecode) {
 		if (!opt_nopng) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[LIBPNG].decode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[LIBPNG].decode_time, res.libs[LIBPNG].decode_faults, {
 				int dec_w, dec_h;
 				void *dec_p = libpng_decode(encoded_png, encoded_png_size, &dec_w, &dec_h);
 				free(dec_p);
 			});
 
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[STBI].decode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[STBI].decode_time, res.libs[STBI].decode_faults, {
 				int dec_w, dec_h, dec_channels;
 				void *dec_p = stbi_load_from_memory(encoded_png, encoded_png_size, &dec_w, &dec_h, &dec_channels, 4);
 				free(dec_p);
 			});
 		}
 
-		BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[QOI].decode_time, {
-			qoi_desc desc;
-			void *dec_p = qoi_decode(encoded_qoi, encoded_qoi_size, &desc, 4);
-			free(dec_p);
-		});
+		if (opt_ctx) {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[QOI].decode_time, res.libs[QOI].decode_faults, {
+				qoi_desc desc;
+				qoi_decode_ctx(&qoi_bench_ctx, encoded_qoi, encoded_qoi_size, &desc, 4);
+			});
+		}
+		else {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[QOI].decode_time, res.libs[QOI].decode_faults, {
+				qoi_desc desc;
+				void *dec_p = qoi_decode_ex(encoded_qoi, encoded_qoi_size, &desc, 4, qoi_bench_allocator);
+				qoi_free(dec_p, qoi_bench_allocator);
+			});
+		}
 	}
 
 
 	// Encoding
 	if (!opt_noencode) {
 		if (!opt_nopng) {
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[LIBPNG].encode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[LIBPNG].encode_time, res.libs[LIBPNG].encode_faults, {
 				int enc_size;
 				void *enc_p = libpng_encode(pixels, w, h, channels, &enc_size);
 				res.libs[LIBPNG].size = enc_size;
 				free(enc_p);
 			});
 
-			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[STBI].encode_time, {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[STBI].encode_time, res.libs[STBI].encode_faults, {
 				int enc_size = 0;
 				stbi_write_png_to_func(stbi_write_callback, &enc_size, w, h, channels, pixels, 0);
 				res.libs[STBI].size = enc_size;
 			});
 		}
 
-		BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[QOI].encode_time, {
-			int enc_size;
-			void *enc_p = qoi_encode(pixels, &(qoi_desc){
-				.width = w,
-				.height = h, 
-				.channels = channels,
-				.colorspace = QOI_SRGB
-			}, &enc_size);
-			res.libs[QOI].size = enc_size;
-			free(enc_p);
-		});
+		if (opt_ctx) {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[QOI].encode_time, res.libs[QOI].encode_faults, {
+				int enc_size;
+				qoi_encode_ctx(&qoi_bench_ctx, pixels, &(qoi_desc){
+					.width = w,
+					.height = h, 
+					.channels = channels,
+					.colorspace = QOI_SRGB
+				}, &enc_size);
+				res.libs[QOI].size = enc_size;
+			});
+		}
+		else {
+			BENCHMARK_FN(opt_nowarmup, opt_runs, res.libs[QOI].encode_time, res.libs[QOI].encode_faults, {
+				int enc_size;
+				void *enc_p = qoi_encode_ex(pixels, &(qoi_desc){
+					.width = w,
+					.height = h, 
+					.channels = channels,
+					.colorspace = QOI_SRGB
+				}, &enc_size, opt_encode_flags, qoi_bench_allocator);
+				res.libs[QOI].size = enc_size;
+				qoi_free(enc_p, qoi_bench_allocator);
+			});
+		}
+
+		// The worst case buffer size that qoi_encode() keeps allocated, vs.
+		// the encoded size that remains with --shrink or --grow
+		res.qoi_reserved = w * h * (channels + 1) + QOI_HEADER_SIZE + sizeof(qoi_padding);
+		res.qoi_retained = opt_encode_flags ? res.libs[QOI].size : res.qoi_reserved;
 	}
 
 	free(pixels);
@@ -539,19 +626,27 @@ void benchmark_directory(const char *path, benchmark_result_t *grand_total) {
 		dir_total.count++;
 		dir_total.raw_size += res.raw_size;
 		dir_total.px += res.px;
+		dir_total.qoi_retained += res.qoi_retained;
+		dir_total.qoi_reserved += res.qoi_reserved;
 		for (int i = 0; i < BENCH_COUNT; ++i) {
 			dir_total.libs[i].encode_time += res.libs[i].encode_time;
 			dir_total.libs[i].decode_time += res.libs[i].decode_time;
 			dir_total.libs[i].size += res.libs[i].size;
+			dir_total.libs[i].encode_faults += res.libs[i].encode_faults;
+			dir_total.libs[i].decode_faults += res.libs[i].decode_faults;
 		}
 
 		grand_total->count++;
 		grand_total->raw_size += res.raw_size;
 		grand_total->px += res.px;
+		grand_total->qoi_retained += res.qoi_retained;
+		grand_total->qoi_reserved += res.qoi_reserved;
 		for (int i = 0; i < BENCH_COUNT; ++i) {
 			grand_total->libs[i].encode_time += res.libs[i].encode_time;
 			grand_total->libs[i].decode_time += res.libs[i].decode_time;
 			grand_total->libs[i].size += res.libs[i].size;
+			grand_total->libs[i].encode_faults += res.libs[i].encode_faults;
+			grand_total->libs[i].decode_faults += res.libs[i].decode_faults;
 		}
 	}
 	closedir(dir);
@@ -573,6 +668,10 @@ int main(int argc, char **argv) {
 		printf("    --nodecode ... don't run decoders\n");
 		printf("    --norecurse .. don't descend into directories\n");
 		printf("    --onlytotals . don't print individual image results\n");
+		printf("    --ctx ........ reuse a qoi_ctx for qoi encode/decode\n");
+		printf("    --largepages . use huge page, prefaulted mmap buffers for qoi\n");
+		printf("    --shrink ..... shrink the qoi encode result to its size\n");
+		printf("    --grow ....... grow the qoi encode result as needed\n");
 		printf("Examples\n");
 		printf("    qoibench 10 images/textures/\n");
 		printf("    qoibench 1 images/textures/ --nopng --nowarmup\n");
@@ -587,6 +686,10 @@ int main(int argc, char **argv) {
 		else if (strcmp(argv[i], "--nodecode") == 0) { opt_nodecode = 1; }
 		else if (strcmp(argv[i], "--norecurse") == 0) { opt_norecurse = 1; }
 		else if (strcmp(argv[i], "--onlytotals") == 0) { opt_onlytotals = 1; }
+		else if (strcmp(argv[i], "--ctx") == 0) { opt_ctx = 1; }
+		else if (strcmp(argv[i], "--largepages") == 0) { opt_largepages = 1; }
+		else if (strcmp(argv[i], "--shrink") == 0) { opt_encode_flags = QOI_ENCODE_SHRINK; }
+		else if (strcmp(argv[i], "--grow") == 0) { opt_encode_flags = QOI_ENCODE_GROW; }
 		else { ERROR("Unknown option %s", argv[i]); }
 	}
 
@@ -596,7 +699,12 @@ int main(int argc, char **argv) {
 	}
 
 	benchmark_result_t grand_total = {0};
+	if (opt_largepages) {
+		qoi_bench_allocator = &qoi_bench_large_allocator;
+	}
+	qoi_ctx_init(&qoi_bench_ctx, qoi_bench_allocator);
 	benchmark_directory(argv[2], &grand_total);
+	qoi_ctx_free(&qoi_bench_ctx);
 
 	if (grand_total.count > 0) {
 		printf("# Grand total for %s\n", argv[2]);
@@ -0,0 +1,1408 @@
+/*
+
+SPDX-License-Identifier: MIT
+
+
+QOI Cache - Caches in front of the QOI encoder and decoder
+
+-- About
+
+Pipelines often encode the very same pixels again and again: the same UI
+states, the same assets exported once more. This library puts a cache in front
+of qoi_encode that is keyed by a hash of the pixels and their qoi_desc, and
+returns the previously encoded bytes without running the encoder.
+
+Servers on the other hand read and decode the same hot files over and over.
+On POSIX systems, this library also provides a thread-safe cache of decoded
+images in front of qoi_read, bounded by a memory budget.
+
+Applications that load the same large assets on every start can keep their
+decoded pixels in a persistent disk cache. Later loads map the raw pixels
+directly, without decoding and without copying.
+
+
+-- Synopsis
+
+// Define `QOICACHE_IMPLEMENTATION` in *one* C/C++ file before including this
+// library to create the implementation. qoi.h must be included before.
+
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+#define QOICACHE_IMPLEMENTATION
+#include "qoicache.h"
+
+// Keep up to 64 MB of encoded images in memory and all of them on disk
+qoi_encode_cache cache;
+qoi_encode_cache_init(&cache, 64 << 20, "/var/cache/qoi", NULL);
+
+int len;
+const void *encoded = qoi_encode_cached(&cache, rgba_pixels, &desc, &len);
+fwrite(encoded, 1, len, fh);
+
+printf("hits: %llu, misses: %llu\n", cache.hits + cache.disk_hits, cache.misses);
+qoi_encode_cache_free(&cache);
+
+// Share up to 1 GB of decoded images between all server threads
+qoi_read_cache images;
+qoi_read_cache_init(&images, 1 << 30, NULL);
+
+const qoi_cached_image *image = qoi_read_cached(&images, "hot.qoi", 4);
+send_pixels(image->pixels, image->desc.width, image->desc.height);
+qoi_read_cache_release(&images, image);
+
+// Keep up to 4 GB of decoded assets on disk, across restarts
+qoi_disk_cache disk;
+qoi_disk_cache_init(&disk, "/var/cache/editor", 4ull << 30, 0, NULL);
+
+qoi_mapped_image asset;
+if (qoi_disk_cache_read(&disk, "terrain.qoi", 4, &asset)) {
+	upload_texture(asset.pixels, asset.desc.width, asset.desc.height);
+	qoi_disk_cache_release(&asset);
+}
+qoi_disk_cache_free(&disk);
+
+
+-- Documentation
+
+The key of an encoded image is a 128 bit hash of its pixels, computed in four
+independent 64 bit lanes, together with the width, height, channels and
+colorspace. The hash is not cryptographic; it guards against accidental, not
+against deliberate collisions.
+
+The in-memory tier keeps the encoded images in least recently used order and
+evicts the oldest ones once their total size exceeds the budget. The optional
+disk tier stores every encoded image as <dir>/<key>.qoi, so it survives
+restarts; it is never evicted by this library. A file found in the disk tier
+is decoded and hashed once before it is used, so that a damaged file is
+encoded again rather than returned.
+
+The read cache requires POSIX threads and the POSIX file functions open and
+fstat. Its images are keyed by path, modification time (in nanoseconds),
+size and inode of the file, and the requested channels, so a file that is
+replaced or rewritten is read again, even within the same second.
+
+Entries are spread over QOICACHE_SHARDS (16) shards, each with its own lock,
+hash table and budget, so that threads looking up different files rarely wait
+for each other. Each shard evicts with the CLOCK algorithm: a hit only sets a
+flag, and eviction sweeps over the entries, sparing those that were used since
+the last sweep.
+
+The images are handed out as immutable, reference counted buffers. An image
+that is still referenced is never evicted; it stays valid until released.
+
+The disk cache requires the POSIX functions mmap, opendir and futimens. Its
+files are named after a 128 bit hash of the encoded .qoi data and the requested
+channels: <dir>/<key>-<channels>.raw. Hashing the encoded data is much cheaper
+than decoding it. Each file starts with a 64 byte header, followed by the raw
+pixels:
+
+struct qoi_disk_cache_header_t {
+	char     magic[4];     // magic bytes "qoir"
+	uint32_t version;      // 1
+	uint32_t width;        // image width in pixels
+	uint32_t height;       // image height in pixels
+	uint32_t channels;     // channels of the pixels
+	uint32_t colorspace;   // colorspace of the source image
+	uint64_t key[2];       // the hash of the encoded data
+	uint64_t checksum[2];  // a hash of the pixels
+	uint8_t  reserved[8];  // zero
+};
+
+The header is stored in native byte order; a cache directory is not meant to be
+shared between machines of different byte order. Files are written under a
+temporary name and renamed into place, so a partially written file is never
+used. On load, the header and the file size are checked. With the
+QOI_DISK_CACHE_VERIFY flag, the pixels are hashed and compared to the
+checksum as well, which costs a full read of the pixels.
+
+Each hit updates the modification time of the file. Whenever a new file has
+been written, the oldest files are removed until the total size of all cache
+files is within the budget.
+
+*/
+
+
+/* -----------------------------------------------------------------------------
+Header - Public functions */
+
+#ifndef QOICACHE_H
+#define QOICACHE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A cache for encoded images. The counters may be read at any time; all other
+fields are private to the cache. A cache must not be used by more than one
+thread at a time.
+
+hits counts images found in memory, disk_hits images found in the disk tier,
+misses images that had to be encoded and evictions images that were dropped
+from memory to stay within the budget. */
+
+typedef struct qoicache_entry_t qoicache_entry_t;
+
+typedef struct {
+	unsigned long long hits;
+	unsigned long long disk_hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+
+	size_t budget;
+	size_t size;
+	int count;
+	char *dir;
+	qoicache_entry_t **buckets;
+	int bucket_count;
+	qoicache_entry_t *newest;
+	qoicache_entry_t *oldest;
+	qoi_ctx ctx;
+	qoi_allocator allocator;
+} qoi_encode_cache;
+
+
+/* Initialize a cache that keeps up to budget bytes of encoded images in
+memory. dir is the directory of the disk tier, which must already exist, or
+NULL for none. The allocator may be NULL. Returns 0 on failure. */
+
+int qoi_encode_cache_init(qoi_encode_cache *cache, size_t budget, const char *dir, const qoi_allocator *allocator);
+
+
+/* Release all memory held by the cache. The disk tier is left untouched. */
+
+void qoi_encode_cache_free(qoi_encode_cache *cache);
+
+
+/* Encode the pixels like qoi_encode(), or return the bytes of an earlier
+encode of the same pixels and desc.
+
+The returned pointer is owned by the cache. It remains valid until the next
+call with the same cache or until qoi_encode_cache_free() is called. The most
+recently returned image is always kept, even if it exceeds the budget on its
+own. Returns NULL on failure. */
+
+const void *qoi_encode_cached(qoi_encode_cache *cache, const void *data, const qoi_desc *desc, int *out_len);
+
+
+#ifdef QOI_POSIX
+#include <pthread.h>
+
+#ifndef QOICACHE_SHARDS
+	#define QOICACHE_SHARDS 16
+#endif
+
+/* A decoded image handed out by qoi_read_cached(). The pixels must not be
+modified. */
+
+typedef struct {
+	const void *pixels;
+	qoi_desc desc;
+	size_t size;
+} qoi_cached_image;
+
+typedef struct qoicache_image_t qoicache_image_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	qoicache_image_t **buckets;
+	int bucket_count;
+	int count;
+	qoicache_image_t *hand;
+	size_t size;
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+} qoicache_shard_t;
+
+/* A thread-safe cache of decoded images. All fields are private; use
+qoi_read_cache_stats() for the counters. */
+
+typedef struct {
+	size_t shard_budget;
+	qoi_allocator allocator;
+	qoicache_shard_t shards[QOICACHE_SHARDS];
+} qoi_read_cache;
+
+
+/* Initialize a cache that keeps up to budget bytes of decoded pixels. The
+allocator may be NULL. Returns 0 on failure. */
+
+int qoi_read_cache_init(qoi_read_cache *cache, size_t budget, const qoi_allocator *allocator);
+
+
+/* Release all memory held by the cache. All images must have been released
+before. */
+
+void qoi_read_cache_free(qoi_read_cache *cache);
+
+
+/* Read and decode a file like qoi_read(), or return the image from an earlier
+call for the same, unchanged file and channels. Returns NULL on failure.
+
+Each returned image holds a reference that must be given back with
+qoi_read_cache_release(). */
+
+const qoi_cached_image *qoi_read_cached(qoi_read_cache *cache, const char *filename, int channels);
+void qoi_read_cache_release(qoi_read_cache *cache, const qoi_cached_image *image);
+
+
+/* Sum up the counters of all shards. hits counts images found in the cache,
+misses files that had to be read and evictions images that were dropped to
+stay within the budget. Any pointer may be NULL. */
+
+void qoi_read_cache_stats(qoi_read_cache *cache, unsigned long long *hits, unsigned long long *misses, unsigned long long *evictions);
+
+
+
+/* A persistent cache of decoded pixels in a directory. All fields are
+private. The cache may be shared by several threads and processes. */
+
+#define QOI_DISK_CACHE_VERIFY 1
+
+typedef struct {
+	char *dir;
+	size_t budget;
+	int flags;
+	qoi_allocator allocator;
+} qoi_disk_cache;
+
+/* Decoded pixels from the disk cache. The pixels must not be modified. They are
+either mapped from a cache file or, on a miss, decoded into memory. */
+
+typedef struct {
+	const void *pixels;
+	qoi_desc desc;
+	size_t size;
+	void *map;
+	size_t map_size;
+	const qoi_allocator *allocator;
+} qoi_mapped_image;
+
+
+/* Initialize a disk cache in dir, which must already exist, with a budget
+for the total size of all cache files. flags may be QOI_DISK_CACHE_VERIFY. The
+allocator may be NULL. Returns 0 on failure. */
+
+int qoi_disk_cache_init(qoi_disk_cache *cache, const char *dir, size_t budget, int flags, const qoi_allocator *allocator);
+void qoi_disk_cache_free(qoi_disk_cache *cache);
+
+
+/* Get the pixels of an encoded QOI image with the given channels (3 or 4, or
+0 for the channels in the header), either mapped from the cache or decoded
+and added to the cache. qoi_disk_cache_read() does the same for a file.
+Returns 0 on failure. The image must be released with
+qoi_disk_cache_release() before the cache is freed. */
+
+int qoi_disk_cache_load(qoi_disk_cache *cache, const void *data, int size, int channels, qoi_mapped_image *image);
+int qoi_disk_cache_read(qoi_disk_cache *cache, const char *filename, int channels, qoi_mapped_image *image);
+void qoi_disk_cache_release(qoi_mapped_image *image);
+
+
+/* Remove the least recently used files until the cache is within its budget.
+This is done automatically after each new file. */
+
+void qoi_disk_cache_trim(qoi_disk_cache *cache);
+
+#endif /* QOI_POSIX */
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* QOICACHE_H */
+
+
+/* -----------------------------------------------------------------------------
+Implementation */
+
+#ifdef QOICACHE_IMPLEMENTATION
+#include <stdio.h>
+#include <string.h>
+#ifdef QOI_POSIX
+	#include <unistd.h>
+	#include <sys/stat.h>
+#endif
+
+struct qoicache_entry_t {
+	unsigned long long key[2];
+	qoi_desc desc;
+	int size;
+	qoicache_entry_t *chain;
+	qoicache_entry_t *newer;
+	qoicache_entry_t *older;
+	/* followed by size bytes of encoded data */
+};
+
+#define QOICACHE_DATA(E) ((unsigned char *)((E) + 1))
+
+static unsigned long long qoicache_rotl(unsigned long long v, int bits) {
+	return (v << bits) | (v >> (64 - bits));
+}
+
+static unsigned long long qoicache_mix(unsigned long long v) {
+	v ^= v >> 33;
+	v *= 0xff51afd7ed558ccdULL;
+	v ^= v >> 33;
+	v *= 0xc4ceb9fe1a85ec53ULL;
+	v ^= v >> 33;
+	return v;
+}
+
+/* 128 bit content key of the pixels, also used as the checksum of disk cache
+files. The cache trusts a matching key without comparing the pixels, hence
+two 64 bit halves that both depend on all lanes. The seed carries the image
+description, so the same bytes with a different size or channel count get a
+different key. */
+static void qoicache_hash(const void *data, size_t len, unsigned long long seed, unsigned long long key[2]) {
+	const unsigned char *bytes = (const unsigned char *)data;
+	const unsigned long long p1 = 0x9e3779b185ebca87ULL, p2 = 0xc2b2ae3d27d4eb4fULL;
+	unsigned long long h0, h1, h2, h3, w[4];
+	size_t i;
+
+	seed = qoicache_mix(seed ^ len);
+	h0 = seed + p1;
+	h1 = seed ^ p2;
+	h2 = seed - p1;
+	h3 = ~seed;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		memcpy(w, bytes + i, 32);
+		h0 = qoicache_rotl(h0 ^ w[0], 31) * p1;
+		h1 = qoicache_rotl(h1 ^ w[1], 31) * p1;
+		h2 = qoicache_rotl(h2 ^ w[2], 31) * p1;
+		h3 = qoicache_rotl(h3 ^ w[3], 31) * p1;
+	}
+	if (i < len) {
+		memset(w, 0, 32);
+		memcpy(w, bytes + i, len - i);
+		h0 = qoicache_rotl(h0 ^ w[0], 31) * p2;
+		h1 = qoicache_rotl(h1 ^ w[1], 31) * p2;
+		h2 = qoicache_rotl(h2 ^ w[2], 31) * p2;
+		h3 = qoicache_rotl(h3 ^ w[3], 31) * p2;
+	}
+
+	key[0] = qoicache_mix(h0 ^ qoicache_rotl(h2, 17));
+	key[1] = qoicache_mix(h1 ^ qoicache_rotl(h3, 17) ^ key[0]);
+}
+
+static unsigned long long qoicache_desc_seed(const qoi_desc *desc) {
+	return
+		((unsigned long long)desc->width << 32 | desc->height) ^
+		((unsigned long long)desc->channels << 8 | desc->colorspace);
+}
+
+static int qoicache_same_desc(const qoi_desc *a, const qoi_desc *b) {
+	return
+		a->width == b->width && a->height == b->height &&
+		a->channels == b->channels && a->colorspace == b->colorspace;
+}
+
+int qoi_encode_cache_init(qoi_encode_cache *cache, size_t budget, const char *dir, const qoi_allocator *allocator) {
+	memset(cache, 0, sizeof(qoi_encode_cache));
+	cache->budget = budget;
+	if (allocator) {
+		cache->allocator = *allocator;
+	}
+	qoi_ctx_init(&cache->ctx, &cache->allocator);
+
+	cache->bucket_count = 64;
+	cache->buckets = (qoicache_entry_t **) qoi_alloc(cache->bucket_count * sizeof(qoicache_entry_t *), QOI_ALLOC_CONTEXT, &cache->allocator);
+	if (!cache->buckets) {
+		return 0;
+	}
+	memset(cache->buckets, 0, cache->bucket_count * sizeof(qoicache_entry_t *));
+
+	if (dir) {
+		size_t len = strlen(dir) + 1;
+		cache->dir = (char *) qoi_alloc(len, QOI_ALLOC_CONTEXT, &cache->allocator);
+		if (!cache->dir) {
+			qoi_encode_cache_free(cache);
+			return 0;
+		}
+		memcpy(cache->dir, dir, len);
+	}
+	return 1;
+}
+
+void qoi_encode_cache_free(qoi_encode_cache *cache) {
+	qoicache_entry_t *entry = cache->newest;
+	while (entry) {
+		qoicache_entry_t *older = entry->older;
+		qoi_free(entry, &cache->allocator);
+		entry = older;
+	}
+	qoi_free(cache->buckets, &cache->allocator);
+	qoi_free(cache->dir, &cache->allocator);
+	qoi_ctx_free(&cache->ctx);
+	cache->buckets = NULL;
+	cache->dir = NULL;
+	cache->newest = NULL;
+	cache->oldest = NULL;
+	cache->size = 0;
+	cache->count = 0;
+}
+
+static void qoicache_unlink(qoi_encode_cache *cache, qoicache_entry_t *entry) {
+	if (entry->newer) {
+		entry->newer->older = entry->older;
+	}
+	else {
+		cache->newest = entry->older;
+	}
+	if (entry->older) {
+		entry->older->newer = entry->newer;
+	}
+	else {
+		cache->oldest = entry->newer;
+	}
+}
+
+static void qoicache_link_newest(qoi_encode_cache *cache, qoicache_entry_t *entry) {
+	entry->newer = NULL;
+	entry->older = cache->newest;
+	if (cache->newest) {
+		cache->newest->newer = entry;
+	}
+	else {
+		cache->oldest = entry;
+	}
+	cache->newest = entry;
+}
+
+static qoicache_entry_t **qoicache_bucket(qoicache_entry_t **buckets, int bucket_count, const unsigned long long key[2]) {
+	return &buckets[key[0] & (bucket_count - 1)];
+}
+
+/* Double the number of buckets once there are more entries than buckets. If
+that fails, the chains just get longer. */
+static void qoicache_grow(qoi_encode_cache *cache) {
+	int i, bucket_count = cache->bucket_count * 2;
+	qoicache_entry_t **buckets;
+
+	buckets = (qoicache_entry_t **) qoi_alloc(bucket_count * sizeof(qoicache_entry_t *), QOI_ALLOC_CONTEXT, &cache->allocator);
+	if (!buckets) {
+		return;
+	}
+	memset(buckets, 0, bucket_count * sizeof(qoicache_entry_t *));
+
+	for (i = 0; i < cache->bucket_count; i++) {
+		qoicache_entry_t *entry = cache->buckets[i];
+		while (entry) {
+			qoicache_entry_t *chain = entry->chain;
+			qoicache_entry_t **bucket = qoicache_bucket(buckets, bucket_count, entry->key);
+			entry->chain = *bucket;
+			*bucket = entry;
+			entry = chain;
+		}
+	}
+
+	qoi_free(cache->buckets, &cache->allocator);
+	cache->buckets = buckets;
+	cache->bucket_count = bucket_count;
+}
+
+static void qoicache_remove(qoi_encode_cache *cache, qoicache_entry_t *entry) {
+	qoicache_entry_t **link = qoicache_bucket(cache->buckets, cache->bucket_count, entry->key);
+	while (*link != entry) {
+		link = &(*link)->chain;
+	}
+	*link = entry->chain;
+	qoicache_unlink(cache, entry);
+	cache->size -= entry->size;
+	cache->count--;
+	qoi_free(entry, &cache->allocator);
+}
+
+/* Evict the oldest entries until the cache is within its budget, but always
+keep the newest one */
+static void qoicache_evict(qoi_encode_cache *cache) {
+	while (cache->size > cache->budget && cache->oldest != cache->newest) {
+		qoicache_remove(cache, cache->oldest);
+		cache->evictions++;
+	}
+}
+
+static qoicache_entry_t *qoicache_insert(qoi_encode_cache *cache, const unsigned long long key[2], const qoi_desc *desc, const void *data, int size) {
+	qoicache_entry_t **bucket;
+	qoicache_entry_t *entry;
+
+	entry = (qoicache_entry_t *) qoi_alloc(sizeof(qoicache_entry_t) + size, QOI_ALLOC_RESULT, &cache->allocator);
+	if (!entry) {
+		return NULL;
+	}
+	entry->key[0] = key[0];
+	entry->key[1] = key[1];
+	entry->desc = *desc;
+	entry->size = size;
+	memcpy(QOICACHE_DATA(entry), data, size);
+
+	if (cache->count >= cache->bucket_count) {
+		qoicache_grow(cache);
+	}
+	bucket = qoicache_bucket(cache->buckets, cache->bucket_count, key);
+	entry->chain = *bucket;
+	*bucket = entry;
+	qoicache_link_newest(cache, entry);
+	cache->size += size;
+	cache->count++;
+
+	qoicache_evict(cache);
+	return entry;
+}
+
+static void qoicache_path(const qoi_encode_cache *cache, const unsigned long long key[2], const char *ext, char *path, size_t path_size) {
+	snprintf(
+		path, path_size, "%s/%016llx%016llx%s",
+		cache->dir, key[0], key[1], ext
+	);
+}
+
+/* Load an encoded image from the disk tier into memory. The file is decoded
+and its pixels are hashed again, so that a truncated, mixed or foreign file is
+never returned; this is still much cheaper than encoding. */
+static qoicache_entry_t *qoicache_load(qoi_encode_cache *cache, const unsigned long long key[2], const qoi_desc *desc) {
+	qoicache_entry_t *entry = NULL;
+	unsigned long long file_key[2];
+	unsigned char *bytes;
+	const void *pixels;
+	char path[1024];
+	qoi_desc file_desc;
+	long size;
+	FILE *f;
+
+	qoicache_path(cache, key, ".qoi", path, sizeof(path));
+	f = fopen(path, "rb");
+	if (!f) {
+		return NULL;
+	}
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	bytes = size >= 22 && size < 0x7fffffff
+		? (unsigned char *) qoi_alloc(size, QOI_ALLOC_TEMP, &cache->allocator)
+		: NULL;
+	if (bytes && fread(bytes, 1, size, f) == (size_t)size && memcmp(bytes, "qoif", 4) == 0) {
+		file_desc.width = (unsigned int)bytes[4] << 24 | bytes[5] << 16 | bytes[6] << 8 | bytes[7];
+		file_desc.height = (unsigned int)bytes[8] << 24 | bytes[9] << 16 | bytes[10] << 8 | bytes[11];
+		file_desc.channels = bytes[12];
+		file_desc.colorspace = bytes[13];
+		pixels = qoicache_same_desc(&file_desc, desc)
+			? qoi_decode_ctx(&cache->ctx, bytes, (int)size, &file_desc, desc->channels)
+			: NULL;
+		if (pixels) {
+			qoicache_hash(pixels, (size_t)desc->width * desc->height * desc->channels, qoicache_desc_seed(desc), file_key);
+			if (file_key[0] == key[0] && file_key[1] == key[1]) {
+				entry = qoicache_insert(cache, key, desc, bytes, (int)size);
+			}
+		}
+	}
+
+	qoi_free(bytes, &cache->allocator);
+	fclose(f);
+	return entry;
+}
+
+/* Write an encoded image to the disk tier. It is written to a temporary file
+first and then renamed, so that readers never see a partial file. On POSIX
+systems the temporary name is unique per call, so that several caches, in one
+or more processes, can share the directory. */
+static void qoicache_store(qoi_encode_cache *cache, const unsigned long long key[2], const void *data, int size) {
+	char path[1024], tmp_path[1024];
+	FILE *f;
+	int ok;
+
+	qoicache_path(cache, key, ".qoi", path, sizeof(path));
+	#ifdef QOI_POSIX
+	{
+		int fd;
+
+		qoicache_path(cache, key, ".tmp.XXXXXX", tmp_path, sizeof(tmp_path));
+		fd = mkstemp(tmp_path);
+		if (fd < 0) {
+			return;
+		}
+		fchmod(fd, 0644);
+		f = fdopen(fd, "wb");
+		if (!f) {
+			close(fd);
+			remove(tmp_path);
+			return;
+		}
+	}
+	#else
+		qoicache_path(cache, key, ".tmp", tmp_path, sizeof(tmp_path));
+		f = fopen(tmp_path, "wb");
+		if (!f) {
+			return;
+		}
+	#endif
+	ok = fwrite(data, 1, size, f) == (size_t)size;
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(tmp_path, path) != 0) {
+		remove(tmp_path);
+	}
+}
+
+const void *qoi_encode_cached(qoi_encode_cache *cache, const void *data, const qoi_desc *desc, int *out_len) {
+	unsigned long long key[2];
+	qoicache_entry_t *entry;
+	const void *encoded;
+	int len;
+
+	if (
+		cache == NULL || cache->buckets == NULL || data == NULL ||
+		desc == NULL || out_len == NULL ||
+		desc->width == 0 || desc->height == 0 ||
+		desc->channels < 3 || desc->channels > 4
+	) {
+		return NULL;
+	}
+
+	qoicache_hash(data, (size_t)desc->width * desc->height * desc->channels, qoicache_desc_seed(desc), key);
+
+	entry = *qoicache_bucket(cache->buckets, cache->bucket_count, key);
+	while (entry && !(entry->key[0] == key[0] && entry->key[1] == key[1] && qoicache_same_desc(&entry->desc, desc))) {
+		entry = entry->chain;
+	}
+
+	if (entry) {
+		cache->hits++;
+		qoicache_unlink(cache, entry);
+		qoicache_link_newest(cache, entry);
+	}
+	else if (cache->dir && (entry = qoicache_load(cache, key, desc)) != NULL) {
+		cache->disk_hits++;
+	}
+	else {
+		/* Encode into the context's reused buffer, so that the entry is the
+		only allocation that depends on the image */
+		cache->misses++;
+		encoded = qoi_encode_ctx(&cache->ctx, data, desc, &len);
+		if (!encoded) {
+			return NULL;
+		}
+		entry = qoicache_insert(cache, key, desc, encoded, len);
+		if (cache->dir) {
+			qoicache_store(cache, key, encoded, len);
+		}
+		if (!entry) {
+			return NULL;
+		}
+	}
+
+	*out_len = entry->size;
+	return QOICACHE_DATA(entry);
+}
+
+#ifdef QOI_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct qoicache_image_t {
+	qoi_cached_image image;
+	unsigned long long hash;
+	long long mtime;
+	long long file_size;
+	unsigned long long inode;
+	int channels;
+	int refs;
+	int referenced;
+	int cached;
+	qoicache_shard_t *shard;
+	qoicache_image_t *chain;
+	qoicache_image_t *next;
+	qoicache_image_t *prev;
+	char *path;
+	/* followed by the path */
+};
+
+/* The modification time in nanoseconds. A file that is rewritten within the
+same second keeps its st_mtime, so the seconds alone can't tell it apart. */
+static long long qoicache_mtime(const struct stat *st) {
+	#ifdef __APPLE__
+		return (long long)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+	#else
+		return (long long)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+	#endif
+}
+
+/* FNV-1a of the path, with the rest of the key mixed in */
+static unsigned long long qoicache_image_hash(const char *path, const struct stat *st, int channels) {
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	while (*path) {
+		h = (h ^ (unsigned char)*path++) * 0x100000001b3ULL;
+	}
+	h ^= qoicache_mix((unsigned long long)qoicache_mtime(st) ^ (unsigned long long)st->st_size << 20);
+	h ^= qoicache_mix((unsigned long long)st->st_ino + channels);
+	return qoicache_mix(h);
+}
+
+int qoi_read_cache_init(qoi_read_cache *cache, size_t budget, const qoi_allocator *allocator) {
+	int i;
+
+	memset(cache, 0, sizeof(qoi_read_cache));
+	cache->shard_budget = budget / QOICACHE_SHARDS;
+	if (allocator) {
+		cache->allocator = *allocator;
+	}
+
+	for (i = 0; i < QOICACHE_SHARDS; i++) {
+		qoicache_shard_t *shard = &cache->shards[i];
+		shard->bucket_count = 16;
+		shard->buckets = (qoicache_image_t **) qoi_alloc(shard->bucket_count * sizeof(qoicache_image_t *), QOI_ALLOC_CONTEXT, &cache->allocator);
+		if (!shard->buckets) {
+			while (i-- > 0) {
+				qoi_free(cache->shards[i].buckets, &cache->allocator);
+				pthread_mutex_destroy(&cache->shards[i].lock);
+			}
+			return 0;
+		}
+		memset(shard->buckets, 0, shard->bucket_count * sizeof(qoicache_image_t *));
+		pthread_mutex_init(&shard->lock, NULL);
+	}
+	return 1;
+}
+
+static void qoicache_image_free(qoi_read_cache *cache, qoicache_image_t *entry) {
+	qoi_free((void *)entry->image.pixels, &cache->allocator);
+	qoi_free(entry, &cache->allocator);
+}
+
+void qoi_read_cache_free(qoi_read_cache *cache) {
+	int i;
+
+	for (i = 0; i < QOICACHE_SHARDS; i++) {
+		qoicache_shard_t *shard = &cache->shards[i];
+		qoicache_image_t *entry = shard->hand;
+		int n;
+
+		for (n = 0; n < shard->count; n++) {
+			qoicache_image_t *next = entry->next;
+			qoicache_image_free(cache, entry);
+			entry = next;
+		}
+		qoi_free(shard->buckets, &cache->allocator);
+		pthread_mutex_destroy(&shard->lock);
+		shard->buckets = NULL;
+		shard->hand = NULL;
+		shard->count = 0;
+		shard->size = 0;
+	}
+}
+
+/* Find an entry in a shard; the shard must be locked */
+static qoicache_image_t *qoicache_image_find(
+	qoicache_shard_t *shard, unsigned long long hash, const char *path,
+	const struct stat *st, int channels
+) {
+	qoicache_image_t *entry = shard->buckets[hash & (shard->bucket_count - 1)];
+	while (entry) {
+		if (
+			entry->hash == hash && entry->channels == channels &&
+			entry->mtime == qoicache_mtime(st) &&
+			entry->file_size == (long long)st->st_size &&
+			entry->inode == (unsigned long long)st->st_ino &&
+			strcmp(entry->path, path) == 0
+		) {
+			return entry;
+		}
+		entry = entry->chain;
+	}
+	return NULL;
+}
+
+/* Remove an entry from the hash table and the clock ring. It is freed only
+when it is no longer referenced. The shard must be locked. */
+static void qoicache_image_remove(qoi_read_cache *cache, qoicache_shard_t *shard, qoicache_image_t *entry) {
+	qoicache_image_t **link = &shard->buckets[entry->hash & (shard->bucket_count - 1)];
+	while (*link != entry) {
+		link = &(*link)->chain;
+	}
+	*link = entry->chain;
+
+	if (entry->next == entry) {
+		shard->hand = NULL;
+	}
+	else {
+		entry->prev->next = entry->next;
+		entry->next->prev = entry->prev;
+		if (shard->hand == entry) {
+			shard->hand = entry->next;
+		}
+	}
+
+	shard->size -= entry->image.size;
+	shard->count--;
+	entry->cached = 0;
+	if (entry->refs == 0) {
+		qoicache_image_free(cache, entry);
+	}
+}
+
+/* Sweep the clock hand until the shard is within its budget. Used entries get
+a second chance, referenced ones are skipped. Two full rounds are enough to
+clear all used flags; after that only referenced entries are left. */
+static void qoicache_image_evict(qoi_read_cache *cache, qoicache_shard_t *shard) {
+	int steps = shard->count * 2;
+
+	while (shard->size > cache->shard_budget && shard->hand && steps-- > 0) {
+		qoicache_image_t *entry = shard->hand;
+		shard->hand = entry->next;
+
+		if (entry->refs > 0) {
+			continue;
+		}
+		if (entry->referenced) {
+			entry->referenced = 0;
+			continue;
+		}
+		qoicache_image_remove(cache, shard, entry);
+		shard->evictions++;
+	}
+}
+
+static void qoicache_image_grow(qoi_read_cache *cache, qoicache_shard_t *shard) {
+	int i, bucket_count = shard->bucket_count * 2;
+	qoicache_image_t **buckets;
+
+	buckets = (qoicache_image_t **) qoi_alloc(bucket_count * sizeof(qoicache_image_t *), QOI_ALLOC_CONTEXT, &cache->allocator);
+	if (!buckets) {
+		return;
+	}
+	memset(buckets, 0, bucket_count * sizeof(qoicache_image_t *));
+
+	for (i = 0; i < shard->bucket_count; i++) {
+		qoicache_image_t *entry = shard->buckets[i];
+		while (entry) {
+			qoicache_image_t *chain = entry->chain;
+			qoicache_image_t **bucket = &buckets[entry->hash & (bucket_count - 1)];
+			entry->chain = *bucket;
+			*bucket = entry;
+			entry = chain;
+		}
+	}
+
+	qoi_free(shard->buckets, &cache->allocator);
+	shard->buckets = buckets;
+	shard->bucket_count = bucket_count;
+}
+
+/* Insert a new entry, just behind the clock hand, so that it is the last one
+to be visited. The shard must be locked. */
+static void qoicache_image_insert(qoi_read_cache *cache, qoicache_shard_t *shard, qoicache_image_t *entry) {
+	qoicache_image_t **bucket;
+
+	if (shard->count >= shard->bucket_count) {
+		qoicache_image_grow(cache, shard);
+	}
+	bucket = &shard->buckets[entry->hash & (shard->bucket_count - 1)];
+	entry->chain = *bucket;
+	*bucket = entry;
+
+	if (shard->hand) {
+		entry->next = shard->hand;
+		entry->prev = shard->hand->prev;
+		entry->prev->next = entry;
+		shard->hand->prev = entry;
+	}
+	else {
+		entry->next = entry;
+		entry->prev = entry;
+		shard->hand = entry;
+	}
+
+	entry->cached = 1;
+	shard->size += entry->image.size;
+	shard->count++;
+	qoicache_image_evict(cache, shard);
+}
+
+/* Read and decode the already opened file. The size from fstat is used, so
+that the file is read exactly once. */
+static void *qoicache_image_load(qoi_read_cache *cache, int fd, const struct stat *st, qoi_desc *desc, int channels) {
+	unsigned char *bytes;
+	void *pixels = NULL;
+	int size, pos = 0;
+
+	if (st->st_size <= 0 || st->st_size > 0x7fffffff) {
+		return NULL;
+	}
+	size = (int)st->st_size;
+
+	bytes = (unsigned char *) qoi_alloc(size, QOI_ALLOC_TEMP, &cache->allocator);
+	if (!bytes) {
+		return NULL;
+	}
+	while (pos < size) {
+		ssize_t bytes_read = read(fd, bytes + pos, size - pos);
+		if (bytes_read <= 0) {
+			break;
+		}
+		pos += bytes_read;
+	}
+
+	if (pos == size) {
+		pixels = qoi_decode_ex(bytes, size, desc, channels, &cache->allocator);
+	}
+	qoi_free(bytes, &cache->allocator);
+	return pixels;
+}
+
+const qoi_cached_image *qoi_read_cached(qoi_read_cache *cache, const char *filename, int channels) {
+	qoicache_image_t *entry, *existing;
+	qoicache_shard_t *shard;
+	unsigned long long hash;
+	struct stat st;
+	size_t path_len;
+	void *pixels;
+	qoi_desc desc;
+	int fd;
+
+	if (cache == NULL || filename == NULL || channels < 0 || channels > 4) {
+		return NULL;
+	}
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	hash = qoicache_image_hash(filename, &st, channels);
+	shard = &cache->shards[(hash >> 32) % QOICACHE_SHARDS];
+
+	pthread_mutex_lock(&shard->lock);
+	entry = qoicache_image_find(shard, hash, filename, &st, channels);
+	if (entry) {
+		entry->refs++;
+		entry->referenced = 1;
+		shard->hits++;
+	}
+	else {
+		shard->misses++;
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if (entry) {
+		close(fd);
+		return &entry->image;
+	}
+
+	/* Decode without holding the lock. If another thread decoded the same
+	file in the meantime, its entry is used instead. */
+	pixels = qoicache_image_load(cache, fd, &st, &desc, channels);
+	close(fd);
+	if (!pixels) {
+		return NULL;
+	}
+
+	path_len = strlen(filename) + 1;
+	entry = (qoicache_image_t *) qoi_alloc(sizeof(qoicache_image_t) + path_len, QOI_ALLOC_CONTEXT, &cache->allocator);
+	if (!entry) {
+		qoi_free(pixels, &cache->allocator);
+		return NULL;
+	}
+	entry->image.pixels = pixels;
+	entry->image.desc = desc;
+	entry->image.size = (size_t)desc.width * desc.height * (channels ? channels : desc.channels);
+	entry->hash = hash;
+	entry->mtime = qoicache_mtime(&st);
+	entry->file_size = st.st_size;
+	entry->inode = st.st_ino;
+	entry->channels = channels;
+	entry->refs = 1;
+	entry->referenced = 0;
+	entry->shard = shard;
+	entry->path = (char *)(entry + 1);
+	memcpy(entry->path, filename, path_len);
+
+	pthread_mutex_lock(&shard->lock);
+	existing = qoicache_image_find(shard, hash, filename, &st, channels);
+	if (existing) {
+		existing->refs++;
+		existing->referenced = 1;
+	}
+	else {
+		qoicache_image_insert(cache, shard, entry);
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if (existing) {
+		qoicache_image_free(cache, entry);
+		return &existing->image;
+	}
+	return &entry->image;
+}
+
+void qoi_read_cache_release(qoi_read_cache *cache, const qoi_cached_image *image) {
+	/* The public image is the first member of the entry */
+	qoicache_image_t *entry = (qoicache_image_t *)image;
+	qoicache_shard_t *shard;
+	int unused;
+
+	if (image == NULL) {
+		return;
+	}
+
+	shard = entry->shard;
+	pthread_mutex_lock(&shard->lock);
+	entry->refs--;
+	unused = entry->refs == 0 && !entry->cached;
+	if (entry->refs == 0 && entry->cached) {
+		/* The shard may have been over budget while this entry was held */
+		qoicache_image_evict(cache, shard);
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if (unused) {
+		qoicache_image_free(cache, entry);
+	}
+}
+
+void qoi_read_cache_stats(qoi_read_cache *cache, unsigned long long *hits, unsigned long long *misses, unsigned long long *evictions) {
+	unsigned long long h = 0, m = 0, e = 0;
+	int i;
+
+	for (i = 0; i < QOICACHE_SHARDS; i++) {
+		qoicache_shard_t *shard = &cache->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		h += shard->hits;
+		m += shard->misses;
+		e += shard->evictions;
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	if (hits) {
+		*hits = h;
+	}
+	if (misses) {
+		*misses = m;
+	}
+	if (evictions) {
+		*evictions = e;
+	}
+}
+
+#include <dirent.h>
+#include <sys/mman.h>
+
+#define QOICACHE_DISK_MAGIC   "qoir"
+#define QOICACHE_DISK_VERSION 1
+#define QOICACHE_DISK_HEADER  64
+
+typedef struct {
+	char magic[4];
+	unsigned int version;
+	unsigned int width;
+	unsigned int height;
+	unsigned int channels;
+	unsigned int colorspace;
+	unsigned long long key[2];
+	unsigned long long checksum[2];
+	unsigned char reserved[8];
+} qoicache_disk_header_t;
+
+typedef char qoicache_disk_header_fits[sizeof(qoicache_disk_header_t) == QOICACHE_DISK_HEADER ? 1 : -1];
+
+typedef struct {
+	long long mtime;
+	long long size;
+	char name[64];
+} qoicache_disk_file_t;
+
+int qoi_disk_cache_init(qoi_disk_cache *cache, const char *dir, size_t budget, int flags, const qoi_allocator *allocator) {
+	size_t len;
+
+	memset(cache, 0, sizeof(qoi_disk_cache));
+	cache->budget = budget;
+	cache->flags = flags;
+	if (allocator) {
+		cache->allocator = *allocator;
+	}
+	if (dir == NULL) {
+		return 0;
+	}
+
+	len = strlen(dir) + 1;
+	cache->dir = (char *) qoi_alloc(len, QOI_ALLOC_CONTEXT, &cache->allocator);
+	if (!cache->dir) {
+		return 0;
+	}
+	memcpy(cache->dir, dir, len);
+	return 1;
+}
+
+void qoi_disk_cache_free(qoi_disk_cache *cache) {
+	qoi_free(cache->dir, &cache->allocator);
+	cache->dir = NULL;
+}
+
+/* Map a cache file and check its header against the key and the expected
+pixel size. Returns 0 if there is no such file or it is not valid. */
+static int qoicache_disk_map(qoi_disk_cache *cache, const char *path, const unsigned long long key[2], int channels, qoi_mapped_image *image) {
+	const qoicache_disk_header_t *header;
+	unsigned long long checksum[2];
+	struct stat st;
+	size_t pixels_size;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < QOICACHE_DISK_HEADER) {
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		close(fd);
+		return 0;
+	}
+
+	/* Mark the file as recently used for qoi_disk_cache_trim() */
+	futimens(fd, NULL);
+	close(fd);
+
+	header = (const qoicache_disk_header_t *)map;
+	pixels_size = (size_t)header->width * header->height * header->channels;
+	if (
+		memcmp(header->magic, QOICACHE_DISK_MAGIC, 4) != 0 ||
+		header->version != QOICACHE_DISK_VERSION ||
+		header->key[0] != key[0] || header->key[1] != key[1] ||
+		header->channels < 3 || header->channels > 4 ||
+		(channels != 0 && header->channels != (unsigned int)channels) ||
+		(size_t)st.st_size != QOICACHE_DISK_HEADER + pixels_size
+	) {
+		munmap(map, st.st_size);
+		return 0;
+	}
+
+	if (cache->flags & QOI_DISK_CACHE_VERIFY) {
+		qoicache_hash((const unsigned char *)map + QOICACHE_DISK_HEADER, pixels_size, 0, checksum);
+		if (checksum[0] != header->checksum[0] || checksum[1] != header->checksum[1]) {
+			munmap(map, st.st_size);
+			return 0;
+		}
+	}
+
+	image->pixels = (const unsigned char *)map + QOICACHE_DISK_HEADER;
+	image->desc.width = header->width;
+	image->desc.height = header->height;
+	image->desc.channels = header->channels;
+	image->desc.colorspace = header->colorspace;
+	image->size = pixels_size;
+	image->map = map;
+	image->map_size = st.st_size;
+	image->allocator = NULL;
+	return 1;
+}
+
+/* Write the pixels to a temporary file and rename it into place, so that
+other readers never see a partial file. Failures are not reported; the
+pixels just won't be cached. */
+static int qoicache_disk_store(const char *path, const unsigned long long key[2], const qoi_mapped_image *image) {
+	qoicache_disk_header_t header;
+	char tmp_path[1100];
+	const unsigned char *parts[2];
+	size_t sizes[2];
+	int fd, i, ok = 1;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, QOICACHE_DISK_MAGIC, 4);
+	header.version = QOICACHE_DISK_VERSION;
+	header.width = image->desc.width;
+	header.height = image->desc.height;
+	header.channels = image->desc.channels;
+	header.colorspace = image->desc.colorspace;
+	header.key[0] = key[0];
+	header.key[1] = key[1];
+	qoicache_hash(image->pixels, image->size, 0, header.checksum);
+
+	/* The temporary name must be unique per call: threads of one process
+	may store the same key at the same time */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		return 0;
+	}
+	if (fchmod(fd, 0644) != 0) {
+		ok = 0;
+	}
+
+	parts[0] = (const unsigned char *)&header;
+	sizes[0] = QOICACHE_DISK_HEADER;
+	parts[1] = (const unsigned char *)image->pixels;
+	sizes[1] = image->size;
+	for (i = 0; i < 2 && ok; i++) {
+		size_t pos = 0;
+		while (pos < sizes[i]) {
+			ssize_t written = write(fd, parts[i] + pos, sizes[i] - pos);
+			if (written <= 0) {
+				ok = 0;
+				break;
+			}
+			pos += written;
+		}
+	}
+
+	ok = close(fd) == 0 && ok;
+	if (!ok || rename(tmp_path, path) != 0) {
+		unlink(tmp_path);
+		return 0;
+	}
+	return 1;
+}
+
+static int qoicache_disk_compare(const void *a, const void *b) {
+	const qoicache_disk_file_t *fa = (const qoicache_disk_file_t *)a;
+	const qoicache_disk_file_t *fb = (const qoicache_disk_file_t *)b;
+	return fa->mtime < fb->mtime ? -1 : fa->mtime > fb->mtime;
+}
+
+void qoi_disk_cache_trim(qoi_disk_cache *cache) {
+	qoicache_disk_file_t *files = NULL, *grown;
+	int count = 0, capacity = 0, i;
+	unsigned long long total = 0;
+	struct dirent *entry;
+	char path[1100];
+	DIR *dir;
+
+	dir = opendir(cache->dir);
+	if (!dir) {
+		return;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		size_t len = strlen(entry->d_name);
+		struct stat st;
+
+		if (len < 4 || len >= sizeof(files->name) || strcmp(entry->d_name + len - 4, ".raw") != 0) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", cache->dir, entry->d_name);
+		if (stat(path, &st) != 0) {
+			continue;
+		}
+
+		if (count == capacity) {
+			int new_capacity = capacity ? capacity * 2 : 64;
+			grown = (qoicache_disk_file_t *) qoi_alloc(new_capacity * sizeof(qoicache_disk_file_t), QOI_ALLOC_TEMP, &cache->allocator);
+			if (!grown) {
+				break;
+			}
+			if (files) {
+				memcpy(grown, files, count * sizeof(qoicache_disk_file_t));
+				qoi_free(files, &cache->allocator);
+			}
+			files = grown;
+			capacity = new_capacity;
+		}
+		files[count].mtime = st.st_mtime;
+		files[count].size = st.st_size;
+		memcpy(files[count].name, entry->d_name, len + 1);
+		total += st.st_size;
+		count++;
+	}
+	closedir(dir);
+
+	if (total > cache->budget) {
+		qsort(files, count, sizeof(qoicache_disk_file_t), qoicache_disk_compare);
+		for (i = 0; i < count && total > cache->budget; i++) {
+			snprintf(path, sizeof(path), "%s/%s", cache->dir, files[i].name);
+			if (unlink(path) == 0) {
+				total -= files[i].size;
+			}
+		}
+	}
+	qoi_free(files, &cache->allocator);
+}
+
+int qoi_disk_cache_load(qoi_disk_cache *cache, const void *data, int size, int channels, qoi_mapped_image *image) {
+	unsigned long long key[2];
+	char path[1024];
+	void *pixels;
+
+	if (
+		cache == NULL || cache->dir == NULL || data == NULL || image == NULL ||
+		size < 14 || (channels != 0 && channels != 3 && channels != 4)
+	) {
+		return 0;
+	}
+
+	qoicache_hash(data, size, 0, key);
+	snprintf(path, sizeof(path), "%s/%016llx%016llx-%d.raw", cache->dir, key[0], key[1], channels);
+
+	if (qoicache_disk_map(cache, path, key, channels, image)) {
+		return 1;
+	}
+
+	pixels = qoi_decode_ex(data, size, &image->desc, channels, &cache->allocator);
+	if (!pixels) {
+		return 0;
+	}
+	if (channels) {
+		image->desc.channels = channels;
+	}
+	image->pixels = pixels;
+	image->size = (size_t)image->desc.width * image->desc.height * image->desc.channels;
+	image->map = NULL;
+	image->map_size = 0;
+	image->allocator = &cache->allocator;
+
+	if (qoicache_disk_store(path, key, image)) {
+		qoi_disk_cache_trim(cache);
+	}
+	return 1;
+}
+
+int qoi_disk_cache_read(qoi_disk_cache *cache, const char *filename, int channels, qoi_mapped_image *image) {
+	struct stat st;
+	void *data;
+	int fd, ok = 0;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > 0x7fffffff) {
+		close(fd);
+		return 0;
+	}
+
+	/* The encoded file is only needed for hashing on a hit, so it is mapped
+	rather than read */
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return 0;
+	}
+
+	ok = qoi_disk_cache_load(cache, data, (int)st.st_size, channels, image);
+	munmap(data, st.st_size);
+	return ok;
+}
+
+void qoi_disk_cache_release(qoi_mapped_image *image) {
+	if (image->map) {
+		munmap(image->map, image->map_size);
+	}
+	else {
+		qoi_free((void *)image->pixels, image->allocator);
+	}
+	image->pixels = NULL;
+	image->map = NULL;
+}
+
+#endif /* QOI_POSIX */
+#endif /* QOICACHE_IMPLEMENTATION */
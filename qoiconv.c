@@ -12,7 +12,7 @@ Requires:
 	-"qoi.h" (https://github.com/phoboslab/qoi/blob/master/qoi.h)
 
 Compile with: 
-	gcc qoiconv.c -std=c99 -O3 -o qoiconv
+	gcc qoiconv.c -std=gnu99 -O3 -lpthread -o qoiconv
 
 */
 
@@ -31,12 +31,1187 @@ Compile with:
 
 #define STR_ENDS_WITH(S, E) (strcmp(S + strlen(S) - (sizeof(E)-1), E) == 0)
 
+#ifdef QOI_POSIX
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Daemon mode. "qoiconv --daemon <socket>" listens on a Unix domain socket and
+// converts images on a pool of worker threads that stay alive between jobs, so
+// clients don't pay for process startup per image.
+//
+// A client sends a qoiconv_request and passes two file descriptors with it
+// (SCM_RIGHTS): the input, which is read as a whole, and the output, which is
+// written from its current offset. Regular files, memfds and pipes all work.
+// Requests can be pipelined on one connection; each is answered with a
+// qoiconv_reply carrying the request id, in the order the jobs finish. A
+// QOICONV_STATS request takes no descriptors and is answered right away with
+// a reply followed by a qoiconv_stats.
+//
+// All structs are in native byte order; both ends run on the same machine.
+
+#define QOICONV_MAGIC 0x64696f71 // "qoid"
+
+enum {
+	QOICONV_PNG_TO_QOI = 1,
+	QOICONV_QOI_TO_PNG = 2,
+	QOICONV_QOI_TO_RAW = 3,
+	QOICONV_STATS = 4
+};
+
+typedef struct {
+	uint32_t magic;
+	uint32_t op;
+	uint32_t id;
+	uint32_t channels; // 0 = from the input, 3 or 4 to convert
+} qoiconv_request;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t id;
+	int32_t status; // 0 on success, -1 on failure
+	uint32_t width;
+	uint32_t height;
+	uint32_t channels;
+	uint64_t size; // bytes written to the output
+	uint64_t micros; // from receiving the request to finishing it
+} qoiconv_reply;
+
+typedef struct {
+	uint64_t queued; // jobs waiting for a worker
+	uint64_t busy; // jobs being converted
+	uint64_t done;
+	uint64_t failed;
+	uint64_t latency_avg; // microseconds, over all finished jobs
+	uint64_t latency_max;
+} qoiconv_stats;
+
+typedef struct {
+	int fd;
+	int refs;
+	pthread_mutex_t lock;
+} daemon_conn_t;
+
+typedef struct daemon_job_t {
+	struct daemon_job_t *next;
+	daemon_conn_t *conn;
+	qoiconv_request req;
+	int in_fd;
+	int out_fd;
+	uint64_t received;
+} daemon_job_t;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	daemon_job_t *head, *tail;
+	qoiconv_stats stats;
+	uint64_t latency_total;
+} queue = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER};
+
+static uint64_t daemon_micros(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int write_all(int fd, const void *data, size_t size) {
+	const char *p = data;
+	while (size > 0) {
+		ssize_t written = write(fd, p, size);
+		if (written < 0 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return 0;
+		}
+		p += written;
+		size -= written;
+	}
+	return 1;
+}
+
+static int read_all(int fd, void *data, size_t size) {
+	char *p = data;
+	while (size > 0) {
+		ssize_t bytes_read = read(fd, p, size);
+		if (bytes_read < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes_read <= 0) {
+			return 0;
+		}
+		p += bytes_read;
+		size -= bytes_read;
+	}
+	return 1;
+}
+
+static void daemon_conn_release(daemon_conn_t *conn) {
+	pthread_mutex_lock(&conn->lock);
+	int refs = --conn->refs;
+	pthread_mutex_unlock(&conn->lock);
+
+	if (refs == 0) {
+		close(conn->fd);
+		pthread_mutex_destroy(&conn->lock);
+		free(conn);
+	}
+}
+
+// Replies from several workers may be sent concurrently; the connection lock
+// keeps them from interleaving.
+static void daemon_reply(daemon_conn_t *conn, const qoiconv_reply *reply, const void *extra, size_t extra_size) {
+	pthread_mutex_lock(&conn->lock);
+	if (write_all(conn->fd, reply, sizeof(*reply)) && extra_size) {
+		write_all(conn->fd, extra, extra_size);
+	}
+	pthread_mutex_unlock(&conn->lock);
+}
+
+// Receive one request and up to two descriptors. Returns the number of
+// descriptors received, or -1 when the connection is closed or broken.
+static int daemon_recv(int fd, qoiconv_request *req, int fds[2]) {
+	union {
+		struct cmsghdr header;
+		char buffer[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	struct iovec iov = {req, sizeof(*req)};
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+
+	#ifdef MSG_CMSG_CLOEXEC
+	ssize_t got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	#else
+	ssize_t got = recvmsg(fd, &msg, 0);
+	#endif
+	if (got <= 0) {
+		return -1;
+	}
+
+	int count = 0;
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		int n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (int i = 0; i < n; i++) {
+			int received;
+			memcpy(&received, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+			if (count < 2) {
+				fds[count++] = received;
+			}
+			else {
+				close(received);
+			}
+		}
+	}
+
+	// The descriptors arrive with the first byte; the rest of the request
+	// may still be in flight.
+	if (
+		(msg.msg_flags & MSG_CTRUNC) ||
+		!read_all(fd, (char *)req + got, sizeof(*req) - got)
+	) {
+		while (count > 0) {
+			close(fds[--count]);
+		}
+		return -1;
+	}
+	return count;
+}
+
+// Map the whole input if it is a regular file (or memfd), read it otherwise.
+static void *load_fd(int fd, int *out_size, int *mapped) {
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		return NULL;
+	}
+
+	*mapped = 0;
+	if (S_ISREG(st.st_mode)) {
+		if (st.st_size <= 0 || st.st_size > INT_MAX) {
+			return NULL;
+		}
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			return NULL;
+		}
+		*mapped = 1;
+		*out_size = st.st_size;
+		return data;
+	}
+
+	int size = 0, capacity = 0;
+	unsigned char *data = NULL;
+	for (;;) {
+		if (size == capacity) {
+			unsigned char *grown = capacity < INT_MAX / 2
+				? realloc(data, capacity = capacity ? capacity * 2 : 64 * 1024)
+				: NULL;
+			if (!grown) {
+				free(data);
+				return NULL;
+			}
+			data = grown;
+		}
+		ssize_t bytes_read = read(fd, data + size, capacity - size);
+		if (bytes_read < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes_read < 0) {
+			free(data);
+			return NULL;
+		}
+		if (bytes_read == 0) {
+			break;
+		}
+		size += bytes_read;
+	}
+	*out_size = size;
+	return data;
+}
+
+// PNG output goes through stbi_write_png_to_func. Note that stb_image_write
+// encodes the whole PNG in memory first and calls this once with all of it,
+// so unlike QOI output (qoi_write_fd) it is not written in bounded pieces.
+typedef struct {
+	int fd;
+	int ok;
+	uint64_t size;
+} daemon_png_out_t;
+
+static void daemon_png_write(void *context, void *data, int size) {
+	daemon_png_out_t *out = context;
+	out->ok = out->ok && write_all(out->fd, data, size);
+	out->size += size;
+}
+
+static int daemon_convert(const daemon_job_t *job, qoiconv_reply *reply) {
+	int size, mapped, w, h, channels = job->req.channels;
+	if (channels != 0 && channels != 3 && channels != 4) {
+		return 0;
+	}
+
+	void *input = load_fd(job->in_fd, &size, &mapped);
+	if (!input) {
+		return 0;
+	}
+
+	void *pixels = NULL;
+	int ok = 0;
+	if (job->req.op == QOICONV_PNG_TO_QOI) {
+		if (stbi_info_from_memory(input, size, &w, &h, &channels)) {
+			// Force all odd encodings to be RGBA, as for files
+			if (job->req.channels) {
+				channels = job->req.channels;
+			}
+			else if (channels != 3) {
+				channels = 4;
+			}
+			pixels = stbi_load_from_memory(input, size, &w, &h, NULL, channels);
+		}
+		if (pixels) {
+			int written = qoi_write_fd(job->out_fd, pixels, &(qoi_desc){
+				.width = w,
+				.height = h,
+				.channels = channels,
+				.colorspace = QOI_SRGB
+			}, 0, NULL);
+			ok = written > 0;
+			reply->size = written;
+		}
+	}
+	else if (job->req.op == QOICONV_QOI_TO_PNG || job->req.op == QOICONV_QOI_TO_RAW) {
+		qoi_desc desc;
+		pixels = qoi_decode(input, size, &desc, channels);
+		if (pixels) {
+			w = desc.width;
+			h = desc.height;
+			channels = channels ? channels : desc.channels;
+
+			if (job->req.op == QOICONV_QOI_TO_PNG) {
+				daemon_png_out_t out = {job->out_fd, 1, 0};
+				ok = stbi_write_png_to_func(daemon_png_write, &out, w, h, channels, pixels, 0) && out.ok;
+				reply->size = out.size;
+			}
+			else {
+				reply->size = (uint64_t)w * h * channels;
+				ok = write_all(job->out_fd, pixels, reply->size);
+			}
+		}
+	}
+
+	if (ok) {
+		reply->width = w;
+		reply->height = h;
+		reply->channels = channels;
+	}
+
+	free(pixels);
+	if (mapped) {
+		munmap(input, size);
+	}
+	else {
+		free(input);
+	}
+	return ok;
+}
+
+static void *daemon_worker(void *arg) {
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&queue.lock);
+		while (!queue.head) {
+			pthread_cond_wait(&queue.ready, &queue.lock);
+		}
+		daemon_job_t *job = queue.head;
+		queue.head = job->next;
+		if (!queue.head) {
+			queue.tail = NULL;
+		}
+		queue.stats.queued--;
+		queue.stats.busy++;
+		pthread_mutex_unlock(&queue.lock);
+
+		qoiconv_reply reply = {.magic = QOICONV_MAGIC, .id = job->req.id, .status = -1};
+		int ok = daemon_convert(job, &reply);
+		close(job->in_fd);
+		close(job->out_fd);
+		reply.status = ok ? 0 : -1;
+		reply.micros = daemon_micros() - job->received;
+
+		pthread_mutex_lock(&queue.lock);
+		queue.stats.busy--;
+		if (ok) {
+			queue.stats.done++;
+		}
+		else {
+			queue.stats.failed++;
+		}
+		queue.latency_total += reply.micros;
+		if (reply.micros > queue.stats.latency_max) {
+			queue.stats.latency_max = reply.micros;
+		}
+		pthread_mutex_unlock(&queue.lock);
+
+		daemon_reply(job->conn, &reply, NULL, 0);
+		daemon_conn_release(job->conn);
+		free(job);
+	}
+	return NULL;
+}
+
+// One reader thread per connection queues the requests it receives.
+static void *daemon_reader(void *arg) {
+	daemon_conn_t *conn = arg;
+	qoiconv_request req;
+	int fds[2];
+	int count;
+
+	while ((count = daemon_recv(conn->fd, &req, fds)) >= 0) {
+		qoiconv_reply reply = {.magic = QOICONV_MAGIC, .id = req.id, .status = -1};
+		if (req.magic != QOICONV_MAGIC) {
+			while (count > 0) {
+				close(fds[--count]);
+			}
+			break;
+		}
+
+		if (req.op == QOICONV_STATS) {
+			pthread_mutex_lock(&queue.lock);
+			qoiconv_stats stats = queue.stats;
+			uint64_t finished = stats.done + stats.failed;
+			stats.latency_avg = finished ? queue.latency_total / finished : 0;
+			pthread_mutex_unlock(&queue.lock);
+
+			reply.status = 0;
+			reply.size = sizeof(stats);
+			daemon_reply(conn, &reply, &stats, sizeof(stats));
+			while (count > 0) {
+				close(fds[--count]);
+			}
+			continue;
+		}
+
+		daemon_job_t *job = count == 2 ? malloc(sizeof(daemon_job_t)) : NULL;
+		if (!job) {
+			while (count > 0) {
+				close(fds[--count]);
+			}
+			daemon_reply(conn, &reply, NULL, 0);
+			continue;
+		}
+
+		job->next = NULL;
+		job->conn = conn;
+		job->req = req;
+		job->in_fd = fds[0];
+		job->out_fd = fds[1];
+		job->received = daemon_micros();
+
+		pthread_mutex_lock(&conn->lock);
+		conn->refs++;
+		pthread_mutex_unlock(&conn->lock);
+
+		pthread_mutex_lock(&queue.lock);
+		if (queue.tail) {
+			queue.tail->next = job;
+		}
+		else {
+			queue.head = job;
+		}
+		queue.tail = job;
+		queue.stats.queued++;
+		pthread_cond_signal(&queue.ready);
+		pthread_mutex_unlock(&queue.lock);
+	}
+
+	daemon_conn_release(conn);
+	return NULL;
+}
+
+static int daemon_socket(const char *path, struct sockaddr_un *addr) {
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		printf("Socket path too long: %s\n", path);
+		return -1;
+	}
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		printf("Couldn't create socket\n");
+	}
+	return fd;
+}
+
+static int daemon_spawn(void *(*start)(void *), void *arg) {
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int ok = pthread_create(&thread, &attr, start, arg) == 0;
+	pthread_attr_destroy(&attr);
+	return ok;
+}
+
+int daemon_run(const char *path, int threads) {
+	struct sockaddr_un addr;
+	int fd = daemon_socket(path, &addr);
+	if (fd < 0) {
+		return 1;
+	}
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+		printf("Couldn't listen on %s\n", path);
+		return 1;
+	}
+
+	// A client going away mid-reply must not take the daemon with it
+	signal(SIGPIPE, SIG_IGN);
+
+	if (threads <= 0) {
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+	for (int i = 0; i < threads; i++) {
+		if (!daemon_spawn(daemon_worker, NULL)) {
+			printf("Couldn't start worker thread\n");
+			return 1;
+		}
+	}
+	printf("Listening on %s with %d threads\n", path, threads);
+	fflush(stdout);
+
+	for (;;) {
+		int client = accept(fd, NULL, NULL);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+				continue;
+			}
+			printf("Couldn't accept connection\n");
+			return 1;
+		}
+
+		daemon_conn_t *conn = malloc(sizeof(daemon_conn_t));
+		if (!conn) {
+			close(client);
+			continue;
+		}
+		conn->fd = client;
+		conn->refs = 1;
+		pthread_mutex_init(&conn->lock, NULL);
+		if (!daemon_spawn(daemon_reader, conn)) {
+			daemon_conn_release(conn);
+		}
+	}
+}
+
+// Client side of the daemon: send all pairs of files as pipelined jobs, then
+// collect the replies. With no files, print the daemon's stats.
+int daemon_send(const char *path, int count, char **files) {
+	struct sockaddr_un addr;
+	int fd = daemon_socket(path, &addr);
+	if (fd < 0) {
+		return 1;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		printf("Couldn't connect to %s\n", path);
+		return 1;
+	}
+
+	int sent = 0, failed = 0;
+	for (int i = 0; i < count || (count == 0 && i == 0); i++) {
+		qoiconv_request req = {QOICONV_MAGIC, QOICONV_STATS, i, 0};
+		union {
+			struct cmsghdr header;
+			char buffer[CMSG_SPACE(2 * sizeof(int))];
+		} control;
+		struct iovec iov = {&req, sizeof(req)};
+		struct msghdr msg = {0};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		int fds[2] = {-1, -1};
+
+		if (count > 0) {
+			const char *in = files[i * 2], *out = files[i * 2 + 1];
+			if (STR_ENDS_WITH(in, ".png") && STR_ENDS_WITH(out, ".qoi")) {
+				req.op = QOICONV_PNG_TO_QOI;
+			}
+			else if (STR_ENDS_WITH(in, ".qoi") && STR_ENDS_WITH(out, ".png")) {
+				req.op = QOICONV_QOI_TO_PNG;
+			}
+			else if (STR_ENDS_WITH(in, ".qoi") && STR_ENDS_WITH(out, ".raw")) {
+				req.op = QOICONV_QOI_TO_RAW;
+			}
+			else {
+				printf("Unsupported conversion %s -> %s\n", in, out);
+				failed++;
+				continue;
+			}
+
+			fds[0] = open(in, O_RDONLY);
+			fds[1] = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fds[0] < 0 || fds[1] < 0) {
+				printf("Couldn't open %s\n", fds[0] < 0 ? in : out);
+				failed++;
+				if (fds[0] >= 0) close(fds[0]);
+				if (fds[1] >= 0) close(fds[1]);
+				continue;
+			}
+
+			msg.msg_control = control.buffer;
+			msg.msg_controllen = CMSG_SPACE(sizeof(fds));
+			struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+			c->cmsg_level = SOL_SOCKET;
+			c->cmsg_type = SCM_RIGHTS;
+			c->cmsg_len = CMSG_LEN(sizeof(fds));
+			memcpy(CMSG_DATA(c), fds, sizeof(fds));
+		}
+
+		ssize_t written = sendmsg(fd, &msg, 0);
+		if (fds[0] >= 0) {
+			close(fds[0]);
+			close(fds[1]);
+		}
+		if (written <= 0 || !write_all(fd, (char *)&req + written, sizeof(req) - written)) {
+			printf("Couldn't send request to %s\n", path);
+			return 1;
+		}
+		sent++;
+	}
+
+	for (int i = 0; i < sent; i++) {
+		qoiconv_reply reply;
+		if (!read_all(fd, &reply, sizeof(reply)) || reply.magic != QOICONV_MAGIC) {
+			printf("Connection to %s lost\n", path);
+			return 1;
+		}
+
+		if (count == 0) {
+			qoiconv_stats stats;
+			if (reply.size != sizeof(stats) || !read_all(fd, &stats, sizeof(stats))) {
+				printf("Connection to %s lost\n", path);
+				return 1;
+			}
+			printf(
+				"queued: %llu, busy: %llu, done: %llu, failed: %llu, latency avg: %llu us, max: %llu us\n",
+				(unsigned long long)stats.queued, (unsigned long long)stats.busy,
+				(unsigned long long)stats.done, (unsigned long long)stats.failed,
+				(unsigned long long)stats.latency_avg, (unsigned long long)stats.latency_max
+			);
+		}
+		else if (reply.id >= (uint32_t)count) {
+			printf("Unexpected reply from %s\n", path);
+			return 1;
+		}
+		else if (reply.status != 0) {
+			printf("Couldn't convert %s\n", files[reply.id * 2]);
+			failed++;
+		}
+		else {
+			printf(
+				"%s -> %s: %ux%ux%u, %llu bytes, %llu us\n",
+				files[reply.id * 2], files[reply.id * 2 + 1],
+				reply.width, reply.height, reply.channels,
+				(unsigned long long)reply.size, (unsigned long long)reply.micros
+			);
+		}
+	}
+
+	close(fd);
+	return failed ? 1 : 0;
+}
+
+#ifdef __linux__
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+// Watch mode. "qoiconv --watch <dir>" converts every .png below dir into a
+// .qoi next to it, then keeps converting PNGs as they are written or moved in.
+// Events are collected until nothing has changed for WATCH_DEBOUNCE_MS (or
+// WATCH_MAX_DELAY_MS at most), then the changed files are converted on a pool
+// of threads. A PNG whose content hash matches the one it was last converted
+// with is skipped. Each .qoi is written to a temporary file and renamed into
+// place, so readers never see a partial image. PNGs that are deleted or moved
+// away are forgotten, so the table only holds files that exist.
+
+#define WATCH_DEBOUNCE_MS 100
+#define WATCH_MAX_DELAY_MS 1000
+#define WATCH_BUCKETS 1024
+#define WATCH_MAX_THREADS 64
+
+typedef struct watch_file_t {
+	struct watch_file_t *next;
+	uint64_t hash; // of the png content last converted, 0 if none
+	int pending;
+	int forgotten; // deleted while pending; removed after the flush
+	char path[];
+} watch_file_t;
+
+static struct {
+	int fd;
+	char **dirs; // path of each watch descriptor
+	int dirs_capacity;
+	watch_file_t *files[WATCH_BUCKETS];
+	watch_file_t **pending;
+	int pending_count, pending_capacity;
+	uint64_t pending_since;
+	pthread_mutex_t lock;
+	int next;
+} watch = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t watch_hash(const void *data, size_t size) {
+	// FNV-1a
+	const unsigned char *bytes = data;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	}
+	return hash ? hash : 1;
+}
+
+static char *watch_join(const char *dir, const char *name) {
+	size_t dir_len = strlen(dir), name_len = strlen(name);
+	char *path = malloc(dir_len + name_len + 2);
+	if (path) {
+		memcpy(path, dir, dir_len);
+		path[dir_len] = '/';
+		memcpy(path + dir_len + 1, name, name_len + 1);
+	}
+	return path;
+}
+
+// The .qoi path for a .png path; the extension has the same length.
+static char *watch_output(const char *png) {
+	size_t len = strlen(png);
+	char *qoi = malloc(len + 1);
+	if (qoi) {
+		memcpy(qoi, png, len - 4);
+		memcpy(qoi + len - 4, ".qoi", 5);
+	}
+	return qoi;
+}
+
+static void watch_queue(const char *path) {
+	uint64_t bucket = watch_hash(path, strlen(path)) % WATCH_BUCKETS;
+	watch_file_t *file = watch.files[bucket];
+	while (file && strcmp(file->path, path) != 0) {
+		file = file->next;
+	}
+
+	if (!file) {
+		file = malloc(sizeof(watch_file_t) + strlen(path) + 1);
+		if (!file) {
+			return;
+		}
+		file->hash = 0;
+		file->pending = 0;
+		file->forgotten = 0;
+		strcpy(file->path, path);
+		file->next = watch.files[bucket];
+		watch.files[bucket] = file;
+	}
+
+	file->forgotten = 0;
+	if (file->pending) {
+		return;
+	}
+	if (watch.pending_count == watch.pending_capacity) {
+		int capacity = watch.pending_capacity ? watch.pending_capacity * 2 : 64;
+		watch_file_t **grown = realloc(watch.pending, capacity * sizeof(watch_file_t *));
+		if (!grown) {
+			return;
+		}
+		watch.pending = grown;
+		watch.pending_capacity = capacity;
+	}
+	if (watch.pending_count == 0) {
+		watch.pending_since = daemon_micros();
+	}
+	file->pending = 1;
+	watch.pending[watch.pending_count++] = file;
+}
+
+// Remove a file from the table. It must not be pending.
+static void watch_remove(watch_file_t *file) {
+	uint64_t bucket = watch_hash(file->path, strlen(file->path)) % WATCH_BUCKETS;
+	watch_file_t **link = &watch.files[bucket];
+	while (*link != file) {
+		link = &(*link)->next;
+	}
+	*link = file->next;
+	free(file);
+}
+
+// Forget the png at path, or all pngs below path if it is a directory.
+// Pending files are only marked; watch_flush() removes them.
+static void watch_forget(const char *path, int is_dir) {
+	size_t len = strlen(path);
+	int first = is_dir ? 0 : (int)(watch_hash(path, len) % WATCH_BUCKETS);
+	int last = is_dir ? WATCH_BUCKETS : first + 1;
+	for (int bucket = first; bucket < last; bucket++) {
+		watch_file_t *file = watch.files[bucket];
+		while (file) {
+			watch_file_t *next = file->next;
+			int match = is_dir
+				? strncmp(file->path, path, len) == 0 && file->path[len] == '/'
+				: strcmp(file->path, path) == 0;
+			if (match && file->pending) {
+				file->forgotten = 1;
+			}
+			else if (match) {
+				watch_remove(file);
+			}
+			file = next;
+		}
+	}
+}
+
+// Queue the png if its .qoi is missing or not newer. The times are compared
+// with nanoseconds; a .qoi with the very same time as its png (on file
+// systems with coarse timestamps) is converted again to be safe.
+static void watch_queue_stale(const char *path) {
+	struct stat png_st, qoi_st;
+	char *qoi = watch_output(path);
+	if (!qoi) {
+		return;
+	}
+	if (
+		stat(path, &png_st) == 0 && S_ISREG(png_st.st_mode) && (
+			stat(qoi, &qoi_st) != 0 ||
+			qoi_st.st_mtim.tv_sec < png_st.st_mtim.tv_sec || (
+				qoi_st.st_mtim.tv_sec == png_st.st_mtim.tv_sec &&
+				qoi_st.st_mtim.tv_nsec <= png_st.st_mtim.tv_nsec
+			)
+		)
+	) {
+		watch_queue(path);
+	}
+	free(qoi);
+}
+
+// Watch dir and all directories below it (not following symlinks), queueing
+// stale pngs on the way.
+static void watch_add_dir(const char *dir) {
+	int wd = inotify_add_watch(
+		watch.fd, dir,
+		IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR
+	);
+	if (wd < 0) {
+		printf("Couldn't watch %s\n", dir);
+		return;
+	}
+
+	if (wd >= watch.dirs_capacity) {
+		int capacity = wd * 2 + 16;
+		char **grown = realloc(watch.dirs, capacity * sizeof(char *));
+		if (!grown) {
+			inotify_rm_watch(watch.fd, wd);
+			return;
+		}
+		memset(grown + watch.dirs_capacity, 0, (capacity - watch.dirs_capacity) * sizeof(char *));
+		watch.dirs = grown;
+		watch.dirs_capacity = capacity;
+	}
+	// A directory that was moved keeps its watch descriptor
+	if (!watch.dirs[wd] || strcmp(watch.dirs[wd], dir) != 0) {
+		free(watch.dirs[wd]);
+		watch.dirs[wd] = strdup(dir);
+	}
+
+	DIR *handle = opendir(dir);
+	if (!handle) {
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(handle))) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		char *path = watch_join(dir, entry->d_name);
+		struct stat st;
+		if (path && lstat(path, &st) == 0) {
+			if (S_ISDIR(st.st_mode)) {
+				watch_add_dir(path);
+			}
+			else if (STR_ENDS_WITH(path, ".png")) {
+				watch_queue_stale(path);
+			}
+		}
+		free(path);
+	}
+	closedir(handle);
+}
+
+static int watch_convert(watch_file_t *file) {
+	int size, mapped, w, h, channels, ok = 0;
+	int fd = open(file->path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	void *png = load_fd(fd, &size, &mapped);
+	close(fd);
+	if (!png) {
+		return 0;
+	}
+
+	uint64_t hash = watch_hash(png, size);
+	if (hash == file->hash) {
+		ok = -1;
+	}
+	else if (stbi_info_from_memory(png, size, &w, &h, &channels)) {
+		// Force all odd encodings to be RGBA
+		if (channels != 3) {
+			channels = 4;
+		}
+
+		void *pixels = stbi_load_from_memory(png, size, &w, &h, NULL, channels);
+		char *qoi = watch_output(file->path);
+		char *tmp = qoi ? malloc(strlen(qoi) + 5) : NULL;
+		if (pixels && tmp) {
+			sprintf(tmp, "%s.tmp", qoi);
+			int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (out >= 0) {
+				ok = qoi_write_fd(out, pixels, &(qoi_desc){
+					.width = w,
+					.height = h,
+					.channels = channels,
+					.colorspace = QOI_SRGB
+				}, 0, NULL) > 0;
+				ok = close(out) == 0 && ok && rename(tmp, qoi) == 0;
+				if (!ok) {
+					unlink(tmp);
+				}
+			}
+		}
+		if (ok) {
+			file->hash = hash;
+		}
+		free(tmp);
+		free(qoi);
+		stbi_image_free(pixels);
+	}
+
+	if (mapped) {
+		munmap(png, size);
+	}
+	else {
+		free(png);
+	}
+	return ok;
+}
+
+static void *watch_worker(void *arg) {
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&watch.lock);
+		int index = watch.next < watch.pending_count ? watch.next++ : -1;
+		pthread_mutex_unlock(&watch.lock);
+		if (index < 0) {
+			return NULL;
+		}
+
+		watch_file_t *file = watch.pending[index];
+		uint64_t start = daemon_micros();
+		int ok = watch_convert(file);
+		if (ok > 0) {
+			printf("%s: converted in %.1f ms\n", file->path, (daemon_micros() - start) / 1000.0);
+		}
+		else if (ok == 0) {
+			printf("Couldn't convert %s\n", file->path);
+		}
+		fflush(stdout);
+	}
+}
+
+// Convert all pending files. The calling thread works as well.
+static void watch_flush(int threads) {
+	pthread_t workers[WATCH_MAX_THREADS];
+	int started;
+
+	if (threads > watch.pending_count) {
+		threads = watch.pending_count;
+	}
+	if (threads > WATCH_MAX_THREADS) {
+		threads = WATCH_MAX_THREADS;
+	}
+
+	watch.next = 0;
+	for (started = 0; started < threads - 1; started++) {
+		if (pthread_create(&workers[started], NULL, watch_worker, NULL) != 0) {
+			break;
+		}
+	}
+	watch_worker(NULL);
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	for (int i = 0; i < watch.pending_count; i++) {
+		watch.pending[i]->pending = 0;
+		if (watch.pending[i]->forgotten) {
+			watch_remove(watch.pending[i]);
+		}
+	}
+	watch.pending_count = 0;
+}
+
+static void watch_event(const struct inotify_event *event) {
+	if (event->mask & IN_Q_OVERFLOW) {
+		// Events were lost; look at everything again
+		for (int wd = 0; wd < watch.dirs_capacity; wd++) {
+			if (watch.dirs[wd]) {
+				watch_add_dir(watch.dirs[wd]);
+			}
+		}
+		return;
+	}
+	if (event->wd < 0 || event->wd >= watch.dirs_capacity || !watch.dirs[event->wd]) {
+		return;
+	}
+	if (event->mask & IN_IGNORED) {
+		free(watch.dirs[event->wd]);
+		watch.dirs[event->wd] = NULL;
+		return;
+	}
+	if (!event->len) {
+		return;
+	}
+
+	char *path = watch_join(watch.dirs[event->wd], event->name);
+	if (!path) {
+		return;
+	}
+	if (event->mask & IN_ISDIR) {
+		if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+			watch_add_dir(path);
+		}
+		else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			watch_forget(path, 1);
+		}
+	}
+	else if (STR_ENDS_WITH(path, ".png")) {
+		if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+			watch_queue(path);
+		}
+		else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			watch_forget(path, 0);
+		}
+	}
+	free(path);
+}
+
+int watch_run(const char *dir, int threads) {
+	watch.fd = inotify_init1(IN_CLOEXEC);
+	if (watch.fd < 0) {
+		printf("Couldn't initialize inotify\n");
+		return 1;
+	}
+
+	if (threads <= 0) {
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	watch_add_dir(dir);
+	if (!watch.dirs_capacity) {
+		return 1;
+	}
+	printf("Watching %s, %d files to convert\n", dir, watch.pending_count);
+	watch_flush(threads);
+	fflush(stdout);
+
+	union {
+		struct inotify_event event;
+		char buffer[64 * 1024];
+	} events;
+
+	for (;;) {
+		int timeout = -1;
+		if (watch.pending_count) {
+			int waited = (daemon_micros() - watch.pending_since) / 1000;
+			timeout = waited < WATCH_MAX_DELAY_MS ? WATCH_DEBOUNCE_MS : 0;
+		}
+
+		struct pollfd pfd = {watch.fd, POLLIN, 0};
+		int ready = poll(&pfd, 1, timeout);
+		if (ready < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ready < 0) {
+			printf("Couldn't wait for events\n");
+			return 1;
+		}
+		if (ready == 0) {
+			watch_flush(threads);
+			continue;
+		}
+
+		ssize_t bytes_read = read(watch.fd, events.buffer, sizeof(events.buffer));
+		if (bytes_read < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytes_read <= 0) {
+			printf("Couldn't read events\n");
+			return 1;
+		}
+		for (char *p = events.buffer; p < events.buffer + bytes_read; ) {
+			const struct inotify_event *event = (const struct inotify_event *)p;
+			watch_event(event);
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+}
+#endif /* __linux__ */
+#endif
+
+
+// Crop a rectangle out of a qoi image without decoding all of it
+int crop_run(const char *rect, const char *infile, const char *outfile) {
+	int x, y, w, h, size, out_len;
+	if (sscanf(rect, "%d,%d,%d,%d", &x, &y, &w, &h) != 4) {
+		printf("Invalid rectangle %s, expected x,y,w,h\n", rect);
+		return 1;
+	}
+
+	FILE *fh = fopen(infile, "rb");
+	if (!fh) {
+		printf("Couldn't open %s\n", infile);
+		return 1;
+	}
+	fseek(fh, 0, SEEK_END);
+	size = ftell(fh);
+	fseek(fh, 0, SEEK_SET);
+	void *data = size > 0 ? malloc(size) : NULL;
+	if (!data || fread(data, 1, size, fh) != (size_t)size) {
+		printf("Couldn't read %s\n", infile);
+		fclose(fh);
+		free(data);
+		return 1;
+	}
+	fclose(fh);
+
+	void *cropped = qoi_crop(data, size, x, y, w, h, &out_len, NULL);
+	free(data);
+	if (!cropped) {
+		printf("Couldn't crop %s to %s\n", infile, rect);
+		return 1;
+	}
+
+	fh = fopen(outfile, "wb");
+	int written = fh && fwrite(cropped, 1, out_len, fh) == (size_t)out_len;
+	if (fh && fclose(fh) != 0) {
+		written = 0;
+	}
+	qoi_free(cropped, NULL);
+	if (!written) {
+		printf("Couldn't write %s\n", outfile);
+		return 1;
+	}
+	return 0;
+}
+
 int main(int argc, char **argv) {
+	if (argc == 5 && strcmp(argv[1], "--crop") == 0) {
+		return crop_run(argv[2], argv[3], argv[4]);
+	}
+
+	#ifdef QOI_POSIX
+	if (argc >= 3 && strcmp(argv[1], "--daemon") == 0) {
+		return daemon_run(argv[2], argc > 3 ? atoi(argv[3]) : 0);
+	}
+	if (argc >= 3 && strcmp(argv[1], "--stats") == 0) {
+		return daemon_send(argv[2], 0, NULL);
+	}
+	if (argc >= 5 && strcmp(argv[1], "--send") == 0 && argc % 2 == 1) {
+		return daemon_send(argv[2], (argc - 3) / 2, argv + 3);
+	}
+	#ifdef __linux__
+	if (argc >= 3 && strcmp(argv[1], "--watch") == 0) {
+		return watch_run(argv[2], argc > 3 ? atoi(argv[3]) : 0);
+	}
+	#endif
+	#endif
+
 	if (argc < 3) {
 		puts("Usage: qoiconv <infile> <outfile>");
+		puts("       qoiconv --crop <x,y,w,h> <infile.qoi> <outfile.qoi>");
+		#ifdef QOI_POSIX
+		puts("       qoiconv --daemon <socket> [threads]");
+		puts("       qoiconv --send <socket> <infile> <outfile> [<infile> <outfile> ...]");
+		puts("       qoiconv --stats <socket>");
+		#endif
+		#ifdef __linux__
+		puts("       qoiconv --watch <dir> [threads]");
+		#endif
 		puts("Examples:");
 		puts("  qoiconv input.png output.qoi");
 		puts("  qoiconv input.qoi output.png");
+		puts("  qoiconv --crop 512,0,256,256 input.qoi tile.qoi");
+		#ifdef QOI_POSIX
+		puts("  qoiconv --send /tmp/qoiconv.sock a.png a.qoi b.qoi b.raw");
+		#endif
 		exit(1);
 	}
 
@@ -0,0 +1,218 @@
+/*
+
+SPDX-License-Identifier: MIT
+
+
+Command line tool to create, extract and list QOI packs
+
+Requires:
+	-"qoi.h" (https://github.com/phoboslab/qoi/blob/master/qoi.h)
+	-"qoipack.h"
+
+Compile with: 
+	gcc qoipack.c -std=gnu99 -O3 -lpthread -o qoipack
+
+*/
+
+
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+
+#define QOIPACK_IMPLEMENTATION
+#include "qoipack.h"
+
+#include <stdio.h>
+
+
+void *fload(const char *path, int *out_size) {
+	FILE *fh = fopen(path, "rb");
+	if (!fh) {
+		return NULL;
+	}
+
+	fseek(fh, 0, SEEK_END);
+	int size = ftell(fh);
+	fseek(fh, 0, SEEK_SET);
+
+	void *buffer = malloc(size);
+	if (!buffer || size <= 0 || !fread(buffer, size, 1, fh)) {
+		free(buffer);
+		fclose(fh);
+		return NULL;
+	}
+	fclose(fh);
+
+	*out_size = size;
+	return buffer;
+}
+
+int fsave(const char *path, const void *data, int size) {
+	FILE *fh = fopen(path, "wb");
+	if (!fh) {
+		return 0;
+	}
+	int written = fwrite(data, 1, size, fh);
+	fclose(fh);
+	return written == size;
+}
+
+const char *basename_of(const char *path) {
+	const char *name = strrchr(path, '/');
+	return name ? name + 1 : path;
+}
+
+int pack(const char *pack_path, int count, char **files) {
+	const char **names = malloc(sizeof(char *) * count);
+	const void **streams = malloc(sizeof(void *) * count);
+	int *sizes = malloc(sizeof(int) * count);
+
+	for (int i = 0; i < count; i++) {
+		names[i] = basename_of(files[i]);
+		streams[i] = fload(files[i], &sizes[i]);
+		if (!streams[i]) {
+			printf("Couldn't read %s\n", files[i]);
+			return 0;
+		}
+	}
+
+	int pack_len;
+	void *pack_data = qoipack_build(names, streams, sizes, count, &pack_len, NULL);
+	if (!pack_data) {
+		printf("Couldn't build pack; all files must be valid QOI images\n");
+		return 0;
+	}
+
+	int ok = fsave(pack_path, pack_data, pack_len);
+	if (!ok) {
+		printf("Couldn't write %s\n", pack_path);
+	}
+
+	qoi_free(pack_data, NULL);
+	for (int i = 0; i < count; i++) {
+		free((void *)streams[i]);
+	}
+	free(names);
+	free(streams);
+	free(sizes);
+	return ok;
+}
+
+int tile(const char *pack_path, const char *image_path, int tile_size) {
+	qoi_desc desc;
+	void *pixels = qoi_read(image_path, &desc, 0);
+	if (!pixels) {
+		printf("Couldn't read %s\n", image_path);
+		return 0;
+	}
+
+	int pack_len;
+	void *pack_data = qoipack_encode_tiles(pixels, &desc, tile_size, tile_size, 0, &pack_len, NULL);
+	free(pixels);
+	if (!pack_data) {
+		printf("Couldn't encode tiles\n");
+		return 0;
+	}
+
+	int ok = fsave(pack_path, pack_data, pack_len);
+	if (!ok) {
+		printf("Couldn't write %s\n", pack_path);
+	}
+
+	qoi_free(pack_data, NULL);
+	return ok;
+}
+
+int unpack(const qoipack *pack, const char *dir) {
+	for (int i = 0; i < pack->count; i++) {
+		qoipack_entry entry;
+		char name[32];
+		char path[1024];
+
+		qoipack_get(pack, i, &entry);
+		if (!entry.name) {
+			snprintf(name, sizeof(name), "%d.qoi", i);
+			entry.name = name;
+		}
+
+		// Don't allow names to escape the target directory
+		if (strchr(entry.name, '/') || strcmp(entry.name, "..") == 0) {
+			printf("Skipping entry with invalid name %s\n", entry.name);
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", dir, entry.name);
+		if (!fsave(path, entry.data, entry.size)) {
+			printf("Couldn't write %s\n", path);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void list(const qoipack *pack) {
+	if (pack->type == QOIPACK_TYPE_TILES) {
+		printf(
+			"Tiled image %ux%u, %d channels, %dx%d tiles of %dx%d\n",
+			pack->desc.width, pack->desc.height, pack->desc.channels,
+			pack->tiles_x, pack->tiles_y, pack->tile_width, pack->tile_height
+		);
+	}
+	for (int i = 0; i < pack->count; i++) {
+		qoipack_entry entry;
+		qoipack_get(pack, i, &entry);
+		printf(
+			"%5d  %5ux%-5u  %8d  %s\n",
+			i, entry.width, entry.height, entry.size,
+			entry.name ? entry.name : "(unnamed)"
+		);
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc < 3) {
+		puts("Usage: qoipack <command> <pack> [files...]");
+		puts("Commands:");
+		puts("  pack ..... create a pack from the given .qoi files");
+		puts("  tile ..... split a .qoi image into tiles (default size: 512)");
+		puts("  unpack ... extract all images into a directory (default: .)");
+		puts("  list ..... list the images in a pack");
+		puts("Examples:");
+		puts("  qoipack pack sprites.qoip images/*.qoi");
+		puts("  qoipack tile map.qoip map.qoi 256");
+		puts("  qoipack unpack sprites.qoip images/");
+		puts("  qoipack list sprites.qoip");
+		exit(1);
+	}
+
+	if (strcmp(argv[1], "pack") == 0) {
+		return pack(argv[2], argc - 3, argv + 3) ? 0 : 1;
+	}
+	if (strcmp(argv[1], "tile") == 0) {
+		if (argc < 4) {
+			puts("Missing image for tile");
+			exit(1);
+		}
+		return tile(argv[2], argv[3], argc > 4 ? atoi(argv[4]) : 512) ? 0 : 1;
+	}
+
+	qoipack pack;
+	if (!qoipack_open(&pack, argv[2])) {
+		printf("Couldn't open pack %s\n", argv[2]);
+		exit(1);
+	}
+
+	int ok = 1;
+	if (strcmp(argv[1], "unpack") == 0) {
+		ok = unpack(&pack, argc > 3 ? argv[3] : ".");
+	}
+	else if (strcmp(argv[1], "list") == 0) {
+		list(&pack);
+	}
+	else {
+		printf("Unknown command %s\n", argv[1]);
+		ok = 0;
+	}
+
+	qoipack_close(&pack);
+	return ok ? 0 : 1;
+}
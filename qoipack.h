@@ -0,0 +1,1132 @@
+/*
+
+SPDX-License-Identifier: MIT
+
+
+QOI Pack - A container for many QOI images with an offset table
+
+-- About
+
+Shipping thousands of tiny .qoi files costs a file system lookup and a few
+syscalls per image. A pack concatenates standard QOI streams behind a table of
+contents, so that the whole set can be mapped into memory once and any image
+can be decoded directly from the mapping by its index or name.
+
+Every embedded stream is an unmodified QOI image; extracting the bytes of an
+entry yields a valid standalone .qoi file.
+
+The same container can also hold a single, very large image split into tiles
+of a fixed size. Each tile is a separate QOI stream, so any region of the image
+can be decoded without decoding everything before it. Tiles are encoded and
+decoded on multiple threads.
+
+Finally, a pack can hold the mip levels of a texture, each level a QOI stream
+half the size of the previous one. All levels are generated and encoded in a
+single pass over the source pixels.
+
+
+-- Synopsis
+
+// Define `QOIPACK_IMPLEMENTATION` in *one* C/C++ file before including this
+// library to create the implementation. qoi.h must be included before.
+
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+#define QOIPACK_IMPLEMENTATION
+#include "qoipack.h"
+
+// Build a pack in memory from already encoded QOI images
+int pack_len;
+void *pack_data = qoipack_build(names, streams, stream_sizes, count, &pack_len, NULL);
+
+// Map a pack file and decode an image by name
+qoipack pack;
+if (qoipack_open(&pack, "sprites.qoip")) {
+	qoi_desc desc;
+	int index = qoipack_find(&pack, "player_idle.qoi");
+	void *rgba_pixels = qoipack_decode(&pack, index, &desc, 4, NULL);
+	qoipack_close(&pack);
+}
+
+// Encode a gigapixel image as 512x512 tiles, using all CPUs
+void *tiled = qoipack_encode_tiles(pixels, &desc, 512, 512, 0, &tiled_len, NULL);
+
+// Decode the current viewport from a tiled pack
+qoipack_decode_region(&pack, view_x, view_y, view_w, view_h, view_pixels, 4, 0);
+
+// Encode a texture with all of its mip levels down to 1x1
+void *mips = qoi_encode_pyramid(pixels, &desc, 0, &mips_len, NULL);
+
+
+-- Data Format
+
+All values are stored as big endian, like in the QOI header.
+
+struct qoipack_header_t {
+	char     magic[4];     // magic bytes "qoip"
+	uint16_t version;      // 1
+	uint16_t type;         // 0 = pack of named images, 1 = tiled image,
+	                       // 2 = mip pyramid
+	uint32_t count;        // number of entries
+	uint32_t width;        // tiled image, pyramid: image width, otherwise 0
+	uint32_t height;       // tiled image, pyramid: image height, otherwise 0
+	uint32_t tile_width;   // tiled image: width of a tile, otherwise 0
+	uint32_t tile_height;  // tiled image: height of a tile, otherwise 0
+	uint8_t  channels;     // tiled image, pyramid: channels, otherwise 0
+	uint8_t  colorspace;   // tiled image, pyramid: colorspace, otherwise 0
+	uint16_t reserved;     // zero
+};
+
+The header is followed by count entries, sorted by name_hash. In a tiled image
+the entries are unnamed and stored row by row, top to bottom. Tiles at the
+right and bottom edge are smaller if the image size is not a multiple of the
+tile size. In a pyramid, the unnamed entries are the mip levels, starting with
+the full size image; each level is half the width and height of the previous
+one (rounded down, but at least 1).
+
+struct qoipack_entry_t {
+	uint64_t name_hash;    // 64 bit FNV-1a hash of the name
+	uint64_t offset;       // start of the QOI stream, from the start of the pack
+	uint32_t length;       // length of the QOI stream in bytes
+	uint32_t width;        // image width, same as in the stream's header
+	uint32_t height;       // image height, same as in the stream's header
+	uint32_t name_offset;  // start of the zero terminated name, 0 if unnamed
+};
+
+The header is 32 bytes and each entry is 32 bytes, so that the table can be
+read in place from a mapping. The names and the QOI streams follow the table.
+Each stream starts at an offset aligned to QOIPACK_ALIGN bytes.
+
+A pack, including its table, names and padding, is limited to QOIPACK_SIZE_MAX
+(2GB) bytes; qoipack_build() returns NULL for anything larger. Each stream,
+and so each tile, is limited to QOIPACK_PIXELS_MAX (400 million) pixels, the
+same limit qoi_encode() and qoi_decode() put on an image. The width and height of a tiled image are
+limited to QOIPACK_SIDE_MAX (2^31 - 1) pixels each.
+
+*/
+
+
+/* -----------------------------------------------------------------------------
+Header - Public functions */
+
+#ifndef QOIPACK_H
+#define QOIPACK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define QOIPACK_TYPE_PACK    0
+#define QOIPACK_TYPE_TILES   1
+#define QOIPACK_TYPE_PYRAMID 2
+
+typedef struct {
+	const unsigned char *data;
+	size_t size;
+	int count;
+	int type;
+	void *map;
+	size_t map_size;
+
+	/* Only for QOIPACK_TYPE_TILES and QOIPACK_TYPE_PYRAMID */
+	qoi_desc desc;
+
+	/* Only for QOIPACK_TYPE_TILES */
+	int tile_width;
+	int tile_height;
+	int tiles_x;
+	int tiles_y;
+} qoipack;
+
+typedef struct {
+	const char *name;
+	const void *data;
+	int size;
+	unsigned int width;
+	unsigned int height;
+} qoipack_entry;
+
+
+/* Build a pack from count already encoded QOI streams. names may be NULL or
+contain NULL entries for unnamed streams. Streams with an invalid QOI header
+are rejected.
+
+The function either returns NULL on failure or the pack data, allocated with
+the given allocator (which may be NULL). out_len is set to the size of the
+pack. The pack data should be released with qoi_free(). */
+
+void *qoipack_build(
+	const char *const *names, const void *const *streams, const int *sizes,
+	int count, int *out_len, const qoi_allocator *allocator
+);
+
+
+/* Open a pack from memory. The data must stay valid until the pack is closed.
+Returns 0 if the data is not a valid pack. */
+
+int qoipack_open_memory(qoipack *pack, const void *data, size_t size);
+
+
+/* Open a pack file. On POSIX systems, the file is mapped into memory, so that
+entries are decoded directly from the page cache. Elsewhere the file is read
+into memory. Returns 0 on failure. */
+
+int qoipack_open(qoipack *pack, const char *path);
+
+void qoipack_close(qoipack *pack);
+
+
+/* Find an entry by its name. Returns the index or -1 if there is no such
+entry. */
+
+int qoipack_find(const qoipack *pack, const char *name);
+
+
+/* Get the name, stream and dimensions of an entry. The name and data point into
+the pack. Returns 0 if the index is out of range. */
+
+int qoipack_get(const qoipack *pack, int index, qoipack_entry *entry);
+
+
+/* Decode an entry, same as qoi_decode_ex() on the entry's stream. */
+
+void *qoipack_decode(const qoipack *pack, int index, qoi_desc *desc, int channels, const qoi_allocator *allocator);
+
+
+/* Encode an image as tiles of tile_width x tile_height pixels into a tiled
+pack. The tiles are encoded on threads worker threads; 0 uses one thread per
+online CPU.
+
+The function either returns NULL on failure or the pack data, to be released
+with qoi_free(). out_len is set to the size of the pack. */
+
+void *qoipack_encode_tiles(
+	const void *data, const qoi_desc *desc, int tile_width, int tile_height,
+	int threads, int *out_len, const qoi_allocator *allocator
+);
+
+
+/* Get the index of the tile at tile column tx and tile row ty of a tiled pack,
+or -1 if out of range. */
+
+int qoipack_tile_index(const qoipack *pack, int tx, int ty);
+
+
+/* Decode the region x, y, width, height of a tiled pack into pixels, which
+must hold width * height * channels bytes (channels must be 3 or 4). Only the
+tiles intersecting the region are decoded, concurrently on threads worker
+threads (0 for one per online CPU). Returns 0 on failure. */
+
+int qoipack_decode_region(
+	const qoipack *pack, int x, int y, int width, int height,
+	void *pixels, int channels, int threads
+);
+
+
+/* Encode an image and its mip levels into a pyramid pack. levels is the
+number of levels including the full size image; 0 generates all levels down to
+1x1. Each level is downscaled from the previous one with a 2x2 box filter on
+the stored values. All levels are generated and encoded row by row in a single
+pass over the source pixels, while the rows are still in the cache.
+
+The function either returns NULL on failure or the pack data, to be released
+with qoi_free(). Level n can be decoded with qoipack_decode(pack, n, ...). */
+
+void *qoi_encode_pyramid(const void *data, const qoi_desc *desc, int levels, int *out_len, const qoi_allocator *allocator);
+
+
+/* The hash used for entry names */
+
+unsigned long long qoipack_hash(const char *name);
+
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* QOIPACK_H */
+
+
+/* -----------------------------------------------------------------------------
+Implementation */
+
+#ifdef QOIPACK_IMPLEMENTATION
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(QOIPACK_NO_MMAP) && defined(QOI_POSIX)
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#define QOIPACK_MMAP
+#else
+	#include <stdio.h>
+#endif
+
+/* Tiles are en-/decoded with POSIX threads, unless QOIPACK_NO_THREADS is
+defined. Without threads, all tiles are handled on the calling thread. */
+#if !defined(QOIPACK_NO_THREADS) && defined(QOI_POSIX)
+	#include <pthread.h>
+	#include <unistd.h>
+	#define QOIPACK_THREADS
+#endif
+
+#ifndef QOIPACK_MAX_THREADS
+	#define QOIPACK_MAX_THREADS 64
+#endif
+
+#ifndef QOIPACK_ALIGN
+	#define QOIPACK_ALIGN 8
+#endif
+
+#define QOIPACK_MAGIC \
+	(((unsigned int)'q') << 24 | ((unsigned int)'o') << 16 | \
+	 ((unsigned int)'i') <<  8 | ((unsigned int)'p'))
+#define QOIPACK_QOI_MAGIC \
+	(((unsigned int)'q') << 24 | ((unsigned int)'o') << 16 | \
+	 ((unsigned int)'i') <<  8 | ((unsigned int)'f'))
+#define QOIPACK_VERSION 1
+#define QOIPACK_HEADER_SIZE 32
+#define QOIPACK_ENTRY_SIZE 32
+
+/* Packs are built in a single allocation and their length is returned as an
+int, so a pack can not be larger than 2GB. */
+#define QOIPACK_SIZE_MAX ((size_t)0x7fffffff)
+
+/* Each stream, and so each tile, must pass the QOI_PIXELS_MAX check of
+qoi_encode() and qoi_decode(). The limit is repeated here, because qoi.h only
+defines it in its implementation. */
+#define QOIPACK_PIXELS_MAX 400000000u
+
+/* Region and tile coordinates of a tiled image are int */
+#define QOIPACK_SIDE_MAX 0x7fffffffu
+
+static void qoipack_write_32(unsigned char *bytes, unsigned int v) {
+	bytes[0] = (0xff000000 & v) >> 24;
+	bytes[1] = (0x00ff0000 & v) >> 16;
+	bytes[2] = (0x0000ff00 & v) >> 8;
+	bytes[3] = (0x000000ff & v);
+}
+
+static unsigned int qoipack_read_32(const unsigned char *bytes) {
+	return
+		(unsigned int)bytes[0] << 24 | (unsigned int)bytes[1] << 16 |
+		(unsigned int)bytes[2] << 8 | (unsigned int)bytes[3];
+}
+
+static void qoipack_write_64(unsigned char *bytes, unsigned long long v) {
+	qoipack_write_32(bytes, (unsigned int)(v >> 32));
+	qoipack_write_32(bytes + 4, (unsigned int)v);
+}
+
+static unsigned long long qoipack_read_64(const unsigned char *bytes) {
+	return (unsigned long long)qoipack_read_32(bytes) << 32 | qoipack_read_32(bytes + 4);
+}
+
+unsigned long long qoipack_hash(const char *name) {
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* Sort helper for qoipack_build */
+typedef struct {
+	unsigned long long hash;
+	int index;
+} qoipack_sort_t;
+
+/* Check a QOI header the same way qoi_decode() does, as the width and height
+are copied into the table */
+static int qoipack_valid_stream(const unsigned char *stream) {
+	unsigned int width = qoipack_read_32(stream + 4);
+	unsigned int height = qoipack_read_32(stream + 8);
+	return
+		qoipack_read_32(stream) == QOIPACK_QOI_MAGIC &&
+		width != 0 && height != 0 &&
+		stream[12] >= 3 && stream[12] <= 4 &&
+		stream[13] <= 1 &&
+		height < QOIPACK_PIXELS_MAX / width;
+}
+
+static int qoipack_compare(const void *a, const void *b) {
+	const qoipack_sort_t *sa = (const qoipack_sort_t *)a;
+	const qoipack_sort_t *sb = (const qoipack_sort_t *)b;
+	if (sa->hash != sb->hash) {
+		return sa->hash < sb->hash ? -1 : 1;
+	}
+	return sa->index - sb->index;
+}
+
+void *qoipack_build(
+	const char *const *names, const void *const *streams, const int *sizes,
+	int count, int *out_len, const qoi_allocator *allocator
+) {
+	qoipack_sort_t *order;
+	unsigned char *bytes;
+	size_t size, names_pos, data_pos;
+	int i;
+
+	if (streams == NULL || sizes == NULL || out_len == NULL || count < 0) {
+		return NULL;
+	}
+
+	order = (qoipack_sort_t *) qoi_alloc(sizeof(qoipack_sort_t) * (count + 1), QOI_ALLOC_TEMP, allocator);
+	if (!order) {
+		return NULL;
+	}
+
+	/* Validate the streams and compute the total size */
+	size = QOIPACK_HEADER_SIZE + (size_t)count * QOIPACK_ENTRY_SIZE;
+	for (i = 0; i < count; i++) {
+		const char *name = names ? names[i] : NULL;
+		const unsigned char *stream = (const unsigned char *)streams[i];
+
+		if (stream == NULL || sizes[i] < 22 || !qoipack_valid_stream(stream)) {
+			qoi_free(order, allocator);
+			return NULL;
+		}
+
+		if (name) {
+			size += strlen(name) + 1;
+		}
+		order[i].hash = name ? qoipack_hash(name) : 0;
+		order[i].index = i;
+	}
+
+	/* The streams are padded in table order, so the size has to be summed in
+	the same order */
+	qsort(order, count, sizeof(qoipack_sort_t), qoipack_compare);
+	for (i = 0; i < count; i++) {
+		size = (size + QOIPACK_ALIGN - 1) & ~(size_t)(QOIPACK_ALIGN - 1);
+		size += sizes[order[i].index];
+	}
+	if (size > QOIPACK_SIZE_MAX) {
+		qoi_free(order, allocator);
+		return NULL;
+	}
+
+	bytes = (unsigned char *) qoi_alloc(size, QOI_ALLOC_RESULT, allocator);
+	if (!bytes) {
+		qoi_free(order, allocator);
+		return NULL;
+	}
+	memset(bytes, 0, size);
+
+	qoipack_write_32(bytes, QOIPACK_MAGIC);
+	bytes[4] = 0;
+	bytes[5] = QOIPACK_VERSION;
+	bytes[6] = 0;
+	bytes[7] = QOIPACK_TYPE_PACK;
+	qoipack_write_32(bytes + 8, count);
+
+	/* Names first, then the streams */
+	names_pos = QOIPACK_HEADER_SIZE + (size_t)count * QOIPACK_ENTRY_SIZE;
+	data_pos = names_pos;
+	for (i = 0; i < count; i++) {
+		const char *name = names ? names[order[i].index] : NULL;
+		if (name) {
+			data_pos += strlen(name) + 1;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		int src = order[i].index;
+		const char *name = names ? names[src] : NULL;
+		const unsigned char *stream = (const unsigned char *)streams[src];
+		unsigned char *entry = bytes + QOIPACK_HEADER_SIZE + i * QOIPACK_ENTRY_SIZE;
+
+		data_pos = (data_pos + QOIPACK_ALIGN - 1) & ~(size_t)(QOIPACK_ALIGN - 1);
+		memcpy(bytes + data_pos, stream, sizes[src]);
+
+		qoipack_write_64(entry, order[i].hash);
+		qoipack_write_64(entry + 8, data_pos);
+		qoipack_write_32(entry + 16, sizes[src]);
+		qoipack_write_32(entry + 20, qoipack_read_32(stream + 4));
+		qoipack_write_32(entry + 24, qoipack_read_32(stream + 8));
+		qoipack_write_32(entry + 28, name ? (unsigned int)names_pos : 0);
+
+		if (name) {
+			size_t len = strlen(name) + 1;
+			memcpy(bytes + names_pos, name, len);
+			names_pos += len;
+		}
+		data_pos += sizes[src];
+	}
+
+	qoi_free(order, allocator);
+	*out_len = (int)size;
+	return bytes;
+}
+
+int qoipack_open_memory(qoipack *pack, const void *data, size_t size) {
+	const unsigned char *bytes = (const unsigned char *)data;
+	unsigned int count;
+	int i;
+
+	if (pack == NULL || bytes == NULL || size < QOIPACK_HEADER_SIZE) {
+		return 0;
+	}
+
+	count = qoipack_read_32(bytes + 8);
+	if (
+		qoipack_read_32(bytes) != QOIPACK_MAGIC ||
+		bytes[4] != 0 || bytes[5] != QOIPACK_VERSION ||
+		count > (size - QOIPACK_HEADER_SIZE) / QOIPACK_ENTRY_SIZE
+	) {
+		return 0;
+	}
+
+	/* Make sure all entries are within bounds, so that lookups don't have to
+	check again */
+	for (i = 0; i < (int)count; i++) {
+		const unsigned char *entry = bytes + QOIPACK_HEADER_SIZE + i * QOIPACK_ENTRY_SIZE;
+		unsigned long long offset = qoipack_read_64(entry + 8);
+		unsigned int length = qoipack_read_32(entry + 16);
+		unsigned int name_offset = qoipack_read_32(entry + 28);
+
+		if (offset > size || length > size - offset || name_offset >= size) {
+			return 0;
+		}
+		if (name_offset && memchr(bytes + name_offset, 0, size - name_offset) == NULL) {
+			return 0;
+		}
+	}
+
+	pack->data = bytes;
+	pack->size = size;
+	pack->count = count;
+	pack->type = bytes[7];
+	pack->map = NULL;
+	pack->map_size = 0;
+
+	pack->desc.width = qoipack_read_32(bytes + 12);
+	pack->desc.height = qoipack_read_32(bytes + 16);
+	pack->desc.channels = bytes[28];
+	pack->desc.colorspace = bytes[29];
+	pack->tile_width = qoipack_read_32(bytes + 20);
+	pack->tile_height = qoipack_read_32(bytes + 24);
+	pack->tiles_x = 0;
+	pack->tiles_y = 0;
+
+	if (pack->type == QOIPACK_TYPE_TILES) {
+		if (
+			pack->desc.width == 0 || pack->desc.height == 0 ||
+			pack->desc.width > QOIPACK_SIDE_MAX || pack->desc.height > QOIPACK_SIDE_MAX ||
+			pack->tile_width <= 0 || pack->tile_height <= 0
+		) {
+			return 0;
+		}
+		pack->tiles_x = (pack->desc.width + pack->tile_width - 1) / pack->tile_width;
+		pack->tiles_y = (pack->desc.height + pack->tile_height - 1) / pack->tile_height;
+		if ((unsigned long long)pack->tiles_x * pack->tiles_y != count) {
+			return 0;
+		}
+	}
+	else if (pack->type == QOIPACK_TYPE_PYRAMID) {
+		if (pack->desc.width == 0 || pack->desc.height == 0 || count == 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int qoipack_open(qoipack *pack, const char *path) {
+	void *map;
+	size_t size;
+
+	#ifdef QOIPACK_MMAP
+		struct stat st;
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			return 0;
+		}
+		if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+			close(fd);
+			return 0;
+		}
+		size = st.st_size;
+		map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) {
+			return 0;
+		}
+	#else
+		long file_size;
+		FILE *f = fopen(path, "rb");
+		if (!f) {
+			return 0;
+		}
+		fseek(f, 0, SEEK_END);
+		file_size = ftell(f);
+		if (file_size <= 0 || fseek(f, 0, SEEK_SET) != 0) {
+			fclose(f);
+			return 0;
+		}
+		size = file_size;
+		map = malloc(size);
+		if (!map || fread(map, 1, size, f) != size) {
+			free(map);
+			fclose(f);
+			return 0;
+		}
+		fclose(f);
+	#endif
+
+	if (!qoipack_open_memory(pack, map, size)) {
+		#ifdef QOIPACK_MMAP
+			munmap(map, size);
+		#else
+			free(map);
+		#endif
+		return 0;
+	}
+
+	pack->map = map;
+	pack->map_size = size;
+	return 1;
+}
+
+void qoipack_close(qoipack *pack) {
+	if (pack->map) {
+		#ifdef QOIPACK_MMAP
+			munmap(pack->map, pack->map_size);
+		#else
+			free(pack->map);
+		#endif
+	}
+	pack->data = NULL;
+	pack->size = 0;
+	pack->count = 0;
+	pack->map = NULL;
+	pack->map_size = 0;
+}
+
+int qoipack_get(const qoipack *pack, int index, qoipack_entry *entry) {
+	const unsigned char *e;
+	unsigned int name_offset;
+
+	if (pack == NULL || entry == NULL || index < 0 || index >= pack->count) {
+		return 0;
+	}
+
+	e = pack->data + QOIPACK_HEADER_SIZE + index * QOIPACK_ENTRY_SIZE;
+	name_offset = qoipack_read_32(e + 28);
+
+	entry->name = name_offset ? (const char *)pack->data + name_offset : NULL;
+	entry->data = pack->data + qoipack_read_64(e + 8);
+	entry->size = qoipack_read_32(e + 16);
+	entry->width = qoipack_read_32(e + 20);
+	entry->height = qoipack_read_32(e + 24);
+	return 1;
+}
+
+int qoipack_find(const qoipack *pack, const char *name) {
+	unsigned long long hash;
+	int lo = 0, hi, i;
+
+	if (pack == NULL || name == NULL) {
+		return -1;
+	}
+
+	/* Binary search for the first entry with this hash, then compare names
+	for all entries that share it */
+	hash = qoipack_hash(name);
+	hi = pack->count;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (qoipack_read_64(pack->data + QOIPACK_HEADER_SIZE + mid * QOIPACK_ENTRY_SIZE) < hash) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	for (i = lo; i < pack->count; i++) {
+		qoipack_entry entry;
+		if (qoipack_read_64(pack->data + QOIPACK_HEADER_SIZE + i * QOIPACK_ENTRY_SIZE) != hash) {
+			break;
+		}
+		qoipack_get(pack, i, &entry);
+		if (entry.name && strcmp(entry.name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void *qoipack_decode(const qoipack *pack, int index, qoi_desc *desc, int channels, const qoi_allocator *allocator) {
+	qoipack_entry entry;
+	if (!qoipack_get(pack, index, &entry)) {
+		return NULL;
+	}
+	return qoi_decode_ex(entry.data, entry.size, desc, channels, allocator);
+}
+
+/* Run fn for all indices 0..count-1 on a number of threads. Each worker
+thread has its own qoi_ctx and scratch buffer. Returns 0 if any call of fn
+failed. */
+typedef struct {
+	int (*fn)(void *job, int index, qoi_ctx *ctx, unsigned char *scratch);
+	void *job;
+	int count;
+	int scratch_size;
+	const qoi_allocator *allocator;
+	int next;
+	int failed;
+	#ifdef QOIPACK_THREADS
+	pthread_mutex_t lock;
+	#endif
+} qoipack_pool_t;
+
+static int qoipack_pool_claim(qoipack_pool_t *pool) {
+	int index;
+	#ifdef QOIPACK_THREADS
+	pthread_mutex_lock(&pool->lock);
+	#endif
+	index = (pool->next < pool->count && !pool->failed) ? pool->next++ : -1;
+	#ifdef QOIPACK_THREADS
+	pthread_mutex_unlock(&pool->lock);
+	#endif
+	return index;
+}
+
+static void qoipack_pool_fail(qoipack_pool_t *pool) {
+	#ifdef QOIPACK_THREADS
+	pthread_mutex_lock(&pool->lock);
+	#endif
+	pool->failed = 1;
+	#ifdef QOIPACK_THREADS
+	pthread_mutex_unlock(&pool->lock);
+	#endif
+}
+
+static void *qoipack_pool_worker(void *arg) {
+	qoipack_pool_t *pool = (qoipack_pool_t *)arg;
+	unsigned char *scratch;
+	qoi_ctx ctx;
+	int index;
+
+	qoi_ctx_init(&ctx, pool->allocator);
+	scratch = NULL;
+	if (pool->scratch_size > 0) {
+		scratch = (unsigned char *) qoi_alloc(pool->scratch_size, QOI_ALLOC_TEMP, pool->allocator);
+	}
+	if (pool->scratch_size > 0 && !scratch) {
+		qoipack_pool_fail(pool);
+		return NULL;
+	}
+
+	while ((index = qoipack_pool_claim(pool)) >= 0) {
+		if (!pool->fn(pool->job, index, &ctx, scratch)) {
+			qoipack_pool_fail(pool);
+		}
+	}
+
+	qoi_free(scratch, pool->allocator);
+	qoi_ctx_free(&ctx);
+	return NULL;
+}
+
+static int qoipack_parallel(
+	int (*fn)(void *job, int index, qoi_ctx *ctx, unsigned char *scratch),
+	void *job, int count, int scratch_size, int threads, const qoi_allocator *allocator
+) {
+	qoipack_pool_t pool;
+
+	pool.fn = fn;
+	pool.job = job;
+	pool.count = count;
+	pool.scratch_size = scratch_size;
+	pool.allocator = allocator;
+	pool.next = 0;
+	pool.failed = 0;
+
+	#ifdef QOIPACK_THREADS
+	{
+		pthread_t workers[QOIPACK_MAX_THREADS];
+		int i, started;
+
+		if (threads <= 0) {
+			threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		}
+		if (threads > count) {
+			threads = count;
+		}
+		if (threads > QOIPACK_MAX_THREADS) {
+			threads = QOIPACK_MAX_THREADS;
+		}
+
+		pthread_mutex_init(&pool.lock, NULL);
+		for (started = 0; started < threads - 1; started++) {
+			if (pthread_create(&workers[started], NULL, qoipack_pool_worker, &pool) != 0) {
+				break;
+			}
+		}
+		qoipack_pool_worker(&pool);
+		for (i = 0; i < started; i++) {
+			pthread_join(workers[i], NULL);
+		}
+		pthread_mutex_destroy(&pool.lock);
+	}
+	#else
+		(void)threads;
+		qoipack_pool_worker(&pool);
+	#endif
+
+	return !pool.failed;
+}
+
+typedef struct {
+	const unsigned char *pixels;
+	const qoi_desc *desc;
+	int tile_width;
+	int tile_height;
+	int tiles_x;
+	const void **streams;
+	int *sizes;
+	const qoi_allocator *allocator;
+} qoipack_encode_job_t;
+
+static int qoipack_encode_tile(void *arg, int index, qoi_ctx *ctx, unsigned char *scratch) {
+	qoipack_encode_job_t *job = (qoipack_encode_job_t *)arg;
+	int channels = job->desc->channels;
+	int x = (index % job->tiles_x) * job->tile_width;
+	int y = (index / job->tiles_x) * job->tile_height;
+	int w = job->desc->width - x < (unsigned int)job->tile_width ? (int)job->desc->width - x : job->tile_width;
+	int h = job->desc->height - y < (unsigned int)job->tile_height ? (int)job->desc->height - y : job->tile_height;
+	size_t stride = (size_t)job->desc->width * channels;
+	qoi_desc tile_desc;
+	int row;
+	(void)ctx;
+
+	/* Gather the tile's rows into one contiguous buffer */
+	for (row = 0; row < h; row++) {
+		memcpy(
+			scratch + row * w * channels,
+			job->pixels + (y + row) * stride + (size_t)x * channels,
+			w * channels
+		);
+	}
+
+	tile_desc = *job->desc;
+	tile_desc.width = w;
+	tile_desc.height = h;
+	job->streams[index] = qoi_encode_ex(scratch, &tile_desc, &job->sizes[index], QOI_ENCODE_SHRINK, job->allocator);
+	return job->streams[index] != NULL;
+}
+
+void *qoipack_encode_tiles(
+	const void *data, const qoi_desc *desc, int tile_width, int tile_height,
+	int threads, int *out_len, const qoi_allocator *allocator
+) {
+	qoipack_encode_job_t job;
+	unsigned char *bytes = NULL;
+	unsigned long long tiles;
+	int i, count;
+
+	if (
+		data == NULL || desc == NULL || out_len == NULL ||
+		desc->width == 0 || desc->height == 0 ||
+		desc->width > QOIPACK_SIDE_MAX || desc->height > QOIPACK_SIDE_MAX ||
+		desc->channels < 3 || desc->channels > 4 ||
+		tile_width <= 0 || tile_height <= 0 ||
+		(unsigned int)tile_height >= QOIPACK_PIXELS_MAX / tile_width
+	) {
+		return NULL;
+	}
+
+	/* Every tile needs at least an entry in the table */
+	tiles = (unsigned long long)((desc->width - 1) / tile_width + 1) * ((desc->height - 1) / tile_height + 1);
+	if (tiles > (QOIPACK_SIZE_MAX - QOIPACK_HEADER_SIZE) / QOIPACK_ENTRY_SIZE) {
+		return NULL;
+	}
+
+	job.pixels = (const unsigned char *)data;
+	job.desc = desc;
+	job.tile_width = tile_width;
+	job.tile_height = tile_height;
+	job.tiles_x = (desc->width - 1) / tile_width + 1;
+	job.allocator = allocator;
+	count = (int)tiles;
+
+	job.streams = (const void **) qoi_alloc(count * sizeof(void *), QOI_ALLOC_TEMP, allocator);
+	job.sizes = (int *) qoi_alloc(count * sizeof(int), QOI_ALLOC_TEMP, allocator);
+	if (!job.streams || !job.sizes) {
+		qoi_free(job.streams, allocator);
+		qoi_free(job.sizes, allocator);
+		return NULL;
+	}
+	memset(job.streams, 0, count * sizeof(void *));
+
+	if (qoipack_parallel(
+		qoipack_encode_tile, &job, count,
+		tile_width * tile_height * desc->channels, threads, allocator
+	)) {
+		/* All tiles are unnamed, so they keep their order in the table */
+		bytes = (unsigned char *) qoipack_build(NULL, job.streams, job.sizes, count, out_len, allocator);
+	}
+
+	if (bytes) {
+		bytes[7] = QOIPACK_TYPE_TILES;
+		qoipack_write_32(bytes + 12, desc->width);
+		qoipack_write_32(bytes + 16, desc->height);
+		qoipack_write_32(bytes + 20, tile_width);
+		qoipack_write_32(bytes + 24, tile_height);
+		bytes[28] = desc->channels;
+		bytes[29] = desc->colorspace;
+	}
+
+	for (i = 0; i < count; i++) {
+		qoi_free((void *)job.streams[i], allocator);
+	}
+	qoi_free(job.streams, allocator);
+	qoi_free(job.sizes, allocator);
+	return bytes;
+}
+
+int qoipack_tile_index(const qoipack *pack, int tx, int ty) {
+	if (
+		pack == NULL || pack->type != QOIPACK_TYPE_TILES ||
+		tx < 0 || ty < 0 || tx >= pack->tiles_x || ty >= pack->tiles_y
+	) {
+		return -1;
+	}
+	return ty * pack->tiles_x + tx;
+}
+
+typedef struct {
+	const qoipack *pack;
+	int x, y, width, height;
+	int tx0, ty0, tiles_x;
+	unsigned char *pixels;
+	int channels;
+} qoipack_region_job_t;
+
+static int qoipack_decode_tile(void *arg, int index, qoi_ctx *ctx, unsigned char *scratch) {
+	qoipack_region_job_t *job = (qoipack_region_job_t *)arg;
+	const qoipack *pack = job->pack;
+	int tx = job->tx0 + index % job->tiles_x;
+	int ty = job->ty0 + index / job->tiles_x;
+	int tile_x = tx * pack->tile_width;
+	int tile_y = ty * pack->tile_height;
+	int x0, y0, x1, y1, row;
+	qoipack_entry entry;
+	unsigned char *tile;
+	qoi_desc desc;
+	(void)scratch;
+
+	if (!qoipack_get(pack, qoipack_tile_index(pack, tx, ty), &entry)) {
+		return 0;
+	}
+
+	tile = (unsigned char *) qoi_decode_ctx(ctx, entry.data, entry.size, &desc, job->channels);
+	if (
+		!tile ||
+		desc.width != (pack->desc.width - tile_x < (unsigned int)pack->tile_width ? pack->desc.width - tile_x : (unsigned int)pack->tile_width) ||
+		desc.height != (pack->desc.height - tile_y < (unsigned int)pack->tile_height ? pack->desc.height - tile_y : (unsigned int)pack->tile_height)
+	) {
+		return 0;
+	}
+
+	/* The intersection of the tile and the region, in image coordinates */
+	x0 = tile_x > job->x ? tile_x : job->x;
+	y0 = tile_y > job->y ? tile_y : job->y;
+	x1 = tile_x + (int)desc.width < job->x + job->width ? tile_x + (int)desc.width : job->x + job->width;
+	y1 = tile_y + (int)desc.height < job->y + job->height ? tile_y + (int)desc.height : job->y + job->height;
+
+	for (row = y0; row < y1; row++) {
+		memcpy(
+			job->pixels + ((size_t)(row - job->y) * job->width + (x0 - job->x)) * job->channels,
+			tile + ((size_t)(row - tile_y) * desc.width + (x0 - tile_x)) * job->channels,
+			(size_t)(x1 - x0) * job->channels
+		);
+	}
+	return 1;
+}
+
+int qoipack_decode_region(
+	const qoipack *pack, int x, int y, int width, int height,
+	void *pixels, int channels, int threads
+) {
+	qoipack_region_job_t job;
+	int tx1, ty1;
+
+	if (
+		pack == NULL || pack->type != QOIPACK_TYPE_TILES || pixels == NULL ||
+		(channels != 3 && channels != 4) ||
+		x < 0 || y < 0 || width <= 0 || height <= 0 ||
+		x >= (int)pack->desc.width || y >= (int)pack->desc.height ||
+		width > (int)pack->desc.width - x || height > (int)pack->desc.height - y
+	) {
+		return 0;
+	}
+
+	job.pack = pack;
+	job.x = x;
+	job.y = y;
+	job.width = width;
+	job.height = height;
+	job.pixels = (unsigned char *)pixels;
+	job.channels = channels;
+	job.tx0 = x / pack->tile_width;
+	job.ty0 = y / pack->tile_height;
+	tx1 = (x + width - 1) / pack->tile_width;
+	ty1 = (y + height - 1) / pack->tile_height;
+	job.tiles_x = tx1 - job.tx0 + 1;
+
+	return qoipack_parallel(
+		qoipack_decode_tile, &job, job.tiles_x * (ty1 - job.ty0 + 1),
+		0, threads, NULL
+	);
+}
+
+#ifndef QOIPACK_MAX_LEVELS
+	#define QOIPACK_MAX_LEVELS 32
+#endif
+
+typedef struct {
+	int levels;
+	int channels;
+	unsigned int width[QOIPACK_MAX_LEVELS];
+	unsigned int height[QOIPACK_MAX_LEVELS];
+	int y[QOIPACK_MAX_LEVELS];
+	qoi_encoder encoder[QOIPACK_MAX_LEVELS];
+
+	/* The previous (even) row of each level, waiting for its odd partner, and
+	two row buffers for each downscaled level */
+	const unsigned char *pending[QOIPACK_MAX_LEVELS];
+	unsigned char *rows[QOIPACK_MAX_LEVELS][2];
+} qoipack_pyramid_t;
+
+/* Downscale two rows of a level into one row of the next level */
+static void qoipack_downscale_row(
+	const unsigned char *a, const unsigned char *b, unsigned int src_width,
+	unsigned char *dst, unsigned int dst_width, int channels
+) {
+	unsigned int x;
+	int c;
+
+	for (x = 0; x < dst_width; x++) {
+		unsigned int x0 = x * 2 * channels;
+		unsigned int x1 = (x * 2 + 1 < src_width ? x * 2 + 1 : x * 2) * channels;
+		for (c = 0; c < channels; c++) {
+			dst[x * channels + c] = (a[x0 + c] + a[x1 + c] + b[x0 + c] + b[x1 + c] + 2) >> 2;
+		}
+	}
+}
+
+/* Encode a row of a level and, once both source rows of a row of the next
+level are available, produce and push that row as well */
+static int qoipack_pyramid_push(qoipack_pyramid_t *pyr, int level, const unsigned char *row) {
+	while (1) {
+		int y = pyr->y[level]++;
+		unsigned char *next;
+
+		if (!qoi_encoder_rows(&pyr->encoder[level], row, 1)) {
+			return 0;
+		}
+		if (level + 1 >= pyr->levels) {
+			return 1;
+		}
+
+		/* Even rows wait for their odd partner, so the last row of an odd
+		height is never used. A level of height 1 pairs its row with itself. */
+		if (pyr->height[level] == 1) {
+			pyr->pending[level] = row;
+		}
+		else if ((y & 1) == 0) {
+			pyr->pending[level] = row;
+			return 1;
+		}
+
+		next = pyr->rows[level + 1][pyr->y[level + 1] & 1];
+		qoipack_downscale_row(
+			pyr->pending[level], row, pyr->width[level],
+			next, pyr->width[level + 1], pyr->channels
+		);
+		row = next;
+		level++;
+	}
+}
+
+void *qoi_encode_pyramid(const void *data, const qoi_desc *desc, int levels, int *out_len, const qoi_allocator *allocator) {
+	const unsigned char *pixels = (const unsigned char *)data;
+	const void *streams[QOIPACK_MAX_LEVELS];
+	int sizes[QOIPACK_MAX_LEVELS];
+	qoipack_pyramid_t *pyr;
+	unsigned char *bytes = NULL;
+	int i, ok = 1, all_levels;
+	unsigned int y;
+
+	if (
+		data == NULL || desc == NULL || out_len == NULL ||
+		desc->width == 0 || desc->height == 0 || levels < 0
+	) {
+		return NULL;
+	}
+
+	all_levels = 1;
+	while (all_levels < QOIPACK_MAX_LEVELS && ((desc->width | desc->height) >> all_levels)) {
+		all_levels++;
+	}
+	if (levels == 0 || levels > all_levels) {
+		levels = all_levels;
+	}
+
+	pyr = (qoipack_pyramid_t *) qoi_alloc(sizeof(qoipack_pyramid_t), QOI_ALLOC_TEMP, allocator);
+	if (!pyr) {
+		return NULL;
+	}
+	memset(pyr, 0, sizeof(qoipack_pyramid_t));
+	pyr->levels = levels;
+	pyr->channels = desc->channels;
+
+	for (i = 0; i < levels; i++) {
+		qoi_desc level_desc = *desc;
+		level_desc.width = pyr->width[i] = i ? (pyr->width[i - 1] > 1 ? pyr->width[i - 1] / 2 : 1) : desc->width;
+		level_desc.height = pyr->height[i] = i ? (pyr->height[i - 1] > 1 ? pyr->height[i - 1] / 2 : 1) : desc->height;
+
+		/* Even a failed begin leaves the encoder safe to abort */
+		ok = qoi_encoder_begin(&pyr->encoder[i], &level_desc, 0, allocator) && ok;
+		if (i > 0 && ok) {
+			pyr->rows[i][0] = (unsigned char *) qoi_alloc((size_t)pyr->width[i] * desc->channels * 2, QOI_ALLOC_TEMP, allocator);
+			pyr->rows[i][1] = pyr->rows[i][0] ? pyr->rows[i][0] + (size_t)pyr->width[i] * desc->channels : NULL;
+			ok = pyr->rows[i][0] != NULL;
+		}
+	}
+
+	for (y = 0; ok && y < desc->height; y++) {
+		ok = qoipack_pyramid_push(pyr, 0, pixels + (size_t)y * desc->width * desc->channels);
+	}
+
+	for (i = 0; i < levels; i++) {
+		streams[i] = ok ? qoi_encoder_end(&pyr->encoder[i], &sizes[i]) : NULL;
+		ok = ok && streams[i] != NULL;
+	}
+
+	if (ok) {
+		bytes = (unsigned char *) qoipack_build(NULL, streams, sizes, levels, out_len, allocator);
+	}
+	if (bytes) {
+		bytes[7] = QOIPACK_TYPE_PYRAMID;
+		qoipack_write_32(bytes + 12, desc->width);
+		qoipack_write_32(bytes + 16, desc->height);
+		bytes[28] = desc->channels;
+		bytes[29] = desc->colorspace;
+	}
+
+	/* Aborting an encoder that has already ended does nothing */
+	for (i = 0; i < levels; i++) {
+		qoi_encoder_abort(&pyr->encoder[i]);
+		qoi_free((void *)streams[i], allocator);
+		qoi_free(pyr->rows[i][0], allocator);
+	}
+	qoi_free(pyr, allocator);
+	return bytes;
+}
+
+#endif /* QOIPACK_IMPLEMENTATION */
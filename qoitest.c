@@ -0,0 +1,1408 @@
+/*
+
+SPDX-License-Identifier: MIT
+
+
+Round trip and edge case checks for qoi.h and the libraries built on it
+
+Requires:
+	-"qoi.h" (https://github.com/phoboslab/qoi/blob/master/qoi.h)
+	-"qoipack.h"
+	-"qoicache.h"
+	-"qoibatch.h" (POSIX only)
+
+Compile and run with:
+	gcc qoitest.c -std=gnu99 -O2 -lpthread -o qoitest && ./qoitest
+
+Define QOI_NO_SIMD to check the scalar code paths; "make test" runs both.
+Prints each failed check and exits with 1 if any failed.
+
+*/
+
+
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+#define QOIPACK_IMPLEMENTATION
+#include "qoipack.h"
+#define QOICACHE_IMPLEMENTATION
+#include "qoicache.h"
+#ifdef QOI_POSIX
+#define QOIBATCH_IMPLEMENTATION
+#include "qoibatch.h"
+#endif
+
+#include <stdio.h>
+
+#ifdef QOI_POSIX
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+static int checks_run = 0;
+static int checks_failed = 0;
+
+#define CHECK(COND, ...) do { \
+	checks_run++; \
+	if (!(COND)) { \
+		checks_failed++; \
+		printf("%s:%d: check failed: %s: ", __FILE__, __LINE__, #COND); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+	} \
+} while (0)
+
+
+// -----------------------------------------------------------------------------
+// Test images
+
+enum {
+	PATTERN_NOISE,    // random bytes; mostly QOI_OP_RGB(A)
+	PATTERN_RUNS,     // long runs broken by random pixels
+	PATTERN_SMALL,    // small steps; QOI_OP_DIFF and QOI_OP_LUMA
+	PATTERN_PALETTE,  // a few colors; QOI_OP_INDEX
+	PATTERN_MIXED,    // all of the above, changing every few pixels
+	PATTERN_COUNT
+};
+
+static const char *pattern_names[PATTERN_COUNT] = {"noise", "runs", "small", "palette", "mixed"};
+
+static unsigned int rand_state = 1;
+
+static unsigned int rand_next(void) {
+	rand_state = rand_state * 1103515245 + 12345;
+	return rand_state >> 16;
+}
+
+// Fill w * h pixels of the given channels. Returns a malloc()ed buffer.
+static unsigned char *make_image(int pattern, int w, int h, int channels) {
+	static const unsigned char palette[5][4] = {
+		{0, 0, 0, 255}, {255, 255, 255, 255}, {200, 30, 40, 255}, {10, 120, 250, 128}, {0, 0, 0, 0}
+	};
+	int px_count = w * h, i, c, mode = pattern;
+	unsigned char *pixels = malloc(px_count * channels);
+	unsigned char px[4] = {0, 0, 0, 255};
+
+	for (i = 0; i < px_count; i++) {
+		if (pattern == PATTERN_MIXED && i % 7 == 0) {
+			mode = rand_next() % PATTERN_MIXED;
+		}
+		switch (mode) {
+			case PATTERN_NOISE:
+				for (c = 0; c < 4; c++) {
+					px[c] = rand_next();
+				}
+				break;
+			case PATTERN_RUNS:
+				if (rand_next() % 50 == 0) {
+					for (c = 0; c < 4; c++) {
+						px[c] = rand_next();
+					}
+				}
+				break;
+			case PATTERN_SMALL:
+				for (c = 0; c < 4; c++) {
+					px[c] += (int)(rand_next() % 5) - 2;
+				}
+				break;
+			case PATTERN_PALETTE:
+				memcpy(px, palette[rand_next() % 5], 4);
+				break;
+		}
+		memcpy(pixels + i * channels, px, channels);
+	}
+	return pixels;
+}
+
+
+// -----------------------------------------------------------------------------
+// qoi_encode() and qoi_decode()
+
+static const int sizes[][2] = {{1, 1}, {1, 9}, {2, 3}, {7, 5}, {64, 64}, {97, 31}, {300, 7}};
+
+static void test_roundtrip(void) {
+	int s, pattern, channels, out_channels, len;
+
+	for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+		int w = sizes[s][0], h = sizes[s][1], i;
+		for (pattern = 0; pattern < PATTERN_COUNT; pattern++) {
+			for (channels = 3; channels <= 4; channels++) {
+				qoi_desc desc = {w, h, channels, QOI_SRGB}, out;
+				unsigned char *pixels = make_image(pattern, w, h, channels);
+				unsigned char *encoded = qoi_encode(pixels, &desc, &len);
+
+				CHECK(encoded != NULL, "%s %dx%dx%d", pattern_names[pattern], w, h, channels);
+				CHECK(len <= (int)(w * h * (channels + 1) + QOI_HEADER_SIZE + 8), "%s %dx%dx%d: %d bytes", pattern_names[pattern], w, h, channels, len);
+
+				for (out_channels = 3; out_channels <= 4; out_channels++) {
+					unsigned char *decoded = qoi_decode(encoded, len, &out, out_channels);
+					int same = 1;
+
+					CHECK(decoded != NULL, "%s %dx%dx%d", pattern_names[pattern], w, h, channels);
+					CHECK(out.width == desc.width && out.height == desc.height && out.channels == channels, "%s %dx%dx%d", pattern_names[pattern], w, h, channels);
+					for (i = 0; decoded && i < w * h; i++) {
+						same &= memcmp(decoded + i * out_channels, pixels + i * channels, 3) == 0;
+						if (out_channels == 4) {
+							same &= decoded[i * 4 + 3] == (channels == 4 ? pixels[i * 4 + 3] : 255);
+						}
+					}
+					CHECK(same, "%s %dx%dx%d decoded to %d channels", pattern_names[pattern], w, h, channels, out_channels);
+					free(decoded);
+				}
+				free(encoded);
+				free(pixels);
+			}
+		}
+	}
+}
+
+static void test_invalid(void) {
+	unsigned char pixels[16] = {0}, bytes[64];
+	qoi_desc desc = {2, 2, 4, QOI_SRGB}, out;
+	int len;
+	void *encoded;
+
+	desc.channels = 2;
+	CHECK(qoi_encode(pixels, &desc, &len) == NULL, "2 channels");
+	desc.channels = 4;
+	desc.width = 0;
+	CHECK(qoi_encode(pixels, &desc, &len) == NULL, "zero width");
+	desc.width = 2;
+
+	encoded = qoi_encode(pixels, &desc, &len);
+	CHECK(encoded != NULL, "2x2");
+	memcpy(bytes, encoded, len);
+	CHECK(qoi_decode(bytes, QOI_HEADER_SIZE, &out, 4) == NULL, "truncated to the header");
+	bytes[0] = 'x';
+	CHECK(qoi_decode(bytes, len, &out, 4) == NULL, "bad magic");
+	free(encoded);
+}
+
+
+// -----------------------------------------------------------------------------
+// qoi_encode_chunks(); every chunk boundary is the end of a span of
+// qoi_encode_sink(), so small chunks put the encoder right at the edge of its
+// output buffer
+
+static void test_chunks(void) {
+	int w = 97, h = 31, pattern, channels, chunk_size, len, count, i;
+
+	for (pattern = 0; pattern < PATTERN_COUNT; pattern++) {
+		for (channels = 3; channels <= 4; channels++) {
+			qoi_desc desc = {w, h, channels, QOI_SRGB};
+			unsigned char *pixels = make_image(pattern, w, h, channels);
+			unsigned char *encoded = qoi_encode(pixels, &desc, &len);
+
+			for (chunk_size = 64; chunk_size < 300; chunk_size++) {
+				qoi_chunk *chunks = qoi_encode_chunks(pixels, &desc, chunk_size, &count, NULL);
+				int p = 0, same = 1;
+
+				CHECK(chunks != NULL, "%s x%d, chunk size %d", pattern_names[pattern], channels, chunk_size);
+				for (i = 0; chunks && i < count; i++) {
+					same &= p + (int)chunks[i].size <= len && memcmp(encoded + p, chunks[i].data, chunks[i].size) == 0;
+					same &= i == count - 1 || (int)chunks[i].size == chunk_size;
+					p += chunks[i].size;
+				}
+				CHECK(same && p == len, "%s x%d, chunk size %d", pattern_names[pattern], channels, chunk_size);
+				qoi_free_chunks(chunks, count, NULL);
+			}
+			free(encoded);
+			free(pixels);
+		}
+	}
+
+	{
+		qoi_desc desc = {w, h, 4, QOI_SRGB};
+		unsigned char *pixels = make_image(PATTERN_NOISE, w, h, 4);
+		CHECK(qoi_encode_chunks(pixels, &desc, 63, &count, NULL) == NULL, "chunk size below 64");
+		free(pixels);
+	}
+}
+
+
+// -----------------------------------------------------------------------------
+// qoi_allocator; every buffer must go back to the allocator it came from
+
+typedef struct {
+	int allocs;
+	int frees;
+	int reallocs;
+} counting_allocator;
+
+static void *counting_alloc(void *user, size_t size, int hint) {
+	(void)hint;
+	((counting_allocator *)user)->allocs++;
+	return malloc(size);
+}
+
+static void *counting_realloc(void *user, void *ptr, size_t old_size, size_t new_size) {
+	(void)old_size;
+	((counting_allocator *)user)->reallocs++;
+	return realloc(ptr, new_size);
+}
+
+static void counting_free(void *user, void *ptr) {
+	((counting_allocator *)user)->frees++;
+	free(ptr);
+}
+
+static void test_allocator(void) {
+	int w = 64, h = 64, len, count, flags;
+	qoi_desc desc = {w, h, 4, QOI_SRGB}, out;
+	unsigned char *pixels = make_image(PATTERN_MIXED, w, h, 4);
+	counting_allocator counts = {0, 0, 0};
+	qoi_allocator allocator = {counting_alloc, NULL, counting_free, &counts};
+	void *encoded, *decoded;
+	qoi_chunk *chunks;
+	qoi_ctx ctx;
+
+	// Shrinking and growing the result with and without a realloc function
+	for (flags = 0; flags <= QOI_ENCODE_GROW; flags++) {
+		allocator.realloc = NULL;
+		encoded = qoi_encode_ex(pixels, &desc, &len, flags, &allocator);
+		CHECK(encoded != NULL, "flags %d", flags);
+		decoded = qoi_decode_ex(encoded, len, &out, 4, &allocator);
+		CHECK(decoded && memcmp(decoded, pixels, w * h * 4) == 0, "flags %d", flags);
+		qoi_free(decoded, &allocator);
+		qoi_free(encoded, &allocator);
+
+		allocator.realloc = counting_realloc;
+		encoded = qoi_encode_ex(pixels, &desc, &len, flags, &allocator);
+		CHECK(encoded != NULL, "flags %d with realloc", flags);
+		qoi_free(encoded, &allocator);
+	}
+	CHECK(counts.reallocs > 0, "realloc unused");
+
+	chunks = qoi_encode_chunks(pixels, &desc, 256, &count, &allocator);
+	CHECK(chunks != NULL, "chunks");
+	qoi_free_chunks(chunks, count, &allocator);
+
+	qoi_ctx_init(&ctx, &allocator);
+	encoded = qoi_encode_ctx(&ctx, pixels, &desc, &len);
+	CHECK(encoded && qoi_decode_ctx(&ctx, encoded, len, &out, 4) != NULL, "ctx");
+	qoi_ctx_free(&ctx);
+
+	CHECK(counts.allocs > 0 && counts.allocs == counts.frees, "%d allocs, %d frees", counts.allocs, counts.frees);
+
+	// An allocator with only one of alloc and free is not used at all
+	counts.allocs = counts.frees = 0;
+	allocator.free = NULL;
+	encoded = qoi_encode_ex(pixels, &desc, &len, QOI_ENCODE_SHRINK, &allocator);
+	CHECK(encoded != NULL, "alloc only");
+	qoi_free(encoded, &allocator);
+	allocator.alloc = NULL;
+	allocator.free = counting_free;
+	encoded = qoi_encode_ex(pixels, &desc, &len, QOI_ENCODE_SHRINK, &allocator);
+	CHECK(encoded != NULL, "free only");
+	qoi_free(encoded, &allocator);
+	CHECK(counts.allocs == 0 && counts.frees == 0, "%d allocs, %d frees", counts.allocs, counts.frees);
+
+	free(pixels);
+}
+
+
+// -----------------------------------------------------------------------------
+// qoi_frame_encode(); each frame changes a few bytes at the top of 32 bit words
+// 16 bytes apart in one stripe, e.g. alphas, which must still make the stripe
+// be encoded again
+
+static void test_frame(void) {
+	int w = 97, h = 50, channels, len, trial;
+
+	for (channels = 3; channels <= 4; channels++) {
+		qoi_desc desc = {w, h, channels, QOI_SRGB}, out;
+		unsigned char *pixels = make_image(PATTERN_MIXED, w, h, channels);
+		qoi_frame_encoder frame;
+		unsigned char *encoded, *decoded;
+
+		CHECK(qoi_frame_init(&frame, &desc, 8, NULL), "x%d", channels);
+		encoded = qoi_frame_encode(&frame, pixels, &len);
+		decoded = encoded ? qoi_decode(encoded, len, &out, channels) : NULL;
+		CHECK(decoded && memcmp(decoded, pixels, w * h * channels) == 0, "x%d first frame", channels);
+		CHECK(frame.stripes_encoded == 7, "x%d first frame: %d stripes", channels, frame.stripes_encoded);
+		free(decoded);
+
+		encoded = qoi_frame_encode(&frame, pixels, &len);
+		decoded = encoded ? qoi_decode(encoded, len, &out, channels) : NULL;
+		CHECK(decoded && memcmp(decoded, pixels, w * h * channels) == 0, "x%d same frame", channels);
+		CHECK(frame.stripes_encoded == 0, "x%d same frame: %d stripes", channels, frame.stripes_encoded);
+		free(decoded);
+
+		for (trial = 0; trial < 1000; trial++) {
+			int y = (rand_next() % 7) * 8, rows = h - y < 8 ? h - y : 8;
+			int i = y * w * channels + (rand_next() % (rows * w * channels / 4 - 8)) * 4 + 3;
+			int same;
+
+			pixels[i] ^= 1 + rand_next() % 255;
+			pixels[i + 16] ^= 1 + rand_next() % 255;
+			pixels[i + 32] ^= 1 + rand_next() % 255;
+			encoded = qoi_frame_encode(&frame, pixels, &len);
+			decoded = encoded ? qoi_decode(encoded, len, &out, channels) : NULL;
+			same = decoded && memcmp(decoded, pixels, w * h * channels) == 0;
+			CHECK(same, "x%d trial %d: byte %d", channels, trial, i);
+			CHECK(frame.stripes_encoded == 1, "x%d trial %d: %d stripes", channels, trial, frame.stripes_encoded);
+			free(decoded);
+			if (!same) {
+				break;
+			}
+		}
+		qoi_frame_free(&frame);
+		free(pixels);
+	}
+}
+
+
+// -----------------------------------------------------------------------------
+// qoi_crop(); rectangles at every edge must match the same pixels of the
+// source, and rectangles not fully inside the image are rejected
+
+static void test_crop(void) {
+	static const int rects[][4] = {{0, 0, 50, 30}, {0, 0, 1, 1}, {49, 29, 1, 1}, {0, 29, 50, 1}, {49, 0, 1, 30}, {10, 5, 20, 7}};
+	static const int bad_rects[][4] = {
+		{-1, 0, 5, 5}, {0, -1, 5, 5}, {0, 0, 0, 5}, {0, 0, 5, 0}, {46, 0, 5, 5}, {0, 26, 5, 5},
+		{50, 0, 1, 1}, {1, 0, 0x7fffffff, 1}, {0, 1, 1, 0x7fffffff}
+	};
+	int w = 50, h = 30, channels, len, crop_len, r, y;
+
+	for (channels = 3; channels <= 4; channels++) {
+		qoi_desc desc = {w, h, channels, QOI_LINEAR}, out;
+		unsigned char *pixels = make_image(PATTERN_MIXED, w, h, channels);
+		unsigned char *encoded = qoi_encode(pixels, &desc, &len);
+
+		for (r = 0; r < (int)(sizeof(rects) / sizeof(rects[0])); r++) {
+			int rx = rects[r][0], ry = rects[r][1], rw = rects[r][2], rh = rects[r][3], same = 1;
+			void *cropped = qoi_crop(encoded, len, rx, ry, rw, rh, &crop_len, NULL);
+			unsigned char *decoded = cropped ? qoi_decode(cropped, crop_len, &out, 0) : NULL;
+
+			CHECK(decoded != NULL, "x%d, %d,%d %dx%d", channels, rx, ry, rw, rh);
+			CHECK(decoded && (int)out.width == rw && (int)out.height == rh && out.channels == channels && out.colorspace == QOI_LINEAR, "x%d, %d,%d %dx%d", channels, rx, ry, rw, rh);
+			for (y = 0; decoded && y < rh; y++) {
+				same &= memcmp(decoded + y * rw * channels, pixels + ((ry + y) * w + rx) * channels, rw * channels) == 0;
+			}
+			CHECK(same, "x%d, %d,%d %dx%d", channels, rx, ry, rw, rh);
+			free(decoded);
+			qoi_free(cropped, NULL);
+		}
+
+		for (r = 0; r < (int)(sizeof(bad_rects) / sizeof(bad_rects[0])); r++) {
+			int rx = bad_rects[r][0], ry = bad_rects[r][1], rw = bad_rects[r][2], rh = bad_rects[r][3];
+			CHECK(qoi_crop(encoded, len, rx, ry, rw, rh, &crop_len, NULL) == NULL, "x%d, %d,%d %dx%d", channels, rx, ry, rw, rh);
+		}
+		CHECK(qoi_crop(encoded, QOI_HEADER_SIZE, 0, 0, 1, 1, &crop_len, NULL) == NULL, "x%d, truncated", channels);
+
+		free(encoded);
+		free(pixels);
+	}
+}
+
+
+// -----------------------------------------------------------------------------
+// qoi_compare(); the same pixels stored differently are equal, and changed
+// pixels are counted and located
+
+static void test_compare(void) {
+	int w = 45, h = 23, len_a, len_b, len_c, i;
+	qoi_desc desc = {w, h, 3, QOI_SRGB}, desc_rgba = {w, h, 4, QOI_SRGB}, small = {w, h - 1, 3, QOI_SRGB};
+	unsigned char *pixels = make_image(PATTERN_MIXED, w, h, 3);
+	unsigned char *rgba = malloc(w * h * 4);
+	void *a, *b, *c;
+	qoi_compare_result result;
+
+	for (i = 0; i < w * h; i++) {
+		memcpy(rgba + i * 4, pixels + i * 3, 3);
+		rgba[i * 4 + 3] = 255;
+	}
+	a = qoi_encode(pixels, &desc, &len_a);
+	b = qoi_encode(rgba, &desc_rgba, &len_b);
+	c = qoi_encode(pixels, &small, &len_c);
+
+	CHECK(qoi_compare(a, len_a, a, len_a, &result, NULL) && result.equal && result.same_size && result.diff_pixels == 0, "same data");
+	CHECK(qoi_compare(a, len_a, b, len_b, &result, NULL) && result.equal && result.diff_pixels == 0, "3 and 4 channels");
+	CHECK(result.first_x == -1 && result.min_x == -1 && result.max_y == -1, "no difference");
+
+	// An alpha-only change, then two more pixels that widen the bounding box
+	free(b);
+	rgba[(7 * w + 30) * 4 + 3] = 254;
+	rgba[(9 * w + 4) * 4] ^= 1;
+	rgba[(20 * w + 44) * 4 + 2] ^= 0x80;
+	b = qoi_encode(rgba, &desc_rgba, &len_b);
+	CHECK(qoi_compare(a, len_a, b, len_b, &result, NULL) && !result.equal && result.same_size, "3 changed pixels");
+	CHECK(result.diff_pixels == 3, "%d changed pixels", result.diff_pixels);
+	CHECK(result.first_x == 30 && result.first_y == 7, "first at %d,%d", result.first_x, result.first_y);
+	CHECK(
+		result.min_x == 4 && result.min_y == 7 && result.max_x == 44 && result.max_y == 20,
+		"box %d,%d - %d,%d", result.min_x, result.min_y, result.max_x, result.max_y
+	);
+
+	CHECK(qoi_compare(a, len_a, c, len_c, &result, NULL) && !result.equal && !result.same_size, "different sizes");
+	CHECK(!qoi_compare(a, len_a, b, QOI_HEADER_SIZE - 1, &result, NULL), "truncated");
+
+	free(a);
+	free(b);
+	free(c);
+	free(rgba);
+	free(pixels);
+}
+
+
+// -----------------------------------------------------------------------------
+// qoi_checksum(), qoi_encode_checksum() and qoi_decode_checksum() must agree
+// with each other and with the formula in the documentation
+
+static unsigned int checksum_mix(unsigned int h) {
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static void test_checksum(void) {
+	int w = 64, h = 19, pattern, channels, out_channels, len, plain_len, i;
+
+	for (pattern = 0; pattern < PATTERN_COUNT; pattern++) {
+		for (channels = 3; channels <= 4; channels++) {
+			qoi_desc desc = {w, h, channels, QOI_SRGB}, out;
+			unsigned char *pixels = make_image(pattern, w, h, channels);
+			unsigned char *plain = qoi_encode(pixels, &desc, &plain_len);
+			unsigned int expected = 0, sum = 0, encoded_sum = 0, decoded_sum = 0;
+			unsigned char *encoded;
+
+			for (i = 0; i < w * h; i++) {
+				const unsigned char *px = pixels + i * channels;
+				unsigned int a = channels == 4 ? px[3] : 255;
+				expected = expected * QOI_CHECKSUM_MUL + checksum_mix(px[0] | px[1] << 8 | px[2] << 16 | a << 24);
+			}
+			sum = qoi_checksum(pixels, &desc);
+			CHECK(sum == expected, "%s x%d: %08x, expected %08x", pattern_names[pattern], channels, sum, expected);
+
+			encoded = qoi_encode_checksum(pixels, &desc, &len, &encoded_sum, NULL);
+			CHECK(encoded && len == plain_len && memcmp(encoded, plain, len) == 0, "%s x%d", pattern_names[pattern], channels);
+			CHECK(encoded_sum == expected, "%s x%d: encoded %08x, expected %08x", pattern_names[pattern], channels, encoded_sum, expected);
+
+			for (out_channels = 3; out_channels <= 4; out_channels++) {
+				unsigned char *decoded = encoded ? qoi_decode_checksum(encoded, len, &out, out_channels, &decoded_sum, NULL) : NULL;
+				CHECK(decoded && decoded_sum == expected, "%s x%d to %d: decoded %08x, expected %08x", pattern_names[pattern], channels, out_channels, decoded_sum, expected);
+				free(decoded);
+			}
+
+			pixels[(w * h / 2) * channels + channels - 1] ^= 1;
+			CHECK(qoi_checksum(pixels, &desc) != expected, "%s x%d: one changed byte", pattern_names[pattern], channels);
+
+			free(encoded);
+			free(plain);
+			free(pixels);
+		}
+	}
+}
+
+
+// -----------------------------------------------------------------------------
+// qoi_encode_analyze() and qoi_decode_analyze(); the results must match a
+// plain pass over the pixels
+
+static void analyze_pixels(const unsigned char *pixels, int w, int h, int channels, qoi_analysis *analysis) {
+	int x, y, i;
+
+	analysis->opaque = 1;
+	analysis->min_x = analysis->min_y = analysis->max_x = analysis->max_y = -1;
+	analysis->color_count = 0;
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			unsigned char px[4] = {0, 0, 0, 255};
+			memcpy(px, pixels + (y * w + x) * channels, channels);
+			analysis->opaque &= px[3] == 255;
+			if (px[3] != 0) {
+				if (analysis->max_y < 0) {
+					analysis->min_x = analysis->max_x = x;
+					analysis->min_y = y;
+				}
+				analysis->min_x = x < analysis->min_x ? x : analysis->min_x;
+				analysis->max_x = x > analysis->max_x ? x : analysis->max_x;
+				analysis->max_y = y;
+			}
+			for (i = 0; i < analysis->color_count && i < 256; i++) {
+				if (memcmp(analysis->palette[i], px, 4) == 0) {
+					break;
+				}
+			}
+			if (i == analysis->color_count && i <= 256) {
+				if (i < 256) {
+					memcpy(analysis->palette[i], px, 4);
+				}
+				analysis->color_count++;
+			}
+		}
+	}
+}
+
+static void test_analyze(void) {
+	enum {SPRITE = PATTERN_COUNT, TRANSPARENT, IMAGE_COUNT};
+	int w = 40, h = 30, image, channels, out_channels, len, x, y;
+
+	for (image = 0; image < IMAGE_COUNT; image++) {
+		for (channels = 3; channels <= 4; channels++) {
+			qoi_desc desc = {w, h, channels, QOI_SRGB}, out;
+			unsigned char *pixels;
+			unsigned char *encoded, *decoded;
+			qoi_analysis expected, analysis;
+			char name[32];
+
+			if (image < PATTERN_COUNT) {
+				pixels = make_image(image, w, h, channels);
+				snprintf(name, sizeof(name), "%s x%d", pattern_names[image], channels);
+			}
+			else {
+				// Transparent but for a solid rectangle with runs across its
+				// rows and one translucent pixel to its right
+				pixels = calloc(w * h, channels);
+				for (y = 5; image == SPRITE && y <= 12; y++) {
+					for (x = 7; x <= 20; x++) {
+						memcpy(pixels + (y * w + x) * channels, "\xc8\x1e\x28\xff", channels);
+					}
+				}
+				if (image == SPRITE) {
+					memcpy(pixels + (12 * w + 30) * channels, "\x01\x02\x03\x80", channels);
+				}
+				snprintf(name, sizeof(name), "%s x%d", image == SPRITE ? "sprite" : "transparent", channels);
+			}
+			analyze_pixels(pixels, w, h, channels, &expected);
+
+			encoded = qoi_encode_analyze(pixels, &desc, &len, &analysis, NULL);
+			CHECK(encoded != NULL, "%s", name);
+			CHECK(
+				analysis.opaque == expected.opaque && analysis.color_count == expected.color_count,
+				"%s: opaque %d, %d colors; expected %d, %d", name, analysis.opaque, analysis.color_count, expected.opaque, expected.color_count
+			);
+			CHECK(
+				analysis.min_x == expected.min_x && analysis.min_y == expected.min_y && analysis.max_x == expected.max_x && analysis.max_y == expected.max_y,
+				"%s: box %d,%d - %d,%d", name, analysis.min_x, analysis.min_y, analysis.max_x, analysis.max_y
+			);
+			CHECK(memcmp(analysis.palette, expected.palette, 4 * (expected.color_count < 256 ? expected.color_count : 256)) == 0, "%s: palette", name);
+
+			for (out_channels = 3; encoded && out_channels <= 4; out_channels++) {
+				decoded = qoi_decode_analyze(encoded, len, &out, out_channels, &analysis, NULL);
+				CHECK(decoded != NULL, "%s to %d", name, out_channels);
+				CHECK(
+					analysis.opaque == expected.opaque && analysis.color_count == expected.color_count &&
+					analysis.min_x == expected.min_x && analysis.min_y == expected.min_y &&
+					analysis.max_x == expected.max_x && analysis.max_y == expected.max_y &&
+					memcmp(analysis.palette, expected.palette, 4 * (expected.color_count < 256 ? expected.color_count : 256)) == 0,
+					"%s to %d", name, out_channels
+				);
+				free(decoded);
+			}
+
+			// The known images, without the reference
+			if (image == SPRITE && channels == 4) {
+				CHECK(!expected.opaque && expected.color_count == 3, "%s", name);
+				CHECK(expected.min_x == 7 && expected.min_y == 5 && expected.max_x == 30 && expected.max_y == 12, "%s", name);
+			}
+			if (image == TRANSPARENT && channels == 4) {
+				CHECK(!expected.opaque && expected.color_count == 1 && expected.min_x == -1 && expected.max_y == -1, "%s", name);
+			}
+			if (channels == 3) {
+				CHECK(expected.opaque && expected.min_x == 0 && expected.min_y == 0 && expected.max_x == w - 1 && expected.max_y == h - 1, "%s", name);
+			}
+			if (image == PATTERN_NOISE) {
+				CHECK(expected.color_count == 257, "%s", name);
+			}
+
+			free(encoded);
+			free(pixels);
+		}
+	}
+}
+
+
+#ifdef QOI_POSIX
+
+// -----------------------------------------------------------------------------
+// Files are written to a temporary directory below the current one, so that
+// O_DIRECT is not ruled out by a tmpfs /tmp
+
+static char temp_dir[] = "qoitest.XXXXXX";
+
+#define TEMP_PATH_SIZE 64
+
+static void temp_path(char *path, const char *name) {
+	snprintf(path, TEMP_PATH_SIZE, "%s/%s", temp_dir, name);
+}
+
+// Remove all files in dir. Returns the number of files whose name does not
+// end in suffix.
+static int clear_dir(const char *dir, const char *suffix) {
+	char path[512];
+	struct dirent *de;
+	DIR *dh;
+	int others = 0;
+
+	dh = opendir(dir);
+	if (!dh) {
+		return 0;
+	}
+	while ((de = readdir(dh)) != NULL) {
+		size_t len = strlen(de->d_name);
+		if (de->d_name[0] != '.') {
+			others += len < strlen(suffix) || strcmp(de->d_name + len - strlen(suffix), suffix) != 0;
+			snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+			unlink(path);
+		}
+	}
+	closedir(dh);
+	return others;
+}
+
+// Remove a directory below temp_dir and all files in it
+static void remove_dir(const char *name) {
+	char dir[TEMP_PATH_SIZE];
+
+	temp_path(dir, name);
+	clear_dir(dir, "");
+	rmdir(dir);
+}
+
+static void *read_file(const char *path, int *size) {
+	FILE *fh = fopen(path, "rb");
+	void *data;
+
+	if (!fh) {
+		return NULL;
+	}
+	fseek(fh, 0, SEEK_END);
+	*size = ftell(fh);
+	fseek(fh, 0, SEEK_SET);
+	data = malloc(*size);
+	if (fread(data, 1, *size, fh) != (size_t)*size) {
+		free(data);
+		data = NULL;
+	}
+	fclose(fh);
+	return data;
+}
+
+
+// -----------------------------------------------------------------------------
+// qoi_write_fd(); the large image fills the buffer ring several times and does
+// not end on a block boundary
+
+static void test_write_fd(void) {
+	static const int fd_sizes[][2] = {{7, 5}, {600, 401}};
+	int s, channels, flags, len, size, fd, written;
+
+	for (s = 0; s < 2; s++) {
+		int w = fd_sizes[s][0], h = fd_sizes[s][1];
+		for (channels = 3; channels <= 4; channels++) {
+			qoi_desc desc = {w, h, channels, QOI_SRGB};
+			unsigned char *pixels = make_image(PATTERN_MIXED, w, h, channels);
+			unsigned char *encoded = qoi_encode(pixels, &desc, &len);
+
+			for (flags = 0; flags <= QOI_WRITE_DIRECT; flags++) {
+				char path[TEMP_PATH_SIZE];
+				void *data;
+
+				temp_path(path, "fd.qoi");
+				fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				CHECK(fd >= 0, "%s", path);
+				written = qoi_write_fd(fd, pixels, &desc, flags, NULL);
+				close(fd);
+				CHECK(written == len, "%dx%dx%d, flags %d: %d of %d bytes", w, h, channels, flags, written, len);
+
+				data = read_file(path, &size);
+				CHECK(data && size == len && memcmp(data, encoded, len) == 0, "%dx%dx%d, flags %d", w, h, channels, flags);
+				free(data);
+				unlink(path);
+			}
+			free(encoded);
+			free(pixels);
+		}
+	}
+}
+
+
+// -----------------------------------------------------------------------------
+// qoi_append_rows(); appending in parts must give the file of qoi_write() for
+// the whole image, with runs that continue across the parts, and a saved
+// state that no longer matches the file must be ignored
+
+static void test_append_rows(void) {
+	static const int parts[] = {5, 1, 17, 8};
+	static const int patterns[] = {PATTERN_RUNS, PATTERN_MIXED};
+	int w = 41, h = 31, p, channels, flags, len, size, i;
+
+	for (p = 0; p < 2; p++) {
+		int pattern = patterns[p];
+		for (channels = 3; channels <= 4; channels++) {
+			qoi_desc desc = {w, h, channels, QOI_SRGB};
+			unsigned char *pixels = make_image(pattern, w, h, channels);
+			unsigned char *encoded;
+
+			// A few solid rows, so that a run is open at the end of a part
+			memset(pixels + 4 * w * channels, 0x80, 3 * w * channels);
+			encoded = qoi_encode(pixels, &desc, &len);
+
+			for (flags = 0; flags <= QOI_APPEND_STATE; flags++) {
+				char path[TEMP_PATH_SIZE], state_path[TEMP_PATH_SIZE + 8];
+				qoi_desc first = desc;
+				int rows = parts[0], height = 0;
+				void *data;
+
+				temp_path(path, "append.qoi");
+				snprintf(state_path, sizeof(state_path), "%s.state", path);
+				first.height = rows;
+				CHECK(qoi_write(path, pixels, &first), "%s", path);
+				for (i = 1; i < (int)(sizeof(parts) / sizeof(parts[0])); i++) {
+					height = qoi_append_rows(path, pixels + rows * w * channels, parts[i], flags, NULL);
+					rows += parts[i];
+					CHECK(height == rows, "%s x%d, flags %d: height %d after %d rows", pattern_names[pattern], channels, flags, height, rows);
+				}
+
+				data = read_file(path, &size);
+				CHECK(data && size == len && memcmp(data, encoded, len) == 0, "%s x%d, flags %d", pattern_names[pattern], channels, flags);
+				free(data);
+
+				// Rewrite the file behind the state's back; the append must
+				// scan the new file instead
+				first.height = parts[0];
+				CHECK(qoi_write(path, pixels, &first), "%s", path);
+				height = qoi_append_rows(path, pixels + parts[0] * w * channels, h - parts[0], flags, NULL);
+				CHECK(height == h, "%s x%d, flags %d: height %d after rewrite", pattern_names[pattern], channels, flags, height);
+				data = read_file(path, &size);
+				CHECK(data && size == len && memcmp(data, encoded, len) == 0, "%s x%d, flags %d after rewrite", pattern_names[pattern], channels, flags);
+				free(data);
+
+				unlink(path);
+				unlink(state_path);
+			}
+			free(encoded);
+			free(pixels);
+		}
+	}
+
+	{
+		char path[TEMP_PATH_SIZE];
+		unsigned char row[4 * 4] = {0};
+		temp_path(path, "missing.qoi");
+		CHECK(qoi_append_rows(path, row, 1, 0, NULL) == 0, "missing file");
+	}
+}
+
+#endif /* QOI_POSIX */
+
+
+// -----------------------------------------------------------------------------
+// qoipack_build() and reading the pack back from memory and from a file
+
+#define PACK_COUNT 6
+
+static void test_pack(void) {
+	const char *names[PACK_COUNT] = {"a.qoi", "b.qoi", "dir/c.qoi", NULL, "e.qoi", "f"};
+	unsigned char *pixels[PACK_COUNT];
+	void *streams[PACK_COUNT];
+	int sizes[PACK_COUNT], i, len, unnamed = 0;
+	qoi_desc descs[PACK_COUNT];
+	qoipack pack;
+	qoipack_entry entry;
+	unsigned char *data;
+
+	for (i = 0; i < PACK_COUNT; i++) {
+		qoi_desc desc = {1 + i * 13, 1 + i * 5, 3 + i % 2, QOI_SRGB};
+		descs[i] = desc;
+		pixels[i] = make_image(i % PATTERN_COUNT, desc.width, desc.height, desc.channels);
+		streams[i] = qoi_encode(pixels[i], &desc, &sizes[i]);
+	}
+
+	data = qoipack_build(names, (const void *const *)streams, sizes, PACK_COUNT, &len, NULL);
+	CHECK(data != NULL, "build");
+	CHECK(qoipack_open_memory(&pack, data, len), "open");
+	CHECK(pack.count == PACK_COUNT && pack.type == QOIPACK_TYPE_PACK, "%d entries", pack.count);
+
+	for (i = 0; i < PACK_COUNT; i++) {
+		int index = names[i] ? qoipack_find(&pack, names[i]) : -1;
+		qoi_desc out;
+		unsigned char *decoded;
+
+		if (!names[i]) {
+			continue;
+		}
+		CHECK(index >= 0, "%s", names[i]);
+		CHECK(qoipack_get(&pack, index, &entry), "%s", names[i]);
+		CHECK(entry.name && strcmp(entry.name, names[i]) == 0, "%s", names[i]);
+		CHECK(entry.width == descs[i].width && entry.height == descs[i].height, "%s", names[i]);
+		CHECK(entry.size == sizes[i] && memcmp(entry.data, streams[i], sizes[i]) == 0, "%s", names[i]);
+		CHECK(((const unsigned char *)entry.data - pack.data) % QOIPACK_ALIGN == 0, "%s", names[i]);
+
+		decoded = qoipack_decode(&pack, index, &out, descs[i].channels, NULL);
+		CHECK(decoded && memcmp(decoded, pixels[i], descs[i].width * descs[i].height * descs[i].channels) == 0, "%s", names[i]);
+		free(decoded);
+	}
+	for (i = 0; i < PACK_COUNT; i++) {
+		CHECK(qoipack_get(&pack, i, &entry), "entry %d", i);
+		if (!entry.name) {
+			unnamed++;
+			CHECK(entry.size == sizes[3] && memcmp(entry.data, streams[3], sizes[3]) == 0, "unnamed entry");
+		}
+	}
+	CHECK(unnamed == 1, "%d unnamed entries", unnamed);
+	CHECK(qoipack_find(&pack, "missing.qoi") == -1, "missing name");
+	CHECK(qoipack_find(&pack, "a.qo") == -1, "prefix of a name");
+	CHECK(!qoipack_get(&pack, PACK_COUNT, &entry), "index out of range");
+	qoipack_close(&pack);
+
+	CHECK(!qoipack_open_memory(&pack, data, QOIPACK_HEADER_SIZE), "truncated table");
+	CHECK(!qoipack_open_memory(&pack, pixels[4], 64), "not a pack");
+
+	#ifdef QOI_POSIX
+	{
+		char path[TEMP_PATH_SIZE];
+		qoi_desc out;
+		unsigned char *decoded;
+		FILE *fh;
+
+		temp_path(path, "test.qoip");
+		fh = fopen(path, "wb");
+		fwrite(data, 1, len, fh);
+		fclose(fh);
+		CHECK(qoipack_open(&pack, path), "%s", path);
+		decoded = qoipack_decode(&pack, qoipack_find(&pack, "dir/c.qoi"), &out, 0, NULL);
+		CHECK(decoded && out.channels == descs[2].channels && memcmp(decoded, pixels[2], descs[2].width * descs[2].height * descs[2].channels) == 0, "%s", path);
+		free(decoded);
+		qoipack_close(&pack);
+		unlink(path);
+	}
+	#endif
+
+	// A stream with a broken header is rejected: the magic, a zero width or
+	// height, too many pixels, bad channels and a bad colorspace
+	{
+		static const unsigned int broken[][2] = {
+			{0, 0x716f6978}, {4, 0}, {8, 0}, {4, 0x80000000u}, {12, 0x02000000}, {12, 0x05000000}, {12, 0x04020000}
+		};
+		unsigned char *header = (unsigned char *)streams[1];
+		unsigned char saved[QOI_HEADER_SIZE];
+
+		memcpy(saved, header, QOI_HEADER_SIZE);
+		for (i = 0; i < (int)(sizeof(broken) / sizeof(broken[0])); i++) {
+			int p = broken[i][0];
+			unsigned int v = broken[i][1];
+			header[p] = v >> 24;
+			header[p + 1] = v >> 16;
+			if (p < 12) {
+				header[p + 2] = v >> 8;
+				header[p + 3] = v;
+			}
+			CHECK(qoipack_build(names, (const void *const *)streams, sizes, PACK_COUNT, &len, NULL) == NULL, "header bytes %d set to %08x", p, v);
+			memcpy(header, saved, QOI_HEADER_SIZE);
+		}
+	}
+
+	qoi_free(data, NULL);
+	for (i = 0; i < PACK_COUNT; i++) {
+		free(streams[i]);
+		free(pixels[i]);
+	}
+}
+
+
+// -----------------------------------------------------------------------------
+// qoipack_encode_tiles() and qoipack_decode_region(); the image size is not a
+// multiple of the tile size, so the last row and column of tiles are smaller
+
+static void test_tiles(void) {
+	static const int regions[][4] = {{0, 0, 97, 61}, {0, 0, 1, 1}, {96, 60, 1, 1}, {15, 9, 2, 2}, {20, 7, 60, 50}};
+	int w = 97, h = 61, channels, r, y, len, threads;
+
+	for (channels = 3; channels <= 4; channels++) {
+		qoi_desc desc = {w, h, channels, QOI_SRGB};
+		unsigned char *pixels = make_image(PATTERN_MIXED, w, h, channels);
+		unsigned char *data;
+		qoipack pack;
+
+		for (threads = 1; threads <= 3; threads += 2) {
+			data = qoipack_encode_tiles(pixels, &desc, 16, 10, threads, &len, NULL);
+			CHECK(data && qoipack_open_memory(&pack, data, len), "x%d, %d threads", channels, threads);
+			CHECK(pack.type == QOIPACK_TYPE_TILES && pack.tiles_x == 7 && pack.tiles_y == 7, "x%d, %d threads", channels, threads);
+			CHECK(qoipack_tile_index(&pack, 7, 0) == -1, "tile out of range");
+
+			for (r = 0; r < (int)(sizeof(regions) / sizeof(regions[0])); r++) {
+				int rx = regions[r][0], ry = regions[r][1], rw = regions[r][2], rh = regions[r][3];
+				unsigned char *region = malloc(rw * rh * channels);
+				int same = 1;
+
+				CHECK(qoipack_decode_region(&pack, rx, ry, rw, rh, region, channels, threads), "region %d", r);
+				for (y = 0; y < rh; y++) {
+					same &= memcmp(region + y * rw * channels, pixels + ((ry + y) * w + rx) * channels, rw * channels) == 0;
+				}
+				CHECK(same, "x%d, region %d,%d %dx%d", channels, rx, ry, rw, rh);
+				free(region);
+			}
+			CHECK(!qoipack_decode_region(&pack, 90, 0, 8, 1, pixels, channels, threads), "region outside the image");
+			CHECK(!qoipack_decode_region(&pack, 1, 0, 0x7fffffff, 1, pixels, channels, threads), "region width overflows");
+			CHECK(!qoipack_decode_region(&pack, 0, 1, 1, 0x7fffffff, pixels, channels, threads), "region height overflows");
+			qoipack_close(&pack);
+			qoi_free(data, NULL);
+		}
+		free(pixels);
+	}
+
+	// Sizes whose tile count does not fit are rejected before the pixels are read
+	{
+		qoi_desc huge = {0x80000000u, 1, 4, QOI_SRGB};
+		unsigned char dummy[4] = {0};
+		CHECK(qoipack_encode_tiles(dummy, &huge, 64, 64, 1, &len, NULL) == NULL, "width above 2^31 - 1");
+		huge.width = huge.height = 0x7fffffffu;
+		CHECK(qoipack_encode_tiles(dummy, &huge, 1, 1, 1, &len, NULL) == NULL, "too many tiles");
+	}
+}
+
+
+// -----------------------------------------------------------------------------
+// qoi_encode_pyramid(); level 0 is the image, and every other level is the 2x2
+// box filter of the level above, with the last row or column paired with
+// itself when that level is 1 pixel high or wide
+
+static void test_pyramid(void) {
+	static const int level_sizes[][2] = {{37, 20}, {18, 10}, {9, 5}, {4, 2}, {2, 1}, {1, 1}};
+	int w = 37, h = 20, channels, len, level, x, y, c;
+
+	for (channels = 3; channels <= 4; channels++) {
+		qoi_desc desc = {w, h, channels, QOI_SRGB}, out;
+		unsigned char *pixels = make_image(PATTERN_NOISE, w, h, channels);
+		unsigned char *data = qoi_encode_pyramid(pixels, &desc, 0, &len, NULL);
+		unsigned char *prev = NULL;
+		qoipack pack;
+
+		CHECK(data && qoipack_open_memory(&pack, data, len), "x%d", channels);
+		CHECK(pack.type == QOIPACK_TYPE_PYRAMID && pack.count == 6, "x%d: %d levels", channels, pack.count);
+		CHECK(pack.desc.width == (unsigned int)w && pack.desc.height == (unsigned int)h && pack.desc.channels == channels, "x%d", channels);
+
+		for (level = 0; level < 6 && level < pack.count; level++) {
+			int lw = level_sizes[level][0], lh = level_sizes[level][1], same = 1;
+			unsigned char *decoded = qoipack_decode(&pack, level, &out, channels, NULL);
+
+			CHECK(decoded && (int)out.width == lw && (int)out.height == lh, "x%d level %d", channels, level);
+			if (!decoded) {
+				break;
+			}
+			if (level == 0) {
+				same = memcmp(decoded, pixels, w * h * channels) == 0;
+			}
+			for (y = 0; level > 0 && y < lh; y++) {
+				int pw = level_sizes[level - 1][0], ph = level_sizes[level - 1][1];
+				int y0 = y * 2, y1 = y * 2 + 1 < ph ? y * 2 + 1 : y * 2;
+				for (x = 0; x < lw; x++) {
+					int x0 = x * 2, x1 = x * 2 + 1 < pw ? x * 2 + 1 : x * 2;
+					for (c = 0; c < channels; c++) {
+						int sum = prev[(y0 * pw + x0) * channels + c] + prev[(y0 * pw + x1) * channels + c] +
+							prev[(y1 * pw + x0) * channels + c] + prev[(y1 * pw + x1) * channels + c];
+						same &= decoded[(y * lw + x) * channels + c] == (sum + 2) >> 2;
+					}
+				}
+			}
+			CHECK(same, "x%d level %d", channels, level);
+			free(prev);
+			prev = decoded;
+		}
+		free(prev);
+		qoipack_close(&pack);
+		qoi_free(data, NULL);
+
+		data = qoi_encode_pyramid(pixels, &desc, 3, &len, NULL);
+		CHECK(data && qoipack_open_memory(&pack, data, len) && pack.count == 3, "x%d, 3 levels", channels);
+		qoipack_close(&pack);
+		qoi_free(data, NULL);
+		free(pixels);
+	}
+}
+
+
+// -----------------------------------------------------------------------------
+// qoi_encode_cached(); hits must return the bytes of qoi_encode(), and any
+// change of the pixels or the description must miss
+
+static void test_encode_cache(void) {
+	int w = 40, h = 30, len, cached_len, i;
+	qoi_desc desc = {w, h, 4, QOI_SRGB}, swapped = {h, w, 4, QOI_SRGB};
+	unsigned char *pixels = make_image(PATTERN_MIXED, w, h, 4);
+	unsigned char *encoded = qoi_encode(pixels, &desc, &len);
+	unsigned char first = pixels[0];
+	qoi_encode_cache cache;
+	const void *cached;
+
+	CHECK(qoi_encode_cache_init(&cache, 1 << 20, NULL, NULL), "init");
+	cached = qoi_encode_cached(&cache, pixels, &desc, &cached_len);
+	CHECK(cached && cached_len == len && memcmp(cached, encoded, len) == 0, "first encode");
+	cached = qoi_encode_cached(&cache, pixels, &desc, &cached_len);
+	CHECK(cached && cached_len == len && memcmp(cached, encoded, len) == 0, "second encode");
+	CHECK(cache.hits == 1 && cache.misses == 1, "%llu hits, %llu misses", cache.hits, cache.misses);
+
+	cached = qoi_encode_cached(&cache, pixels, &swapped, &cached_len);
+	CHECK(cache.misses == 2, "same bytes, different size");
+	pixels[w * h * 2] ^= 1;
+	cached = qoi_encode_cached(&cache, pixels, &desc, &cached_len);
+	CHECK(cache.misses == 3, "one changed byte");
+	pixels[w * h * 2] ^= 1;
+	cached = qoi_encode_cached(&cache, pixels, &desc, &cached_len);
+	CHECK(cache.hits == 2 && cached_len == len && memcmp(cached, encoded, len) == 0, "back to the original");
+	qoi_encode_cache_free(&cache);
+
+	// A budget for about one image evicts the older ones
+	CHECK(qoi_encode_cache_init(&cache, len + len / 2, NULL, NULL), "init");
+	for (i = 0; i < 4; i++) {
+		pixels[0] = first + i + 1;
+		CHECK(qoi_encode_cached(&cache, pixels, &desc, &cached_len) != NULL, "image %d", i);
+	}
+	CHECK(cache.misses == 4 && cache.evictions >= 2, "%llu evictions", cache.evictions);
+	qoi_encode_cached(&cache, pixels, &desc, &cached_len);
+	CHECK(cache.hits == 1, "newest image evicted");
+	qoi_encode_cache_free(&cache);
+	pixels[0] = first;
+
+	#ifdef QOI_POSIX
+	{
+		// The disk tier outlives the cache
+		char dir[TEMP_PATH_SIZE];
+
+		temp_path(dir, "encode");
+		mkdir(dir, 0755);
+		for (i = 0; i < 2; i++) {
+			CHECK(qoi_encode_cache_init(&cache, 1 << 20, dir, NULL), "init with %s", dir);
+			cached = qoi_encode_cached(&cache, pixels, &desc, &cached_len);
+			CHECK(cached && cached_len == len && memcmp(cached, encoded, len) == 0, "disk tier, pass %d", i);
+			CHECK(cache.disk_hits == (unsigned long long)i && cache.misses == (unsigned long long)(1 - i), "disk tier, pass %d", i);
+			qoi_encode_cache_free(&cache);
+		}
+
+		// A damaged file in the disk tier is encoded again, not returned
+		{
+			char file[512] = "";
+			struct dirent *de;
+			DIR *dh = opendir(dir);
+			unsigned char *other;
+			int other_len, damage;
+
+			while ((de = readdir(dh)) != NULL) {
+				if (strstr(de->d_name, ".qoi")) {
+					snprintf(file, sizeof(file), "%s/%s", dir, de->d_name);
+				}
+			}
+			closedir(dh);
+
+			pixels[w * h] ^= 0x80;
+			other = qoi_encode(pixels, &desc, &other_len);
+			pixels[w * h] ^= 0x80;
+
+			for (damage = 0; damage < 3; damage++) {
+				FILE *fh = fopen(file, "wb");
+				if (damage == 0) {
+					fwrite(encoded, 1, 10, fh);
+				}
+				else if (damage == 1) {
+					fwrite(encoded, 1, len - 9, fh);
+				}
+				else {
+					fwrite(other, 1, other_len, fh);
+				}
+				fclose(fh);
+
+				CHECK(qoi_encode_cache_init(&cache, 1 << 20, dir, NULL), "init with %s", dir);
+				cached = qoi_encode_cached(&cache, pixels, &desc, &cached_len);
+				CHECK(cached && cached_len == len && memcmp(cached, encoded, len) == 0, "damage %d", damage);
+				CHECK(cache.disk_hits == 0 && cache.misses == 1, "damage %d", damage);
+				qoi_encode_cache_free(&cache);
+			}
+			free(other);
+		}
+		CHECK(clear_dir(dir, ".qoi") == 0, "temporary files left behind");
+		rmdir(dir);
+	}
+	#endif
+
+	free(encoded);
+	free(pixels);
+}
+
+
+#ifdef QOI_POSIX
+
+// -----------------------------------------------------------------------------
+// qoi_read_cached(); a file rewritten with the same size within the same
+// second must not be served from the cache
+
+static void test_read_cache(void) {
+	int w = 33, h = 17, i;
+	qoi_desc desc = {w, h, 4, QOI_SRGB};
+	unsigned char *pixels = make_image(PATTERN_NOISE, w, h, 4);
+	const qoi_cached_image *a, *b, *c;
+	unsigned long long hits, misses;
+	qoi_read_cache cache;
+	char path[TEMP_PATH_SIZE];
+
+	temp_path(path, "read.qoi");
+	CHECK(qoi_read_cache_init(&cache, 1 << 20, NULL), "init");
+	qoi_write(path, pixels, &desc);
+
+	a = qoi_read_cached(&cache, path, 4);
+	b = qoi_read_cached(&cache, path, 4);
+	CHECK(a && a == b, "second read");
+	CHECK(a && a->size == (size_t)w * h * 4 && memcmp(a->pixels, pixels, w * h * 4) == 0, "pixels");
+	c = qoi_read_cached(&cache, path, 3);
+	CHECK(c && c != a && c->size == (size_t)w * h * 3, "other channels");
+	qoi_read_cache_stats(&cache, &hits, &misses, NULL);
+	CHECK(hits == 1 && misses == 2, "%llu hits, %llu misses", hits, misses);
+	qoi_read_cache_release(&cache, c);
+
+	// Still holding a and b; a rewrite must not touch their pixels
+	for (i = 0; i < w * h * 4; i++) {
+		pixels[i] = ~pixels[i];
+	}
+	qoi_write(path, pixels, &desc);
+	c = qoi_read_cached(&cache, path, 4);
+	CHECK(c && c != a && memcmp(c->pixels, pixels, w * h * 4) == 0, "rewritten file");
+	CHECK(a && a->pixels != c->pixels && ((const unsigned char *)a->pixels)[0] == (unsigned char)~pixels[0], "held image");
+	qoi_read_cache_stats(&cache, &hits, &misses, NULL);
+	CHECK(hits == 1 && misses == 3, "%llu hits, %llu misses", hits, misses);
+
+	qoi_read_cache_release(&cache, a);
+	qoi_read_cache_release(&cache, b);
+	qoi_read_cache_release(&cache, c);
+
+	unlink(path);
+	CHECK(qoi_read_cached(&cache, path, 4) == NULL, "deleted file");
+	qoi_read_cache_free(&cache);
+	free(pixels);
+}
+
+
+
+// -----------------------------------------------------------------------------
+// qoi_disk_cache_load(); the first load decodes and stores, later loads map the
+// stored file. Several threads storing the same image at once must not trip
+// over each other's temporary files.
+
+#define DISK_CACHE_SIZE 256
+
+typedef struct {
+	qoi_disk_cache *cache;
+	const void *encoded;
+	int len;
+	const unsigned char *pixels;
+	int failed;
+} disk_cache_job;
+
+static void *disk_cache_worker(void *arg) {
+	disk_cache_job *job = (disk_cache_job *)arg;
+	qoi_mapped_image image;
+	int i;
+
+	for (i = 0; i < 20; i++) {
+		if (!qoi_disk_cache_load(job->cache, job->encoded, job->len, 4, &image)) {
+			job->failed++;
+			continue;
+		}
+		job->failed += memcmp(image.pixels, job->pixels, DISK_CACHE_SIZE * DISK_CACHE_SIZE * 4) != 0;
+		qoi_disk_cache_release(&image);
+
+		// Make the threads store the image again
+		if (i % 4 == 0) {
+			clear_dir(job->cache->dir, ".raw");
+		}
+	}
+	return NULL;
+}
+
+static void test_disk_cache(void) {
+	int w = 64, h = 48, len, flags, i;
+	qoi_desc desc = {w, h, 4, QOI_SRGB};
+	unsigned char *pixels = make_image(PATTERN_MIXED, w, h, 4);
+	unsigned char *encoded = qoi_encode(pixels, &desc, &len);
+	char path[TEMP_PATH_SIZE], dir[TEMP_PATH_SIZE];
+	qoi_mapped_image image;
+	qoi_disk_cache cache;
+
+	temp_path(path, "disk.qoi");
+	temp_path(dir, "disk");
+	qoi_write(path, pixels, &desc);
+
+	for (flags = 0; flags <= QOI_DISK_CACHE_VERIFY; flags++) {
+		mkdir(dir, 0755);
+		CHECK(qoi_disk_cache_init(&cache, dir, 1 << 20, flags, NULL), "init");
+		for (i = 0; i < 2; i++) {
+			CHECK(qoi_disk_cache_load(&cache, encoded, len, 4, &image), "load %d", i);
+			CHECK(image.size == (size_t)w * h * 4 && memcmp(image.pixels, pixels, image.size) == 0, "load %d", i);
+			CHECK((image.map != NULL) == (i == 1), "load %d, flags %d: mapped %d", i, flags, image.map != NULL);
+			qoi_disk_cache_release(&image);
+		}
+		CHECK(qoi_disk_cache_read(&cache, path, 3, &image), "read");
+		CHECK(image.size == (size_t)w * h * 3 && image.map == NULL, "other channels");
+		qoi_disk_cache_release(&image);
+		CHECK(qoi_disk_cache_read(&cache, path, 3, &image) && image.map != NULL, "read again");
+		qoi_disk_cache_release(&image);
+		qoi_disk_cache_free(&cache);
+		remove_dir("disk");
+	}
+
+	{
+		qoi_desc large_desc = {DISK_CACHE_SIZE, DISK_CACHE_SIZE, 4, QOI_SRGB};
+		unsigned char *large = make_image(PATTERN_NOISE, DISK_CACHE_SIZE, DISK_CACHE_SIZE, 4);
+		unsigned char *large_encoded = qoi_encode(large, &large_desc, &len);
+		pthread_t threads[4];
+		disk_cache_job jobs[4];
+
+		mkdir(dir, 0755);
+		CHECK(qoi_disk_cache_init(&cache, dir, 1 << 30, QOI_DISK_CACHE_VERIFY, NULL), "init");
+		for (i = 0; i < 4; i++) {
+			disk_cache_job job = {&cache, large_encoded, len, large, 0};
+			jobs[i] = job;
+			pthread_create(&threads[i], NULL, disk_cache_worker, &jobs[i]);
+		}
+		for (i = 0; i < 4; i++) {
+			pthread_join(threads[i], NULL);
+			CHECK(jobs[i].failed == 0, "thread %d: %d failed loads", i, jobs[i].failed);
+		}
+		CHECK(clear_dir(dir, ".raw") == 0, "temporary files left behind");
+		qoi_disk_cache_free(&cache);
+		rmdir(dir);
+		free(large_encoded);
+		free(large);
+	}
+
+	unlink(path);
+	free(encoded);
+	free(pixels);
+}
+
+
+// -----------------------------------------------------------------------------
+// qoi_read_batch(); every index gets exactly one callback, with NULL for a
+// missing, a truncated and an empty file, also with more threads than files
+
+#define BATCH_COUNT 9
+#define BATCH_MISSING 2
+#define BATCH_TRUNCATED 5
+#define BATCH_EMPTY 8
+
+typedef struct {
+	pthread_mutex_t lock;
+	unsigned char *pixels[BATCH_COUNT];
+	int calls[BATCH_COUNT];
+	int same[BATCH_COUNT];
+} batch_result;
+
+static void batch_callback(void *user, int index, void *pixels, const qoi_desc *desc) {
+	batch_result *result = (batch_result *)user;
+	int same = 0;
+
+	if (pixels) {
+		same = desc && desc->width == 20 + (unsigned int)index && desc->height == 11 &&
+			memcmp(pixels, result->pixels[index], desc->width * desc->height * 4) == 0;
+	}
+	else {
+		same = desc == NULL && (index == BATCH_MISSING || index == BATCH_TRUNCATED || index == BATCH_EMPTY);
+	}
+	qoi_free(pixels, NULL);
+
+	pthread_mutex_lock(&result->lock);
+	result->calls[index]++;
+	result->same[index] = same;
+	pthread_mutex_unlock(&result->lock);
+}
+
+static void test_read_batch(void) {
+	static const int thread_counts[] = {1, 3, 0, 64};
+	char paths[BATCH_COUNT][TEMP_PATH_SIZE];
+	const char *path_list[BATCH_COUNT];
+	batch_result result;
+	int t, i, len, decoded;
+
+	pthread_mutex_init(&result.lock, NULL);
+	for (i = 0; i < BATCH_COUNT; i++) {
+		char name[16];
+		qoi_desc desc = {20 + i, 11, 4, QOI_SRGB};
+		void *encoded;
+		FILE *fh;
+
+		snprintf(name, sizeof(name), "batch%d.qoi", i);
+		temp_path(paths[i], name);
+		path_list[i] = paths[i];
+		result.pixels[i] = make_image(i % PATTERN_COUNT, desc.width, desc.height, 4);
+		if (i == BATCH_MISSING) {
+			continue;
+		}
+
+		encoded = qoi_encode(result.pixels[i], &desc, &len);
+		fh = fopen(paths[i], "wb");
+		CHECK(fh != NULL, "%s", paths[i]);
+		if (i == BATCH_TRUNCATED) {
+			len = QOI_HEADER_SIZE + 4;
+		}
+		if (i == BATCH_EMPTY) {
+			len = 0;
+		}
+		fwrite(encoded, 1, len, fh);
+		fclose(fh);
+		free(encoded);
+	}
+
+	for (t = 0; t < (int)(sizeof(thread_counts) / sizeof(thread_counts[0])); t++) {
+		memset(result.calls, 0, sizeof(result.calls));
+		memset(result.same, 0, sizeof(result.same));
+		decoded = qoi_read_batch(path_list, BATCH_COUNT, 4, thread_counts[t], batch_callback, &result, NULL);
+		CHECK(decoded == BATCH_COUNT - 3, "%d threads: %d decoded", thread_counts[t], decoded);
+		for (i = 0; i < BATCH_COUNT; i++) {
+			CHECK(result.calls[i] == 1, "%d threads: %d callbacks for %d", thread_counts[t], result.calls[i], i);
+			CHECK(result.same[i], "%d threads: file %d", thread_counts[t], i);
+		}
+	}
+	CHECK(qoi_read_batch(path_list, 0, 4, 1, batch_callback, &result, NULL) == 0, "no files");
+
+	for (i = 0; i < BATCH_COUNT; i++) {
+		unlink(paths[i]);
+		free(result.pixels[i]);
+	}
+	pthread_mutex_destroy(&result.lock);
+}
+
+#endif /* QOI_POSIX */
+
+
+int main(void) {
+	test_roundtrip();
+	test_invalid();
+	test_chunks();
+	test_allocator();
+	test_frame();
+	test_crop();
+	test_compare();
+	test_checksum();
+	test_analyze();
+
+#ifdef QOI_POSIX
+	if (!mkdtemp(temp_dir)) {
+		printf("Couldn't create %s\n", temp_dir);
+		return 1;
+	}
+	test_write_fd();
+	test_append_rows();
+#endif
+
+	test_pack();
+	test_tiles();
+	test_pyramid();
+	test_encode_cache();
+
+#ifdef QOI_POSIX
+	test_read_cache();
+	test_disk_cache();
+	test_read_batch();
+#endif
+
+#ifdef QOI_POSIX
+	rmdir(temp_dir);
+#endif
+
+	printf("%d checks, %d failed\n", checks_run, checks_failed);
+	return checks_failed ? 1 : 0;
+}